@@ -0,0 +1,166 @@
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+// Built-in devices
+
+struct Uart : MSP430::Device {
+    uint16_t read(MSP430& msp, uint16_t) override {
+        if (not msp.uart_read)
+            throw Error("UART input not connected");
+        return uint8_t(msp.uart_read());
+    }
+
+    void write(MSP430& msp, uint16_t, uint16_t value) override {
+        if (not msp.uart_print)
+            throw Error("UART output not connected");
+        msp.uart_print(value);
+    }
+};
+
+// Lets guests poll instead of waiting in uart_read or uart_print. Writes are
+// ignored.
+struct UartStatus : MSP430::Device {
+    uint16_t read(MSP430& msp, uint16_t) override {
+        if (msp.uart_status)
+            return msp.uart_status();
+        return (msp.uart_read ? MSP430::UART_RX_READY : 0) | (msp.uart_print ? MSP430::UART_TX_READY : 0);
+    }
+
+    void write(MSP430&, uint16_t, uint16_t) override {
+    }
+};
+
+// Microseconds since the last write, on the virtual clock while timing.
+// Reading the low word latches the high word so a low then high read pair is
+// consistent.
+// State is in MSP430::timer.
+struct Timer : MSP430::Device {
+    static uint64_t host_microseconds() {
+        auto since = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(since).count();
+    }
+
+    static uint64_t now(const MSP430& msp) {
+        if (msp.timing)
+            return msp.virtual_microseconds();
+        return host_microseconds() - msp.timer.start;
+    }
+
+    uint16_t read(MSP430& msp, uint16_t address) override {
+        if (address != MSP430::MMIO_TIMER)
+            return msp.timer.high;
+
+        auto us = uint32_t(now(msp) - msp.timer.epoch);
+        msp.timer.high = us >> 16;
+        return uint16_t(us);
+    }
+
+    void write(MSP430& msp, uint16_t, uint16_t) override {
+        msp.timer.epoch = now(msp);
+        msp.timer.high = 0;
+    }
+};
+
+struct Exit : MSP430::Device {
+    uint16_t read(MSP430&, uint16_t) override {
+        return 0;
+    }
+
+    bool steady(const MSP430&, uint16_t) const override {
+        return true;
+    }
+
+    void write(MSP430& msp, uint16_t, uint16_t) override {
+        // Engines finish the instruction and return
+        msp.stop_requested |= MSP430::stop_exit;
+    }
+};
+
+// Shared by every instance and owned by none, so making one, pooled ones in
+// particular, allocates nothing for its devices
+static UartStatus uart_status_device;
+static Uart uart_device;
+static Timer timer_device;
+static Exit exit_device;
+
+static void
+attach_default_devices(MSP430& msp)
+{
+    auto map = [&](uint16_t address, uint16_t size, MSP430::Device& device) {
+        std::fill_n(&msp.mmio[address - MSP430::MMIO_BASE], size, &device);
+    };
+    map(MSP430::MMIO_UART_STATUS, 2, uart_status_device);
+    map(MSP430::MMIO_UART, 2, uart_device);
+    map(MSP430::MMIO_TIMER, 4, timer_device);
+    map(MSP430::MMIO_EXIT, 2, exit_device);
+    msp.restart_timer();
+}
+
+void MSP430::restart_timer()
+{
+    timer = {};
+    timer.start = Timer::host_microseconds();
+}
+
+MSP430::MSP430()
+{
+    attach_default_devices(*this);
+}
+
+MSP430::MSP430(RamPool& pool, unsigned partition)
+    : ram(pool.take(partition), RamDeleter{&pool})
+{
+    ram->fill(0);
+    attach_default_devices(*this);
+}
+
+// Device table
+
+// Drops devices no longer mapped anywhere
+static void
+release_unmapped(MSP430& msp)
+{
+    std::erase_if(msp.devices, [&](auto& device) {
+        return std::find(msp.mmio.begin(), msp.mmio.end(), device.get()) == msp.mmio.end();
+    });
+}
+
+void MSP430::attach_device(uint16_t address, uint16_t size, std::shared_ptr<Device> device)
+{
+    if (address < MMIO_BASE || size > RAM_SIZE - address)
+        throw Error("Device outside of MMIO window");
+
+    for (size_t i=0; i<size; i++)
+        mmio[address - MMIO_BASE + i] = device.get();
+    if (std::find(devices.begin(), devices.end(), device) == devices.end())
+        devices.push_back(std::move(device));
+    release_unmapped(*this);
+}
+
+void MSP430::detach_device(uint16_t address, uint16_t size)
+{
+    if (address < MMIO_BASE || size > RAM_SIZE - address)
+        throw Error("Device outside of MMIO window");
+
+    for (size_t i=0; i<size; i++)
+        mmio[address - MMIO_BASE + i] = nullptr;
+    release_unmapped(*this);
+}
+
+uint16_t
+unmapped_read(MSP430& msp, uint16_t)
+{
+    if (msp.unmapped_policy == MSP430::UnmappedPolicy::ignore)
+        return 0;
+    throw Error("Read from unknown MMIO device");
+}
+
+void
+unmapped_write(MSP430& msp, uint16_t, uint16_t)
+{
+    if (msp.unmapped_policy == MSP430::UnmappedPolicy::ignore)
+        return;
+    throw Error("Write to unknown MMIO device");
+}
@@ -0,0 +1,121 @@
+#include "fleet.hpp"
+#include "lockstep.hpp"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Work stealing
+//
+// Jobs are dealt round robin to per-thread queues up front. Threads take
+// from the back of their own queue and, once it is empty, steal from the
+// front of the others. Jobs are whole simulations so contention on the
+// queue locks is negligible. Nothing is queued after start, so a thread
+// that finds every queue empty is done.
+
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+
+    std::optional<size_t> pop_back() {
+        std::lock_guard guard(lock);
+        if (jobs.empty())
+            return {};
+        auto job = jobs.back();
+        jobs.pop_back();
+        return job;
+    }
+
+    std::optional<size_t> pop_front() {
+        std::lock_guard guard(lock);
+        if (jobs.empty())
+            return {};
+        auto job = jobs.front();
+        jobs.pop_front();
+        return job;
+    }
+};
+
+static std::optional<size_t>
+next_job(std::vector<WorkQueue>& queues, unsigned self)
+{
+    if (auto job = queues[self].pop_back())
+        return job;
+
+    for (unsigned i=1; i<queues.size(); i++) {
+        if (auto job = queues[(self + i) % queues.size()].pop_front())
+            return job;
+    }
+    return {};
+}
+
+void
+connect_job(MSP430& msp, FleetJob& job)
+{
+    job.output.clear();
+    msp.uart_print = [&job](char c) { job.output += c; };
+    msp.uart_read = [&job, position = size_t(0)]() mutable {
+        return position < job.input.size() ? job.input[position++] : char(-1);
+    };
+}
+
+// Reuses the thread's instance, so loading the image copies back only the
+// pages the last job wrote and keeps the code decoded or compiled elsewhere
+static void
+run_job(const std::shared_ptr<const MSP430::Image>& image, FleetJob& job, const FleetOptions& options, MSP430& msp)
+{
+    msp.engine = options.engine;
+    msp.load(image);
+    msp.restart_timer();
+    connect_job(msp, job);
+    job.result = msp.run(options.max_instructions);
+}
+
+void
+run_fleet(std::shared_ptr<const MSP430::Image> image, std::span<FleetJob> jobs, const FleetOptions& options)
+{
+    // Queued by group in lockstep, otherwise each job alone
+    size_t group = options.lockstep ? LOCKSTEP_LANES : 1;
+    size_t groups = (jobs.size() + group - 1) / group;
+
+    unsigned threads = options.threads;
+    if (threads == 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(groups, 1));
+
+    // Each thread holds one instance at a time, or one group, from the
+    // partition numbered as the thread
+    MSP430::RamPool ram_pool(threads * group, threads);
+
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i=0; i<groups; i++)
+        queues[i % threads].jobs.push_back(i);
+
+    auto worker = [&](unsigned self) {
+        std::unique_ptr<Lockstep> lockstep;
+        std::unique_ptr<MSP430> msp;
+        if (options.lockstep)
+            lockstep = std::make_unique<Lockstep>(image, ram_pool, self);
+        else
+            msp = std::make_unique<MSP430>(ram_pool, self);
+
+        while (auto i = next_job(queues, self)) {
+            if (lockstep) {
+                auto first = *i * group;
+                lockstep->run(jobs.subspan(first, std::min(group, jobs.size() - first)), options.max_instructions);
+            } else {
+                run_job(image, jobs[*i], options, *msp);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i=1; i<threads; i++)
+        pool.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : pool)
+        thread.join();
+}
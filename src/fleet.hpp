@@ -0,0 +1,27 @@
+#pragma once
+// Runs many independent instances of one program across all cores
+
+#include "msp430.hpp"
+
+#include <span>
+#include <string>
+
+struct FleetJob {
+    std::string input;              // UART input, reads past the end give 0xff
+    std::string output;             // UART output
+    MSP430::RunResult result;
+};
+
+struct FleetOptions {
+    unsigned threads = 0;           // 0 for one per core
+    size_t max_instructions = SIZE_MAX;
+    MSP430::Engine engine = MSP430::Engine::cached;
+    bool lockstep = false;          // Step jobs in groups sharing vector registers, see lockstep.hpp
+};
+
+// Points the UART of msp at job's input and output
+void connect_job(MSP430& msp, FleetJob& job);
+
+// Runs every job on an instance loaded from image, with its protection. Jobs
+// are spread over a work stealing thread pool, returns once all have finished.
+void run_fleet(std::shared_ptr<const MSP430::Image> image, std::span<FleetJob> jobs, const FleetOptions& options);
@@ -0,0 +1,168 @@
+#include "fuzz.hpp"
+
+#include <string.h>
+
+// Hit counts are compared in power of two buckets, as in AFL, so loops
+// running a few more times are not new coverage but new orders are.
+
+static constexpr uint8_t
+bucket_of(unsigned count)
+{
+    if (count <= 2)     return count;
+    if (count == 3)     return 4;
+    if (count <= 7)     return 8;
+    if (count <= 15)    return 16;
+    if (count <= 31)    return 32;
+    if (count <= 127)   return 64;
+    return 128;
+}
+
+static constexpr auto BUCKETS = [] {
+    std::array<uint8_t, 256> buckets{};
+    for (unsigned count=0; count<256; count++)
+        buckets[count] = bucket_of(count);
+    return buckets;
+}();
+
+static constexpr uint8_t INTERESTING[] = {
+    0x00, 0x01, 0x7f, 0x80, 0xff, '\n', ' ', '0', '9', 'A', 'z',
+};
+
+Fuzzer::Fuzzer(std::shared_ptr<const MSP430::Image> image, const FuzzOptions& options)
+    : image(std::move(image)), options(options), rng(options.seed),
+      trace(MSP430::COVERAGE_SIZE), seen(MSP430::COVERAGE_SIZE)
+{
+    msp.engine = options.engine;
+    msp.coverage = trace.data();
+    msp.uart_print = [](char) {};
+    msp.uart_read = [this] {
+        return position < input.size() ? input[position++] : char(-1);
+    };
+}
+
+bool
+Fuzzer::execute(const std::string& data, const FuzzCrash*& new_crash)
+{
+    input = data;
+    position = 0;
+    memset(trace.data(), 0, trace.size());
+
+    // Loaded rather than restored, which also applies the image's protection
+    msp.load(image);
+    auto result = msp.run(options.max_instructions);
+    executions++;
+    new_crash = nullptr;
+
+    using enum MSP430::StopReason;
+    switch (result.reason) {
+        case budget:
+            hangs++;
+            return false;
+        case illegal:
+        case misaligned:
+        case fault: {
+            auto pc = result.pc;
+            auto [it, inserted] = crashes.try_emplace(pc, FuzzCrash{ pc, std::move(result), data });
+            if (inserted)
+                new_crash = &it->second;
+            return false;
+        }
+        default:
+            break;
+    }
+
+    // Most of the map is untouched, skip it a word at a time
+    bool interesting = false;
+    for (size_t i=0; i<trace.size(); i+=8) {
+        uint64_t word;
+        memcpy(&word, &trace[i], 8);
+        if (word == 0)
+            continue;
+
+        for (size_t j=i; j<i+8; j++) {
+            auto bucket = BUCKETS[trace[j]];
+            if (bucket & ~seen[j]) {
+                edges += seen[j] == 0;
+                seen[j] |= bucket;
+                interesting = true;
+            }
+        }
+    }
+    return interesting;
+}
+
+bool
+Fuzzer::add_seed(std::string seed)
+{
+    if (seed.size() > options.max_input)
+        seed.resize(options.max_input);
+
+    const FuzzCrash* crash;
+    if (not execute(seed, crash))
+        return false;
+    corpus.push_back(std::move(seed));
+    return true;
+}
+
+std::string
+Fuzzer::mutate()
+{
+    auto below = [&](size_t n) { return size_t(rng() % n); };
+
+    auto data = corpus.empty() ? std::string() : corpus[below(corpus.size())];
+    auto stacked = 1 + below(8);
+
+    for (size_t i=0; i<stacked; i++) {
+        switch (below(data.empty() ? 2 : 7)) {
+            case 0: { // Insert random bytes
+                auto at = below(data.size() + 1);
+                auto n = 1 + below(16);
+                for (size_t k=0; k<n; k++)
+                    data.insert(data.begin() + at, char(rng()));
+                break;
+            }
+            case 1: { // Splice in part of another input
+                if (corpus.empty())
+                    break;
+                auto& other = corpus[below(corpus.size())];
+                if (other.empty())
+                    break;
+                auto from = below(other.size());
+                data = data.substr(0, below(data.size() + 1)) + other.substr(from);
+                break;
+            }
+            case 2:
+                data[below(data.size())] ^= 1 << below(8);
+                break;
+            case 3:
+                data[below(data.size())] = rng();
+                break;
+            case 4:
+                data[below(data.size())] = INTERESTING[below(std::size(INTERESTING))];
+                break;
+            case 5:
+                data[below(data.size())] += int(below(35)) - 17;
+                break;
+            case 6: { // Erase bytes
+                auto at = below(data.size());
+                data.erase(at, 1 + below(std::min<size_t>(16, data.size() - at)));
+                break;
+            }
+        }
+    }
+
+    if (data.size() > options.max_input)
+        data.resize(options.max_input);
+    return data;
+}
+
+const FuzzCrash*
+Fuzzer::fuzz_one()
+{
+    auto data = mutate();
+
+    const FuzzCrash* crash;
+    if (execute(data, crash))
+        corpus.push_back(std::move(data));
+    return crash;
+}
@@ -0,0 +1,56 @@
+#pragma once
+// Coverage guided fuzzing of a program's UART input
+
+#include "msp430.hpp"
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+struct FuzzOptions {
+    size_t max_instructions = 1'000'000;    // Per input, longer runs are hangs
+    size_t max_input = 4096;                // Bytes
+    uint64_t seed = 0;
+    MSP430::Engine engine = MSP430::Engine::cached;
+};
+
+struct FuzzCrash {
+    uint16_t pc;                    // Of the faulting instruction
+    MSP430::RunResult result;
+    std::string input;
+};
+
+// Runs mutated inputs on instances loaded from one image. Inputs that
+// reach new edges, or new hit count buckets of known edges, join the corpus.
+// Runs stopping with illegal, misaligned or fault are crashes, kept once per
+// PC. Reads past the end of the input give 0xff.
+struct Fuzzer {
+    Fuzzer(std::shared_ptr<const MSP430::Image> image, const FuzzOptions& options);
+    Fuzzer(const Fuzzer&) = delete; // The UART hook points at this
+
+    // Runs input as is, returns true if it was added to the corpus
+    bool add_seed(std::string input);
+
+    // Mutates and runs one corpus entry, returns a crash at a new PC
+    const FuzzCrash* fuzz_one();
+
+    std::vector<std::string> corpus;
+    std::map<uint16_t, FuzzCrash> crashes;
+    size_t executions = 0;
+    size_t hangs = 0;
+    size_t edges = 0;
+
+    // Runs input, sets new_crash if it crashed at a new PC
+    bool execute(const std::string& input, const FuzzCrash*& new_crash);
+    std::string mutate();
+
+    std::shared_ptr<const MSP430::Image> image;
+    FuzzOptions options;
+    MSP430 msp;
+    std::mt19937_64 rng;
+    std::string input;
+    size_t position = 0;            // Next UART byte of input
+    std::vector<uint8_t> trace;     // Coverage of the current run
+    std::vector<uint8_t> seen;      // Hit count buckets seen per edge
+};
@@ -0,0 +1,385 @@
+#include "gdb.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+// Instructions run between checks for an interrupt from the debugger
+static constexpr size_t BATCH = 1 << 16;
+
+static constexpr char HEX[] = "0123456789abcdef";
+
+static int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void
+put_hex8(std::string& out, uint8_t value)
+{
+    out += HEX[value >> 4];
+    out += HEX[value & 15];
+}
+
+// Little-endian value of width bytes from 2 * width hex digits
+static bool
+parse_register(const char* text, unsigned width, uint16_t& out)
+{
+    uint32_t value = 0;
+    for (unsigned i=0; i<width; i++) {
+        int high = hex_value(text[2*i]), low = hex_value(text[2*i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        value |= uint32_t(high << 4 | low) << (8 * i);
+    }
+    out = value;
+    return true;
+}
+
+struct GdbServer {
+    MSP430& msp;
+    int in, out;
+    bool ack = true;
+    bool connected = true;
+    std::string last_stop = "S05";
+
+    char buffer[4096] = {};
+    size_t buffered = 0, taken = 0;
+
+    // Transport
+
+    int get_byte() {
+        if (taken == buffered) {
+            ssize_t n;
+            do {
+                n = read(in, buffer, sizeof(buffer));
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                connected = false;
+                return -1;
+            }
+            buffered = n;
+            taken = 0;
+        }
+        return uint8_t(buffer[taken++]);
+    }
+
+    void put(const std::string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            auto n = write(out, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                connected = false;
+                return;
+            }
+            done += n;
+        }
+    }
+
+    // Next packet, or "\x03" for an interrupt. False once disconnected.
+    bool receive(std::string& packet) {
+        for (;;) {
+            int c = get_byte();
+            if (c < 0)
+                return false;
+            if (c == 0x03) {
+                packet = "\x03";
+                return true;
+            }
+            if (c != '$')
+                continue; // Acks, and noise between packets
+
+            packet.clear();
+            uint8_t sum = 0;
+            while ((c = get_byte()) >= 0 && c != '#') {
+                packet += char(c);
+                sum += c;
+            }
+            int high = hex_value(get_byte()), low = hex_value(get_byte());
+            if (not connected)
+                return false;
+
+            if (not ack)
+                return true;
+            if (high >= 0 && low >= 0 && uint8_t(high << 4 | low) == sum) {
+                put("+");
+                return true;
+            }
+            put("-");
+        }
+    }
+
+    // Sends payload, again for each nack
+    void send(const std::string& payload) {
+        std::string packet = "$" + payload + "#";
+        uint8_t sum = 0;
+        for (char c : payload)
+            sum += c;
+        put_hex8(packet, sum);
+
+        for (;;) {
+            put(packet);
+            if (not ack || not connected)
+                return;
+
+            int c;
+            while ((c = get_byte()) >= 0 && c != '+' && c != '-') {}
+            if (c != '-')
+                return;
+        }
+    }
+
+    // Takes an interrupt sent while the machine runs, without blocking
+    bool interrupted() {
+        if (taken == buffered) {
+            pollfd fd = { in, POLLIN, 0 };
+            if (poll(&fd, 1, 0) <= 0)
+                return false;
+        }
+        return get_byte() == 0x03;
+    }
+
+    // Execution
+
+    std::string stop_reply(const MSP430::RunResult& result) {
+        if (not result.message.empty())
+            fprintf(stderr, "Stopped: %s\n", result.message.c_str());
+
+        switch (result.reason) {
+            case MSP430::StopReason::budget:
+            case MSP430::StopReason::breakpoint:
+                return "S05";
+            case MSP430::StopReason::exit:
+                return "W00";
+            case MSP430::StopReason::illegal:
+                return "S04";
+            case MSP430::StopReason::misaligned:
+                return "S0a";
+            case MSP430::StopReason::watchpoint:
+                break;
+            case MSP430::StopReason::fault:
+                return "S0b";
+        }
+
+        auto [address, kind] = msp.watch_hit;
+        const char* name = msp.watchpoints[address] == MSP430::watch_access ? "awatch"
+            : kind == MSP430::watch_write ? "watch" : "rwatch";
+        char reply[32];
+        snprintf(reply, sizeof(reply), "T05%s:%x;", name, address);
+        return reply;
+    }
+
+    std::string resume(const char* args, bool step) {
+        unsigned address;
+        if (sscanf(args, "%x", &address) == 1)
+            msp.registers[MSP430::PC] = address;
+
+        if (step)
+            return stop_reply(msp.run(1));
+
+        for (;;) {
+            auto result = msp.run(BATCH);
+            if (result.reason != MSP430::StopReason::budget)
+                return stop_reply(result);
+            if (interrupted())
+                return "S02";
+            if (not connected)
+                return {};
+        }
+    }
+
+    // Registers
+
+    static constexpr unsigned REGISTER_BYTES = 4;
+
+    std::string read_registers() {
+        std::string reply;
+        for (auto value : msp.registers) {
+            for (unsigned i=0; i<REGISTER_BYTES; i++)
+                put_hex8(reply, i < 2 ? value >> (8 * i) : 0);
+        }
+        return reply;
+    }
+
+    // Also takes 16 bit registers, from the packet length
+    std::string write_registers(const char* text) {
+        auto width = strlen(text) / 32;
+        if (width != 2 && width != REGISTER_BYTES)
+            return "E01";
+
+        uint16_t values[16];
+        for (unsigned reg=0; reg<16; reg++) {
+            if (not parse_register(text + 2 * width * reg, width, values[reg]))
+                return "E01";
+        }
+        memcpy(msp.registers, values, sizeof(values));
+        return "OK";
+    }
+
+    std::string read_register(const char* args) {
+        unsigned reg;
+        if (sscanf(args, "%x", &reg) != 1 || reg >= 16)
+            return "E01";
+        std::string reply;
+        for (unsigned i=0; i<REGISTER_BYTES; i++)
+            put_hex8(reply, i < 2 ? msp.registers[reg] >> (8 * i) : 0);
+        return reply;
+    }
+
+    std::string write_register(const char* args) {
+        unsigned reg;
+        int offset = -1;
+        if (sscanf(args, "%x=%n", &reg, &offset) != 1 || offset < 0 || reg >= 16)
+            return "E01";
+        auto text = args + offset;
+        auto width = std::min<size_t>(strlen(text) / 2, REGISTER_BYTES);
+        if (width < 2 || not parse_register(text, width, msp.registers[reg]))
+            return "E01";
+        return "OK";
+    }
+
+    // Memory
+    //
+    // Accesses go to ram directly, so MMIO devices see none of them
+
+    std::string read_memory(const char* args) {
+        unsigned address, length;
+        if (sscanf(args, "%x,%x", &address, &length) != 2 || address > MSP430::RAM_SIZE || length > MSP430::RAM_SIZE - address)
+            return "E01";
+        std::string reply;
+        for (unsigned i=0; i<length; i++)
+            put_hex8(reply, (*msp.ram)[address + i]);
+        return reply;
+    }
+
+    std::string write_memory(const char* args) {
+        unsigned address, length;
+        int offset = -1;
+        if (sscanf(args, "%x,%x:%n", &address, &length, &offset) != 2 || offset < 0 || address > MSP430::RAM_SIZE || length > MSP430::RAM_SIZE - address)
+            return "E01";
+        auto text = args + offset;
+        if (strlen(text) != 2 * length)
+            return "E01";
+
+        for (unsigned i=0; i<length; i++) {
+            int high = hex_value(text[2*i]), low = hex_value(text[2*i + 1]);
+            if (high < 0 || low < 0)
+                return "E01";
+            (*msp.ram)[address + i] = high << 4 | low;
+        }
+        msp.invalidate_decode_cache();
+        return "OK";
+    }
+
+    // Breakpoints and watchpoints
+
+    std::string set_point(const char* args, bool enabled) {
+        unsigned type, address, length;
+        if (sscanf(args, "%u,%x,%x", &type, &address, &length) != 3 || address >= MSP430::RAM_SIZE)
+            return "E01";
+
+        static constexpr MSP430::Watch kinds[] = {
+            MSP430::watch_write, MSP430::watch_read, MSP430::watch_access,
+        };
+        switch (type) {
+            case 0: // Software
+            case 1: // Hardware
+                msp.set_breakpoint(address, enabled);
+                return "OK";
+            case 2 ... 4:
+                msp.set_watchpoint(address, length, kinds[type - 2], enabled);
+                return "OK";
+        }
+        return {};
+    }
+
+    // Replies to packet, empty for those not supported
+    std::string handle(const std::string& packet) {
+        auto args = packet.c_str() + 1;
+
+        switch (packet[0]) {
+            case 0x03:
+                return "S02";
+            case '?':
+                return last_stop;
+            case 'g':
+                return read_registers();
+            case 'G':
+                return write_registers(args);
+            case 'p':
+                return read_register(args);
+            case 'P':
+                return write_register(args);
+            case 'm':
+                return read_memory(args);
+            case 'M':
+                return write_memory(args);
+            case 'Z':
+                return set_point(args, true);
+            case 'z':
+                return set_point(args, false);
+            case 'c':
+                return last_stop = resume(args, false);
+            case 's':
+                return last_stop = resume(args, true);
+            case 'H':
+            case 'T':
+                return "OK";
+            case 'D':
+                connected = false;
+                return "OK";
+        }
+
+        if (packet.starts_with("qSupported"))
+            return "PacketSize=4000;QStartNoAckMode+";
+        if (packet == "QStartNoAckMode")
+            return "OK";
+        if (packet == "qAttached")
+            return "1";
+        if (packet == "qfThreadInfo")
+            return "m1";
+        if (packet == "qsThreadInfo")
+            return "l";
+        if (packet == "qC")
+            return "QC1";
+        if (packet == "qSymbol::")
+            return "OK";
+        return {};
+    }
+
+    void serve() {
+        std::string packet;
+        while (connected && receive(packet)) {
+            if (packet.empty())
+                continue;
+            if (packet[0] == 'k')
+                return;
+            if (packet.starts_with("vKill")) {
+                send("OK");
+                return;
+            }
+
+            send(handle(packet));
+            if (packet == "QStartNoAckMode")
+                ack = false;
+        }
+    }
+};
+
+void
+serve_gdb(MSP430& msp, int in, int out)
+{
+    msp.sync_flags();
+    GdbServer server{ msp, in, out };
+    server.serve();
+}
@@ -0,0 +1,14 @@
+#pragma once
+// GDB remote serial protocol stub
+//
+// Supports register and memory access, breakpoints (Z0, Z1), watchpoints
+// (Z2 write, Z3 read, Z4 access), continue and step. Breakpoints and
+// watchpoints use those of MSP430, so a continue runs on the chosen engine.
+// Registers are sent as 32 bits each, as msp430-elf-gdb expects.
+
+#include "msp430.hpp"
+
+// Serves one debugger connection, reading packets from in and writing
+// replies to out, which may be the same descriptor. Returns once the
+// debugger detaches or kills, or the connection closes.
+void serve_gdb(MSP430& msp, int in, int out);
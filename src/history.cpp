@@ -0,0 +1,142 @@
+#include "history.hpp"
+#include "msp430_impl.hpp"
+
+History::History(MSP430& msp, uint64_t interval, size_t max_undo)
+    : msp(msp), interval(interval), max_undo(max_undo)
+{
+    checkpoints.push_back({ 0, msp.snapshot() });
+    msp.history = this;
+}
+
+History::~History()
+{
+    msp.history = nullptr;
+}
+
+void History::before()
+{
+    if (open)
+        return;
+
+    auto& entry = entries.emplace_back();
+    memcpy(entry.registers, msp.registers, sizeof(entry.registers));
+    entry.flags = msp.pending_flags;
+    entry.cycles = msp.cycles;
+    entry.writes = 0;
+    open = true;
+}
+
+void History::after()
+{
+    open = false;
+    position++;
+
+    while (entries.size() > max_undo) {
+        writes.erase(writes.begin(), writes.begin() + entries.front().writes);
+        entries.pop_front();
+    }
+
+    if (position % interval != 0)
+        return;
+
+    if (checkpoints.size() == MAX_CHECKPOINTS) {
+        interval *= 2;
+        std::erase_if(checkpoints, [&](auto& c) { return c.position % interval != 0; });
+        if (position % interval != 0)
+            return;
+    }
+    checkpoints.push_back({ position, msp.snapshot() });
+}
+
+void History::write(uint16_t address)
+{
+    if (not open)
+        return;
+
+    writes.push_back({ address, (*msp.ram)[address] });
+    entries.back().writes++;
+}
+
+void
+history_write(MSP430& msp, ByteWord mode, uint16_t address)
+{
+    msp.history->write(address);
+    if (mode == Word)
+        msp.history->write(address + 1);
+}
+
+// Writes back overwritten bytes as write_ram would, without logging them
+void History::undo()
+{
+    auto& entry = entries.back();
+    for (uint32_t i=0; i<entry.writes; i++) {
+        auto [address, value] = writes.back();
+        writes.pop_back();
+
+        if (msp.decode_cache)
+            invalidate_code(msp, address);
+        msp.dirty[address / MSP430::PAGE_BYTES] = true;
+        (*msp.ram)[address] = value;
+    }
+
+    memcpy(msp.registers, entry.registers, sizeof(entry.registers));
+    msp.pending_flags = entry.flags;
+    msp.cycles = entry.cycles;
+    entries.pop_back();
+}
+
+// Runs forward to target, past exits the program made the first time and
+// past breakpoints and watchpoints
+MSP430::RunResult History::replay(uint64_t target)
+{
+    using enum MSP430::StopReason;
+    MSP430::RunResult result = { budget, 0, {} };
+    while (position < target) {
+        result = msp.run(target - position);
+        bool resumable = result.reason == budget || result.reason == exit
+            || result.reason == breakpoint || result.reason == watchpoint;
+        if (result.instructions == 0 || not resumable)
+            break;
+    }
+    return result;
+}
+
+MSP430::RunResult History::seek(uint64_t target)
+{
+    if (target > position || (target == position && not open))
+        return replay(target);
+
+    // Back to the state before a faulted instruction
+    if (open) {
+        undo();
+        open = false;
+    }
+
+    auto back = position - target;
+    if (back <= entries.size()) {
+        for (uint64_t i=0; i<back; i++)
+            undo();
+        position = target;
+        return { MSP430::StopReason::budget, 0, {} };
+    }
+
+    auto it = std::prev(std::ranges::upper_bound(checkpoints, target, {}, &Checkpoint::position));
+    msp.restore(it->snapshot);
+    position = it->position;
+    checkpoints.erase(std::next(it), checkpoints.end());
+    entries.clear();
+    writes.clear();
+    return replay(target);
+}
+
+bool History::step_back(uint64_t count)
+{
+    if (position == 0 && not open)
+        return false;
+
+    // After a fault the first step back only undoes the faulted instruction
+    if (open)
+        count--;
+    seek(position - std::min(count, position));
+    return true;
+}
@@ -0,0 +1,116 @@
+#pragma once
+// Execution history for stepping backwards, see MSP430::history
+//
+// A snapshot is checkpointed every interval instructions. Once
+// MAX_CHECKPOINTS are held the interval doubles and every other one is
+// dropped, so memory stays bounded however long the run. The last max_undo
+// instructions also keep the registers before them and the bytes they
+// overwrote. Moving back within those undoes them, further back restores the
+// checkpoint before the target and replays.
+//
+// Devices are not rewound, replays only match while they behave the same.
+// Use the timer with timing set so it follows the virtual clock.
+
+#include "msp430.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <vector>
+
+struct History {
+    static constexpr size_t MAX_CHECKPOINTS = 64;
+
+    // Attaches to msp, its current state is instruction 0
+    explicit History(MSP430& msp, uint64_t interval = 1 << 16, size_t max_undo = 1 << 16);
+    ~History(); // Detaches
+
+    History(const History&) = delete;
+
+    uint64_t position = 0; // Instructions executed since instruction 0
+
+    // Moves to the state after target instructions, running forward if it is
+    // ahead. The result is from the last run.
+    MSP430::RunResult seek(uint64_t target);
+
+    // Moves back count instructions, false if already at instruction 0
+    bool step_back(uint64_t count = 1);
+
+    // Moves back to the last position before the current one where stop
+    // returns true, checked as run_until does. Stops at instruction 0 and
+    // returns false if there is none.
+    template <typename Predicate>
+    bool reverse_until(Predicate&& stop);
+
+    // Called by run() around each instruction and by write_ram
+    void before();
+    void after();
+    void write(uint16_t address);
+
+    struct Checkpoint {
+        uint64_t position;
+        MSP430::Snapshot snapshot;
+    };
+
+    struct Entry {
+        uint16_t registers[16];
+        MSP430::PendingFlags flags;
+        uint64_t cycles;
+        uint32_t writes; // Bytes at the back of writes
+    };
+
+    struct Write {
+        uint16_t address;
+        uint8_t value;
+    };
+
+    MSP430& msp;
+    uint64_t interval;
+    size_t max_undo;
+    std::vector<Checkpoint> checkpoints;    // By position, the first at 0
+
+    // The last entry is open while its instruction runs, and stays open if it
+    // faults so a retry adds to it
+    std::deque<Entry> entries;
+    std::deque<Write> writes;
+    bool open = false;
+
+    void undo();
+    MSP430::RunResult replay(uint64_t target);
+};
+
+template <typename Predicate>
+bool History::reverse_until(Predicate&& stop)
+{
+    // Replay each span between checkpoints, latest first, and keep its last match
+    auto end = position;
+    while (end > 0) {
+        auto it = std::prev(std::ranges::lower_bound(checkpoints, end, {}, &Checkpoint::position));
+        auto start = it->position;
+        seek(start);
+
+        bool found = false;
+        uint64_t match = 0;
+        while (position < end) {
+            auto result = msp.run_until(stop, end - position);
+            // Replay carries on past breakpoints and watchpoints that are not matches
+            if (result.reason == MSP430::StopReason::breakpoint && stop(msp)) {
+                found = true;
+                match = position;
+                result = msp.run(1);
+            }
+            if (result.reason != MSP430::StopReason::budget && result.reason != MSP430::StopReason::exit
+                && result.reason != MSP430::StopReason::breakpoint && result.reason != MSP430::StopReason::watchpoint)
+                break;
+        }
+
+        if (found) {
+            seek(match);
+            return true;
+        }
+        end = start;
+    }
+
+    seek(0);
+    return false;
+}
@@ -0,0 +1,1048 @@
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+#include <ranges>
+#include <vector>
+
+// Block compiler
+//
+// The dispatcher interprets with the decode cache and counts how often each
+// address is entered by a jump, call or return. Hot addresses are compiled to
+// host code: straight-line ALU instructions up to and including a conditional
+// jump, stopping before anything else that writes PC (CALL, RETI, BR, ...) or
+// that is not translated. The interpreter executes those.
+//
+// Compiled code keeps the most used guest registers in host registers and
+// only computes flags that can be observed: by a later instruction, at a
+// block exit or by the interpreter after a bail out. Memory accesses check
+// for misalignment, MMIO and writes to cached code before the instruction has
+// any effect, and leave the block with PC pointing at it if needed, so the
+// interpreter re-executes it with the usual error reporting and invalidation.
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using BlockCode = uint32_t (*)(uint16_t* registers, uint8_t* ram, const uint64_t* code);
+
+static constexpr size_t ARENA_SIZE = 8 << 20;
+static constexpr size_t MAX_BLOCK_INSNS = 64;
+
+// Block entries before compiling, lowered in tests so everything is compiled
+#ifdef MSP430TEST
+static constexpr uint8_t HOT_THRESHOLD = 1;
+#else
+static constexpr uint8_t HOT_THRESHOLD = 32;
+#endif
+
+struct MSP430::Jit {
+    struct Block {
+        BlockCode code;
+        uint16_t end;       // Address after the last instruction
+        uint8_t length;     // Instructions, the most a call can execute
+        uint8_t hits;
+        bool failed;        // First instruction can not be compiled
+    };
+
+    Block blocks[RAM_SIZE / 2] = {};
+    std::vector<uint16_t> compiled; // Start addresses of blocks with code
+    size_t used = 0;
+
+    // The arena is one memory file mapped twice, code is written through one
+    // view and run from the other. No mapping is both writable and
+    // executable, which hardened kernels refuse.
+    uint8_t* arena = nullptr;       // Read and write
+    const uint8_t* code = nullptr;  // Read and execute, at the same offsets
+
+    Jit() {
+        int fd = memfd_create("msp430-jit", MFD_CLOEXEC);
+        if (fd < 0)
+            throw Error("Failed to create JIT code arena");
+
+        void* writable = MAP_FAILED;
+        void* executable = MAP_FAILED;
+        if (ftruncate(fd, ARENA_SIZE) == 0) {
+            writable = mmap(nullptr, ARENA_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            executable = mmap(nullptr, ARENA_SIZE, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+
+        if (writable == MAP_FAILED || executable == MAP_FAILED) {
+            if (writable != MAP_FAILED)
+                munmap(writable, ARENA_SIZE);
+            if (executable != MAP_FAILED)
+                munmap(executable, ARENA_SIZE);
+            throw Error("Failed to map JIT code arena");
+        }
+        arena = static_cast<uint8_t*>(writable);
+        code = static_cast<const uint8_t*>(executable);
+    }
+
+    ~Jit() {
+        munmap(arena, ARENA_SIZE);
+        munmap(const_cast<uint8_t*>(code), ARENA_SIZE);
+    }
+
+    void flush() {
+        for (auto start : compiled)
+            blocks[start >> 1] = {};
+        for (auto& block : blocks)
+            block.failed = false;
+        compiled.clear();
+        used = 0;
+    }
+
+    // As new, for another instance
+    void reset() {
+        flush();
+        for (auto& block : blocks)
+            block.hits = 0;
+    }
+};
+
+// Each thread keeps the jit of the last instance it destroyed for the next
+// one it runs, so fleet jobs do not map an arena each
+static thread_local std::unique_ptr<MSP430::Jit> spare_jit;
+
+void MSP430::JitDeleter::operator()(Jit* p) const
+{
+    if (spare_jit) {
+        delete p;
+    } else {
+        p->reset();
+        spare_jit.reset(p);
+    }
+}
+
+static MSP430::Jit*
+take_jit()
+{
+    if (spare_jit)
+        return spare_jit.release();
+    return new MSP430::Jit;
+}
+
+// x86-64 encoding
+
+enum HostReg : uint8_t {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15,
+};
+
+enum HostCond : uint8_t {
+    cc_b = 0x2,
+    cc_ae = 0x3,
+    cc_e = 0x4,
+    cc_ne = 0x5,
+};
+
+enum AluOp : uint8_t {
+    op_add, op_or, op_adc, op_sbb, op_and, op_sub, op_xor, op_cmp,
+};
+
+static constexpr int NO_INDEX = -1;
+
+struct Emitter {
+    std::vector<uint8_t> bytes;
+
+    void byte(uint8_t b) { bytes.push_back(b); }
+    void u16(uint16_t v) { byte(v); byte(v >> 8); }
+    void u32(uint32_t v) { u16(v); u16(v >> 16); }
+
+    void rex(bool w, unsigned reg, int index, unsigned base, bool byte_reg = false) {
+        uint8_t r = 0x40 | w << 3 | (reg >> 3) << 2 | (index > 0 ? index >> 3 : 0) << 1 | base >> 3;
+        // spl, bpl, sil and dil need a REX prefix to be addressed
+        if (r != 0x40 || (byte_reg && reg >= 4))
+            byte(r);
+    }
+
+    void modrm_reg(unsigned reg, unsigned rm) {
+        byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void modrm_mem(unsigned reg, unsigned base, int index, int32_t disp) {
+        if (index == NO_INDEX && (base & 7) != rsp) {
+            byte(0x80 | (reg & 7) << 3 | (base & 7));
+        } else {
+            byte(0x84 | (reg & 7) << 3);
+            byte((index == NO_INDEX ? 4 : index & 7) << 3 | (base & 7));
+        }
+        u32(disp);
+    }
+
+    // 32-bit register operations, writes zero the upper half
+    void alu(AluOp op, unsigned dst, HostReg src) {
+        rex(0, src, 0, dst); byte(op << 3 | 1); modrm_reg(src, dst);
+    }
+    void alu(AluOp op, unsigned dst, uint32_t imm) {
+        rex(0, 0, 0, dst); byte(0x81); modrm_reg(op, dst); u32(imm);
+    }
+    void mov(unsigned dst, unsigned src) {
+        rex(0, src, 0, dst); byte(0x89); modrm_reg(src, dst);
+    }
+    void mov64(unsigned dst, unsigned src) {
+        rex(1, src, 0, dst); byte(0x89); modrm_reg(src, dst);
+    }
+    void mov_imm(unsigned dst, uint32_t imm) {
+        rex(0, 0, 0, dst); byte(0xb8 + (dst & 7)); u32(imm);
+    }
+    void shl(unsigned dst, uint8_t n) {
+        rex(0, 0, 0, dst); byte(0xc1); modrm_reg(4, dst); byte(n);
+    }
+    void shr(unsigned dst, uint8_t n) {
+        rex(0, 0, 0, dst); byte(0xc1); modrm_reg(5, dst); byte(n);
+    }
+    void not_(unsigned dst) {
+        rex(0, 0, 0, dst); byte(0xf7); modrm_reg(2, dst);
+    }
+    void test(unsigned dst, uint32_t imm) {
+        rex(0, 0, 0, dst); byte(0xf7); modrm_reg(0, dst); u32(imm);
+    }
+    void movsx8(unsigned dst, unsigned src) {
+        rex(0, dst, 0, src, src >= 4); byte(0x0f); byte(0xbe); modrm_reg(dst, src);
+    }
+
+    // Memory operands are [base + index + disp]
+    void load16(unsigned dst, unsigned base, int index, int32_t disp) {
+        rex(0, dst, index, base); byte(0x0f); byte(0xb7); modrm_mem(dst, base, index, disp);
+    }
+    void load8(unsigned dst, unsigned base, int index, int32_t disp) {
+        rex(0, dst, index, base); byte(0x0f); byte(0xb6); modrm_mem(dst, base, index, disp);
+    }
+    void store16(unsigned base, int index, int32_t disp, unsigned src) {
+        byte(0x66); rex(0, src, index, base); byte(0x89); modrm_mem(src, base, index, disp);
+    }
+    void store8(unsigned base, int index, int32_t disp, unsigned src) {
+        rex(0, src, index, base, true); byte(0x88); modrm_mem(src, base, index, disp);
+    }
+    void store16_imm(unsigned base, int32_t disp, uint16_t imm) {
+        byte(0x66); rex(0, 0, 0, base); byte(0xc7); modrm_mem(0, base, NO_INDEX, disp); u16(imm);
+    }
+    void store8_imm(unsigned base, int index, int32_t disp, uint8_t imm) {
+        rex(0, 0, index, base); byte(0xc6); modrm_mem(0, base, index, disp); byte(imm);
+    }
+    // Bit test of a bit string at base, sets the carry flag
+    void bt(unsigned base, unsigned bit) {
+        rex(1, bit, 0, base); byte(0x0f); byte(0xa3); modrm_mem(bit, base, NO_INDEX, 0);
+    }
+
+    void push(unsigned reg) { rex(0, 0, 0, reg); byte(0x50 + (reg & 7)); }
+    void pop(unsigned reg) { rex(0, 0, 0, reg); byte(0x58 + (reg & 7)); }
+    void ret() { byte(0xc3); }
+
+    // Jumps return the offset of their displacement for patch()
+    size_t jcc(HostCond cc) {
+        byte(0x0f); byte(0x80 | cc); u32(0);
+        return bytes.size() - 4;
+    }
+    size_t jmp() {
+        byte(0xe9); u32(0);
+        return bytes.size() - 4;
+    }
+    void patch(size_t at, size_t target) {
+        uint32_t rel = target - (at + 4);
+        memcpy(&bytes[at], &rel, 4);
+    }
+};
+
+// Block translation
+
+struct JitInsn {
+    enum Kind : uint8_t { dual, single, jump } kind;
+    ByteWord mode;
+    uint8_t op;
+    bool flags_live;
+    uint16_t pc;
+    uint16_t next;
+    Operand src, dst;
+};
+
+static bool
+is_memory(const Operand& operand)
+{
+    return operand.kind != reg_direct && operand.kind != constant;
+}
+
+static bool
+sets_flags(const JitInsn& insn)
+{
+    switch (insn.kind) {
+        case JitInsn::dual:
+            return insn.op != MOV && insn.op != BIC && insn.op != BIS;
+        case JitInsn::single:
+            return insn.op == RRC || insn.op == RRA || insn.op == SXT;
+        case JitInsn::jump:
+            return false;
+    }
+    unreachable();
+}
+
+static bool
+reads_flags(const JitInsn& insn)
+{
+    switch (insn.kind) {
+        case JitInsn::dual:
+            return insn.op == ADDC || insn.op == SUBC
+                || (insn.src.kind == reg_direct && insn.src.reg == SR)
+                || (insn.dst.kind == reg_direct && insn.dst.reg == SR);
+        case JitInsn::single:
+            return insn.op == RRC
+                || (insn.src.kind == reg_direct && insn.src.reg == SR)
+                || (insn.dst.kind == reg_direct && insn.dst.reg == SR);
+        case JitInsn::jump:
+            return true;
+    }
+    unreachable();
+}
+
+// Memory accesses can leave the block before the instruction executes
+static bool
+may_bail(const JitInsn& insn)
+{
+    return is_memory(insn.src) || is_memory(insn.dst)
+        || (insn.kind == JitInsn::single && insn.op == PUSH);
+}
+
+// Writes to SR setting GIE go through write_register, which ends the batch
+// when interrupts are pending
+static bool
+may_set_gie(const JitInsn& insn)
+{
+    switch (insn.op) {
+        case CMP: case BIT: case BIC:
+            return false;
+        case BIS:
+            return insn.src.kind != constant || (insn.src.ext & IF);
+    }
+    return true;
+}
+
+// Decodes an instruction the compiler translates, false for anything else
+static bool
+decode_jit(const MSP430& msp, uint16_t pc, JitInsn& out)
+{
+    if (pc > MMIO_BASE - 6)
+        return false;
+
+    Fetch fetch = {
+        .words = reinterpret_cast<const uint16_t*>(&(*msp.ram)[pc]),
+        .pc = pc,
+        .count = 1,
+    };
+    auto instruction = fetch.words[0];
+    out = {};
+    out.pc = pc;
+
+    switch (MSP430::classify(instruction)) {
+        case MSP430::invalid:
+            return false;
+
+        case MSP430::conditional: {
+            auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+            out.kind = JitInsn::jump;
+            out.op = op.condition;
+            out.dst = { constant, PC, uint16_t(pc + 2 + (uint16_t(int16_t(op.offset)) << 1)) };
+            break;
+        }
+
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            out.kind = JitInsn::single;
+            out.mode = ByteWord(op.bw);
+            out.op = op.opcode;
+            switch (op.opcode) {
+                case RRC: case RRA: case SWPB: case SXT:
+                    if (not decode_single(op, fetch, out.dst))
+                        return false;
+                    // Any of them may set GIE in SR, see may_set_gie
+                    if (out.dst.kind != reg_direct || out.dst.reg == PC || out.dst.reg == SR)
+                        return false;
+                    break;
+                case PUSH:
+                    if (op.bw || not decode_single(op, fetch, out.src))
+                        return false;
+                    if (out.src.kind == reg_direct && out.src.reg == PC)
+                        out.src = { constant, PC, uint16_t(pc + 2) };
+                    if (is_memory(out.src))
+                        return false;
+                    break;
+                default:
+                    return false;
+            }
+            break;
+        }
+
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            out.kind = JitInsn::dual;
+            out.mode = ByteWord(op.bw);
+            out.op = op.opcode;
+            if (op.opcode == DADD)
+                return false;
+            if (not decode_source(op, fetch, out.src) || not decode_dest(op, fetch, out.dst))
+                return false;
+            if (out.dst.kind == reg_direct && out.dst.reg == PC)
+                return false;
+            if (out.dst.kind == reg_direct && out.dst.reg == SR && may_set_gie(out))
+                return false;
+            break;
+        }
+    }
+
+    out.next = fetch.address();
+    return true;
+}
+
+static uint32_t
+mask_of(ByteWord mode)
+{
+    return mode == Byte ? Constants<Byte>::mask : Constants<Word>::mask;
+}
+
+static uint32_t
+sign_of(ByteWord mode)
+{
+    return mode == Byte ? Constants<Byte>::sign : Constants<Word>::sign;
+}
+
+// Host registers guest registers can be pinned to. rax, rcx, rdx and r11 are
+// scratch, r13-r15 hold the block arguments.
+static constexpr HostReg PINNABLE[] = { rbx, rbp, rsi, rdi, r8, r9, r10, r12 };
+static constexpr HostReg REG_FILE = r15, RAM_BASE = r14, CODE_BITMAP = r13;
+
+struct BlockCompiler {
+    Emitter x;
+    const std::vector<JitInsn>& insns;
+    int32_t dirty_offset; // Of MSP430::dirty from the register file
+    int32_t attributes_offset; // Of MSP430::page_attributes
+    int8_t host[16];
+    std::vector<std::pair<size_t, unsigned>> bails; // Jump to patch, instruction index
+
+    BlockCompiler(const std::vector<JitInsn>& insns, int32_t dirty_offset, int32_t attributes_offset)
+        : insns(insns), dirty_offset(dirty_offset), attributes_offset(attributes_offset) {}
+
+    bool pinned(unsigned reg) const { return host[reg] >= 0; }
+
+    void load_guest(unsigned dst, unsigned reg) {
+        if (pinned(reg))
+            x.mov(dst, host[reg]);
+        else
+            x.load16(dst, REG_FILE, NO_INDEX, 2 * reg);
+    }
+
+    // src must already be masked to 16 bits
+    void store_guest(unsigned reg, unsigned src) {
+        if (pinned(reg))
+            x.mov(host[reg], src);
+        else
+            x.store16(REG_FILE, NO_INDEX, 2 * reg, src);
+    }
+
+    void add_guest(unsigned reg, uint16_t value) {
+        unsigned r = pinned(reg) ? unsigned(host[reg]) : unsigned(rcx);
+        if (not pinned(reg))
+            load_guest(rcx, reg);
+        x.alu(op_add, r, uint32_t(value));
+        x.alu(op_and, r, 0xffffu);
+        if (not pinned(reg))
+            store_guest(reg, rcx);
+    }
+
+    void bail_if(HostCond cc, unsigned index) {
+        bails.emplace_back(x.jcc(cc), index);
+    }
+
+    // Leaves the block unless the interpreter would access plain ram. Code
+    // is checked by word rather than page_code. Clobbers rcx.
+    void check_access(unsigned address, ByteWord mode, bool write, unsigned index) {
+        if (mode == Word) {
+            x.test(address, 1);
+            bail_if(cc_ne, index);
+        }
+        x.mov(rcx, address);
+        x.shr(rcx, 8);
+        x.load8(rcx, REG_FILE, rcx, attributes_offset);
+        x.test(rcx, write ? MSP430::page_write_trap & ~MSP430::page_code : MSP430::page_read_trap);
+        bail_if(cc_ne, index);
+        if (write) {
+            x.mov(rcx, address);
+            x.shr(rcx, 1);
+            x.bt(CODE_BITMAP, rcx);
+            bail_if(cc_b, index);
+        }
+    }
+
+    void load_memory(unsigned dst, unsigned address, ByteWord mode) {
+        if (mode == Word)
+            x.load16(dst, RAM_BASE, address, 0);
+        else
+            x.load8(dst, RAM_BASE, address, 0);
+    }
+
+    // Clobbers rcx
+    void store_memory(unsigned address, unsigned src, ByteWord mode) {
+        if (mode == Word)
+            x.store16(RAM_BASE, address, 0, src);
+        else
+            x.store8(RAM_BASE, address, 0, src);
+        x.mov(rcx, address);
+        x.shr(rcx, 8);
+        x.store8_imm(REG_FILE, rcx, dirty_offset, 1);
+    }
+
+    // Replaces the ALU flags in SR with those in eax. Clobbers rcx.
+    void merge_flags() {
+        load_guest(rcx, SR);
+        x.alu(op_and, rcx, uint32_t(~ALU & 0xffff));
+        x.alu(op_or, rcx, rax);
+        store_guest(SR, rcx);
+    }
+
+    // Sets eax to NF and ZF of the result in r11. Clobbers rcx.
+    void sign_zero_flags(ByteWord mode, unsigned flags) {
+        x.mov(rcx, r11);
+        x.shr(rcx, mode == Word ? 13 : 5);
+        x.alu(op_and, rcx, uint32_t(NF));
+        x.alu(op_or, flags, rcx);
+        // cmp sets carry for zero, sbb spreads it over the register
+        x.mov(rcx, r11);
+        x.alu(op_and, rcx, mask_of(mode));
+        x.alu(op_cmp, rcx, 1u);
+        x.alu(op_sbb, rcx, rcx);
+        x.alu(op_and, rcx, uint32_t(ZF));
+        x.alu(op_or, flags, rcx);
+    }
+
+    // Flags from alu_flags_update: eax holds the source with its sign as
+    // passed there, ecx the target and r11 the result.
+    void alu_flags(ByteWord mode) {
+        x.alu(op_xor, rax, r11);
+        x.alu(op_xor, rcx, r11);
+        x.alu(op_and, rax, rcx);
+        if (mode == Word)
+            x.shr(rax, 7);
+        else
+            x.shl(rax, 1);
+        x.alu(op_and, rax, uint32_t(VF));
+        x.mov(rcx, r11);
+        x.shr(rcx, mode == Word ? 16 : 8);
+        x.alu(op_and, rcx, uint32_t(CF));
+        x.alu(op_or, rax, rcx);
+        sign_zero_flags(mode, rax);
+        merge_flags();
+    }
+
+    // Flags from logic_flags_update: eax holds the source, ecx the target and
+    // r11 the result. Overflow is set when both operands are negative.
+    void logic_flags(ByteWord mode, bool overflow) {
+        if (overflow) {
+            x.alu(op_and, rax, rcx);
+            if (mode == Word)
+                x.shr(rax, 7);
+            else
+                x.shl(rax, 1);
+            x.alu(op_and, rax, uint32_t(VF));
+        } else {
+            x.mov_imm(rax, 0);
+        }
+        carry_not_zero_flags(mode);
+    }
+
+    // Adds NF, ZF and CF for a non-zero result in r11 to eax, then merges
+    void carry_not_zero_flags(ByteWord mode) {
+        sign_zero_flags(mode, rax);
+        x.mov(rcx, rax);
+        x.shr(rcx, 1);
+        x.alu(op_and, rcx, uint32_t(CF));
+        x.alu(op_xor, rcx, uint32_t(CF));
+        x.alu(op_or, rax, rcx);
+        merge_flags();
+    }
+
+    void emit_dual(const JitInsn& in, unsigned index) {
+        auto mode = in.mode;
+        uint16_t step = (mode == Byte && in.src.reg > SP) ? 1 : 2;
+
+        // eax = source. Nothing is written until both operands are checked.
+        switch (in.src.kind) {
+            case reg_direct:
+                load_guest(rax, in.src.reg);
+                break;
+            case constant:
+                x.mov_imm(rax, in.src.ext);
+                break;
+            case indexed:
+                load_guest(rdx, in.src.reg);
+                x.alu(op_add, rdx, uint32_t(in.src.ext));
+                x.alu(op_and, rdx, 0xffffu);
+                break;
+            case absolute:
+                x.mov_imm(rdx, in.src.ext);
+                break;
+            case indirect:
+            case autoincrement:
+                load_guest(rdx, in.src.reg);
+                break;
+        }
+        if (is_memory(in.src)) {
+            check_access(rdx, mode, false, index);
+            load_memory(rax, rdx, mode);
+        } else if (mode == Byte) {
+            x.alu(op_and, rax, 0xffu);
+        }
+
+        // edx = destination address
+        if (in.dst.kind == absolute) {
+            x.mov_imm(rdx, in.dst.ext);
+        } else if (in.dst.kind == indexed) {
+            uint16_t offset = in.dst.ext;
+            if (in.src.kind == autoincrement && in.src.reg == in.dst.reg)
+                offset += step;
+            load_guest(rdx, in.dst.reg);
+            x.alu(op_add, rdx, uint32_t(offset));
+            x.alu(op_and, rdx, 0xffffu);
+        }
+        if (is_memory(in.dst))
+            check_access(rdx, mode, true, index);
+
+        if (in.src.kind == autoincrement)
+            add_guest(in.src.reg, step);
+
+        // ecx = target
+        if (in.op != MOV) {
+            if (is_memory(in.dst)) {
+                load_memory(rcx, rdx, mode);
+            } else {
+                load_guest(rcx, in.dst.reg);
+                if (mode == Byte)
+                    x.alu(op_and, rcx, 0xffu);
+            }
+        }
+
+        // r11 = result, eax adjusted to the sign alu_flags_update uses
+        switch (in.op) {
+            case MOV:
+                x.mov(r11, rax);
+                break;
+            case ADD:
+                x.mov(r11, rcx);
+                x.alu(op_add, r11, rax);
+                break;
+            case ADDC:
+                load_guest(r11, SR);
+                x.alu(op_and, r11, uint32_t(CF));
+                x.alu(op_add, r11, rcx);
+                x.alu(op_add, r11, rax);
+                break;
+            case SUBC:
+                x.not_(rax);
+                x.alu(op_and, rax, mask_of(mode));
+                load_guest(r11, SR);
+                x.alu(op_and, r11, uint32_t(CF));
+                x.alu(op_add, r11, rcx);
+                x.alu(op_add, r11, rax);
+                break;
+            case SUB:
+            case CMP:
+                x.not_(rax);
+                x.alu(op_and, rax, mask_of(mode));
+                x.mov(r11, rcx);
+                x.alu(op_add, r11, rax);
+                x.alu(op_add, r11, 1u);
+                break;
+            case BIT:
+                x.mov(r11, rcx);
+                x.alu(op_and, r11, rax);
+                break;
+            case BIC:
+                x.mov(r11, rax);
+                x.not_(r11);
+                x.alu(op_and, r11, rcx);
+                break;
+            case BIS:
+                x.mov(r11, rcx);
+                x.alu(op_or, r11, rax);
+                break;
+            case XOR:
+                x.mov(r11, rcx);
+                x.alu(op_xor, r11, rax);
+                break;
+            case AND:
+                x.mov(r11, rcx);
+                x.alu(op_and, r11, rax);
+                break;
+        }
+
+        // Flags before the write, a destination of SR overrides them
+        if (in.flags_live) {
+            if (in.op == AND || in.op == BIT || in.op == XOR)
+                logic_flags(mode, in.op == XOR);
+            else
+                alu_flags(mode);
+        }
+
+        if (in.op == CMP || in.op == BIT)
+            return;
+
+        if (is_memory(in.dst)) {
+            store_memory(rdx, r11, mode);
+        } else {
+            x.alu(op_and, r11, mask_of(mode));
+            store_guest(in.dst.reg, r11);
+        }
+    }
+
+    void emit_single(const JitInsn& in, unsigned index) {
+        auto mode = in.mode;
+        unsigned reg = in.dst.reg;
+
+        switch (in.op) {
+            case PUSH:
+                load_guest(rdx, SP);
+                x.alu(op_sub, rdx, 2u);
+                x.alu(op_and, rdx, 0xffffu);
+                check_access(rdx, Word, true, index);
+                store_guest(SP, rdx);
+                // The operand is read after SP is decremented
+                if (in.src.kind == constant)
+                    x.mov_imm(rax, in.src.ext);
+                else
+                    load_guest(rax, in.src.reg);
+                store_memory(rdx, rax, Word);
+                return;
+
+            case SWPB:
+                load_guest(rcx, reg);
+                x.mov(rax, rcx);
+                x.shr(rax, 8);
+                x.shl(rcx, 8);
+                x.alu(op_or, rcx, rax);
+                x.alu(op_and, rcx, 0xffffu);
+                store_guest(reg, rcx);
+                return;
+
+            case SXT:
+                load_guest(r11, reg);
+                x.movsx8(r11, r11);
+                x.alu(op_and, r11, 0xffffu);
+                store_guest(reg, r11);
+                if (in.flags_live) {
+                    x.mov_imm(rax, 0);
+                    carry_not_zero_flags(Word);
+                }
+                return;
+
+            case RRC:
+            case RRA:
+                load_guest(r11, reg);
+                x.alu(op_and, r11, mask_of(mode));
+                if (in.op == RRC) {
+                    load_guest(rax, SR);
+                    x.alu(op_and, rax, uint32_t(CF));
+                    x.shl(rax, mode == Word ? 16 : 8);
+                } else {
+                    x.mov(rax, r11);
+                    x.alu(op_and, rax, sign_of(mode));
+                    x.shl(rax, 1);
+                }
+                x.alu(op_or, r11, rax);
+                x.mov(rax, r11);
+                x.alu(op_and, rax, uint32_t(CF));
+                x.shr(r11, 1);
+                store_guest(reg, r11);
+                if (in.flags_live) {
+                    sign_zero_flags(mode, rax);
+                    merge_flags();
+                }
+                return;
+        }
+        unreachable();
+    }
+
+    // Sets the flags from eval of the condition on SR, returns the jump
+    // taken when it holds
+    size_t emit_condition(Condition cond) {
+        load_guest(rax, SR);
+        switch (cond) {
+            case not_equal:
+                x.test(rax, ZF);
+                return x.jcc(cc_e);
+            case equal:
+                x.test(rax, ZF);
+                return x.jcc(cc_ne);
+            case no_carry:
+                x.test(rax, CF);
+                return x.jcc(cc_e);
+            case carry:
+                x.test(rax, CF);
+                return x.jcc(cc_ne);
+            case negative:
+                x.test(rax, NF);
+                return x.jcc(cc_ne);
+            case greater_equal:
+            case less:
+                x.mov(rcx, rax);
+                x.shr(rcx, 6);
+                x.alu(op_xor, rcx, rax);
+                x.test(rcx, NF);
+                return x.jcc(cond == less ? cc_ne : cc_e);
+            case always:
+                return x.jmp();
+        }
+        unreachable();
+    }
+
+    void emit_exit(uint16_t pc, uint32_t count, std::vector<size_t>& exits) {
+        x.store16_imm(REG_FILE, 2 * PC, pc);
+        x.mov_imm(rax, count);
+        exits.push_back(x.jmp());
+    }
+
+    void allocate_registers() {
+        unsigned uses[16] = {};
+        for (auto& in : insns) {
+            for (auto* operand : { &in.src, &in.dst })
+                if (operand->kind != constant && operand->kind != absolute)
+                    uses[operand->reg]++;
+            if (in.kind == JitInsn::single && in.op == PUSH)
+                uses[SP]++;
+            if (in.flags_live || reads_flags(in))
+                uses[SR] += 2;
+        }
+        uses[PC] = 0;
+
+        unsigned order[16];
+        for (unsigned i=0; i<16; i++)
+            order[i] = i;
+        std::stable_sort(order, order + 16, [&](unsigned a, unsigned b) { return uses[a] > uses[b]; });
+
+        memset(host, -1, sizeof(host));
+        for (unsigned i=0; i<std::size(PINNABLE) && uses[order[i]]; i++)
+            host[order[i]] = PINNABLE[i];
+    }
+
+    void compile() {
+        allocate_registers();
+
+        static constexpr HostReg saved[] = { rbx, rbp, r12, r13, r14, r15 };
+        for (auto reg : saved)
+            x.push(reg);
+        x.mov64(REG_FILE, rdi);
+        x.mov64(RAM_BASE, rsi);
+        x.mov64(CODE_BITMAP, rdx);
+        for (unsigned reg=0; reg<16; reg++)
+            if (pinned(reg))
+                x.load16(host[reg], REG_FILE, NO_INDEX, 2 * reg);
+
+        std::vector<size_t> exits;
+        const auto& last = insns.back();
+        for (unsigned i=0; i<insns.size(); i++) {
+            const auto& in = insns[i];
+            switch (in.kind) {
+                case JitInsn::dual: emit_dual(in, i); break;
+                case JitInsn::single: emit_single(in, i); break;
+                case JitInsn::jump: break;
+            }
+        }
+
+        uint32_t length = insns.size();
+        if (last.kind == JitInsn::jump) {
+            auto taken = emit_condition(Condition(last.op));
+            if (last.op != always)
+                emit_exit(last.pc + 2, length, exits);
+            x.patch(taken, x.bytes.size());
+            emit_exit(last.dst.ext, length, exits);
+        } else {
+            emit_exit(last.next, length, exits);
+        }
+
+        for (auto [at, index] : bails) {
+            x.patch(at, x.bytes.size());
+            emit_exit(insns[index].pc, index, exits);
+        }
+
+        for (auto at : exits)
+            x.patch(at, x.bytes.size());
+        for (unsigned reg=0; reg<16; reg++)
+            if (pinned(reg))
+                x.store16(REG_FILE, NO_INDEX, 2 * reg, host[reg]);
+        for (auto reg : saved | std::views::reverse)
+            x.pop(reg);
+        x.ret();
+    }
+};
+
+// Backwards pass marking which flag updates are observed
+static void
+mark_live_flags(std::vector<JitInsn>& insns)
+{
+    bool live = true; // SR is stored at every exit
+    for (auto& in : insns | std::views::reverse) {
+        if (sets_flags(in)) {
+            in.flags_live = live;
+            live = false;
+        }
+        if (reads_flags(in) || may_bail(in))
+            live = true;
+    }
+}
+
+static void
+compile_block(MSP430& msp, MSP430::Jit& jit, uint16_t start)
+{
+    auto& block = jit.blocks[start >> 1];
+
+    std::vector<JitInsn> insns;
+    uint16_t pc = start;
+    JitInsn insn;
+    while (insns.size() < MAX_BLOCK_INSNS && decode_jit(msp, pc, insn)) {
+        // Blocks end before breakpoints, the interpreter stops at them, and
+        // before code it may not execute, which faults there
+        if (msp.has_breakpoint(pc))
+            break;
+        auto last = uint16_t(insn.next - 2);
+        if ((page_attributes(msp, pc) | page_attributes(msp, last)) & MSP430::page_no_exec)
+            break;
+        insns.push_back(insn);
+        if (insn.kind == JitInsn::jump)
+            break;
+        pc = insn.next;
+    }
+
+    // Loops run() skips ahead through are left to the interpreter, which
+    // finds them
+    if (insns.empty() || is_tight_loop(msp, start)) {
+        block.failed = true;
+        return;
+    }
+
+    mark_live_flags(insns);
+
+    auto dirty_offset = reinterpret_cast<const char*>(msp.dirty.data())
+        - reinterpret_cast<const char*>(msp.registers);
+    auto attributes_offset = reinterpret_cast<const char*>(msp.page_attributes.data())
+        - reinterpret_cast<const char*>(msp.registers);
+    BlockCompiler compiler(insns, dirty_offset, attributes_offset);
+    compiler.compile();
+    auto& bytes = compiler.x.bytes;
+
+    if (jit.used + bytes.size() > ARENA_SIZE)
+        jit.flush();
+
+    memcpy(jit.arena + jit.used, bytes.data(), bytes.size());
+    block.code = reinterpret_cast<BlockCode>(jit.code + jit.used);
+    jit.used += (bytes.size() + 15) & ~size_t(15);
+
+    block.length = insns.size();
+    block.end = insns.back().next;
+    jit.compiled.push_back(start);
+
+    // Writes to these words must drop the block
+    for (unsigned address = start; address < block.end; address += 2)
+        mark_code(msp, address);
+}
+
+void
+jit_invalidate(MSP430& msp, uint16_t address)
+{
+    auto& jit = *msp.jit;
+    jit.blocks[address >> 1].failed = false; // May compile now
+    std::erase_if(jit.compiled, [&](uint16_t start) {
+        auto& block = jit.blocks[start >> 1];
+        if (address < start || address >= block.end)
+            return false;
+        block = {};
+        return true;
+    });
+}
+
+void
+jit_flush(MSP430& msp)
+{
+    msp.jit->flush();
+}
+
+void
+execute_jit(MSP430& msp, size_t& count)
+{
+    if (not msp.decode_cache) [[unlikely]]
+        msp.decode_cache.reset(new MSP430::DecodeCache);
+    if (not msp.jit) [[unlikely]]
+        msp.jit.reset(take_jit());
+
+    auto& jit = *msp.jit;
+    auto& cache = *msp.decode_cache;
+    bool entry = true;
+
+    // Compiled code bails out before MMIO, so only the interpreter stops
+    while (count > 0 && not msp.stop_requested) {
+        auto pc = msp.registers[PC];
+
+        if (not (pc & 1)) {
+            auto& block = jit.blocks[pc >> 1];
+
+            if (block.code && block.length <= count) {
+                // Compiled code reads and writes SR directly
+                sync_flags(msp);
+                auto executed = block.code(msp.registers, msp.ram->data(), cache.code);
+                count -= executed;
+                entry = true;
+                // Left early, the interpreter handles the instruction
+                if (executed < block.length) {
+                    step_cached(msp);
+                    count--;
+                }
+                continue;
+            }
+
+            if (entry && not block.code && not block.failed) {
+                if (block.hits < HOT_THRESHOLD)
+                    block.hits++;
+                if (block.hits >= HOT_THRESHOLD) {
+                    compile_block(msp, jit, pc);
+                    if (block.code)
+                        continue;
+                }
+            }
+        }
+
+        step_cached(msp);
+        count--;
+
+        // Count entries only at jump targets, not every instruction
+        auto& decoded = cache.entries[pc >> 1];
+        entry = pc & 1 || decoded.length == 0 || msp.registers[PC] != uint16_t(pc + decoded.length);
+    }
+}
+
+#else
+
+struct MSP430::Jit {};
+
+void MSP430::JitDeleter::operator()(Jit* p) const
+{
+    delete p;
+}
+
+void
+jit_invalidate(MSP430&, uint16_t)
+{
+}
+
+void
+jit_flush(MSP430&)
+{
+}
+
+// No code generator for this host, interpret instead
+void
+execute_jit(MSP430& msp, size_t& count)
+{
+    while (count > 0 && not msp.stop_requested) {
+        step_cached(msp);
+        count--;
+    }
+}
+
+#endif
@@ -0,0 +1,308 @@
+#include "msp430_impl.hpp"
+#include "msp430x.hpp"
+
+#include <algorithm>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Loading
+//
+// Files are mapped and read in place, ram is prepared directly in the
+// image's snapshot memory. Every offset and size from the file is checked
+// before use.
+
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    explicit MappedFile(const char* path) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw Error(strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw Error(strerror(errno));
+        }
+
+        size = st.st_size;
+        if (size > 0) {
+            auto p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                throw Error(strerror(errno));
+            data = static_cast<const uint8_t*>(p);
+        } else {
+            close(fd);
+        }
+    }
+
+    ~MappedFile() {
+        if (data)
+            munmap(const_cast<uint8_t*>(data), size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    // count entries of T at offset, throws if they run past the end
+    template <typename T>
+    const T* at(uint64_t offset, uint64_t count = 1) const {
+        if (offset > size || count * sizeof(T) > size - offset)
+            throw Error("Unexpected end-of-file");
+        return reinterpret_cast<const T*>(data + offset);
+    }
+};
+
+static void
+check_range(uint64_t address, uint64_t length, uint64_t limit, const char* what)
+{
+    if (address > limit || length > limit - address)
+        throw Error(what);
+}
+
+static const Elf32_Ehdr&
+elf_header(const MappedFile& file)
+{
+    auto& header = *file.at<Elf32_Ehdr>(0);
+
+    if (header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_ident[EI_DATA] != ELFDATA2LSB)
+        throw Error("Not a 32-bit little-endian ELF file");
+
+    if (header.e_machine != EM_MSP430)
+        throw Error("Bad e_machine value");
+
+    if (header.e_phnum > 0 && header.e_phentsize != sizeof(Elf32_Phdr))
+        throw Error("Bad e_phentsize value");
+
+    if (header.e_shnum > 0 && header.e_shentsize != sizeof(Elf32_Shdr))
+        throw Error("Bad e_shentsize value");
+
+    return header;
+}
+
+// ELF files by their magic, binaries by their .bin suffix
+static bool
+is_elf(const MappedFile& file, const char* path)
+{
+    bool elf = file.size >= SELFMAG && memcmp(file.data, ELFMAG, SELFMAG) == 0;
+    auto length = strlen(path);
+    bool bin = length >= 4 && strcmp(path + length - 4, ".bin") == 0;
+
+    if (not elf && not bin)
+        throw Error("Not an ELF file");
+    return elf;
+}
+
+// Calls store(address, contents, file_size, memory_size) for each part of
+// the program below limit, the bytes past file_size being zero
+template <typename Store>
+static void
+load_contents(const MappedFile& file, const Elf32_Ehdr& header, uint64_t limit, Store store)
+{
+    auto programs = std::span(file.at<Elf32_Phdr>(header.e_phoff, header.e_phnum), header.e_phnum);
+    auto sections = std::span(file.at<Elf32_Shdr>(header.e_shoff, header.e_shnum), header.e_shnum);
+
+    // Segments are loaded at their physical address, as startup code copies
+    // initialised data from there
+    for (auto& program : programs) {
+        if (program.p_type != PT_LOAD)
+            continue;
+
+        if (program.p_filesz > program.p_memsz)
+            throw Error("Bad p_filesz value");
+        check_range(program.p_paddr, program.p_memsz, limit, "LOAD segment too large");
+
+        store(program.p_paddr, file.at<uint8_t>(program.p_offset, program.p_filesz), program.p_filesz, program.p_memsz);
+    }
+
+    // Without program headers, as in relocatable output, load sections
+    if (programs.empty()) {
+        for (auto& section : sections) {
+            if (not (section.sh_flags & SHF_ALLOC))
+                continue;
+
+            check_range(section.sh_addr, section.sh_size, limit, "Section too large");
+
+            if (section.sh_type == SHT_NOBITS)
+                store(section.sh_addr, nullptr, 0, section.sh_size);
+            else
+                store(section.sh_addr, file.at<uint8_t>(section.sh_offset, section.sh_size), section.sh_size, section.sh_size);
+        }
+    }
+}
+
+// Pages get the access of every segment in them, from p_flags at their
+// virtual address, and reads where a segment is stored at another physical
+// address. Pages outside every segment, such as the stack, are data that is
+// not executable. The MMIO page, which also holds the vector table, is at most
+// kept from executing so devices stay writable. Without program headers
+// nothing is protected.
+static void
+segment_protection(const MappedFile& file, const Elf32_Ehdr& header, MSP430::Image& image)
+{
+    auto programs = std::span(file.at<Elf32_Phdr>(header.e_phoff, header.e_phnum), header.e_phnum);
+
+    std::array<uint8_t, MSP430::PAGES> allowed = {};
+    std::array<bool, MSP430::PAGES> covered = {};
+    bool loaded = false;
+
+    auto allow = [&](uint32_t address, uint32_t size, uint8_t flags) {
+        if (size == 0)
+            return;
+        for (auto page = address / MSP430::PAGE_BYTES; page <= (address + size - 1) / MSP430::PAGE_BYTES; page++) {
+            allowed[page] |= flags;
+            covered[page] = true;
+        }
+    };
+
+    for (auto& program : programs) {
+        if (program.p_type != PT_LOAD)
+            continue;
+
+        check_range(program.p_vaddr, program.p_memsz, MSP430::RAM_SIZE, "LOAD segment too large");
+        allow(program.p_vaddr, program.p_memsz, program.p_flags & (PF_R | PF_W | PF_X));
+        if (program.p_paddr != program.p_vaddr)
+            allow(program.p_paddr, program.p_filesz, PF_R);
+        loaded = true;
+    }
+
+    if (not loaded)
+        return;
+
+    for (size_t page=0; page<MSP430::PAGES; page++) {
+        auto flags = covered[page] ? allowed[page] : PF_R | PF_W;
+        image.protection[page] = (flags & PF_R ? 0 : MSP430::page_no_read)
+            | (flags & PF_W ? 0 : MSP430::page_no_write)
+            | (flags & PF_X ? 0 : MSP430::page_no_exec);
+    }
+    image.protection[MSP430::MMIO_BASE / MSP430::PAGE_BYTES] &= MSP430::page_no_exec;
+}
+
+static void
+load_elf(const MappedFile& file, MSP430::RAM& ram, MSP430::Image& image)
+{
+    auto& header = elf_header(file);
+    auto sections = std::span(file.at<Elf32_Shdr>(header.e_shoff, header.e_shnum), header.e_shnum);
+
+    load_contents(file, header, MSP430::RAM_SIZE, [&](uint32_t address, const uint8_t* contents, uint32_t file_size, uint32_t memory_size) {
+        if (file_size > 0)
+            memcpy(ram.data() + address, contents, file_size);
+        // Segments may end at the top of memory, one past the last element
+        memset(ram.data() + address + file_size, 0, memory_size - file_size);
+    });
+    segment_protection(file, header, image);
+
+    // Functions are STT_FUNC or, from assembly, global labels in code
+    for (auto& section : sections) {
+        if (section.sh_type != SHT_SYMTAB || section.sh_link >= sections.size())
+            continue;
+
+        auto& strtab = sections[section.sh_link];
+        auto names = file.at<char>(strtab.sh_offset, strtab.sh_size);
+        auto count = section.sh_size / sizeof(Elf32_Sym);
+
+        for (auto& sym : std::span(file.at<Elf32_Sym>(section.sh_offset, count), count)) {
+            auto type = ELF32_ST_TYPE(sym.st_info);
+            bool function = type == STT_FUNC
+                || (type == STT_NOTYPE && ELF32_ST_BIND(sym.st_info) == STB_GLOBAL);
+
+            if (not function || sym.st_name >= strtab.sh_size
+                    || sym.st_shndx == SHN_UNDEF || sym.st_shndx >= sections.size()
+                    || not (sections[sym.st_shndx].sh_flags & SHF_EXECINSTR))
+                continue;
+
+            auto name = names + sym.st_name;
+            image.symbols.push_back({ uint16_t(sym.st_value), std::string(name, strnlen(name, strtab.sh_size - sym.st_name)) });
+        }
+    }
+
+    std::ranges::sort(image.symbols, {}, &MSP430::Symbol::address);
+    image.snapshot.registers[PC] = header.e_entry;
+}
+
+std::shared_ptr<const MSP430::Image> MSP430::load_image(const char* path)
+{
+    MappedFile file(path);
+    auto image = std::make_shared<Image>();
+
+    bool elf = is_elf(file, path);
+
+    image->snapshot.memory = make_snapshot_memory([&](RAM& ram) {
+        if (elf) {
+            load_elf(file, ram, *image);
+        } else {
+            check_range(0, file.size, RAM_SIZE, "Binary too large");
+            if (file.size > 0)
+                memcpy(ram.data(), file.data, file.size);
+        }
+    });
+
+    return image;
+}
+
+void MSP430::load(std::shared_ptr<const Image> loaded)
+{
+    restore(loaded->snapshot);
+
+    bool changed = false;
+    for (size_t page=0; page<PAGES; page++) {
+        auto updated = (page_attributes[page] & ~page_protection) | loaded->protection[page];
+        changed |= page_attributes[page] != updated;
+        page_attributes[page] = updated;
+    }
+    // As in protect, code was only checked for execution once
+    if (changed)
+        invalidate_decode_cache();
+
+    image = std::move(loaded);
+}
+
+const MSP430::Symbol* MSP430::find_symbol(uint16_t address) const
+{
+    if (not image)
+        return nullptr;
+
+    auto& symbols = image->symbols;
+    auto it = std::ranges::upper_bound(symbols, address, {}, &Symbol::address);
+    return it == symbols.begin() ? nullptr : &*std::prev(it);
+}
+
+std::shared_ptr<const MSP430X::Image> MSP430X::load_image(const char* path)
+{
+    MappedFile file(path);
+    auto image = std::make_shared<Image>();
+    std::array<std::shared_ptr<Page>, PAGES> pages;
+
+    // Pages are allocated as the program reaches them
+    auto store = [&](uint32_t address, const uint8_t* contents, uint32_t file_size, uint32_t memory_size) {
+        for (uint32_t done=0; done<memory_size;) {
+            auto offset = (address + done) % PAGE_BYTES;
+            auto length = std::min<uint32_t>(memory_size - done, PAGE_BYTES - offset);
+            auto& page = pages[(address + done) / PAGE_BYTES];
+            if (not page)
+                page = std::make_shared<Page>();
+
+            auto copied = done < file_size ? std::min(length, file_size - done) : 0;
+            if (copied > 0)
+                memcpy(page->data() + offset, contents + done, copied);
+            memset(page->data() + offset + copied, 0, length - copied);
+            done += length;
+        }
+    };
+
+    if (is_elf(file, path)) {
+        auto& header = elf_header(file);
+        load_contents(file, header, ADDRESS_SPACE, store);
+        image->entry = header.e_entry & ADDRESS_MASK;
+    } else {
+        check_range(0, file.size, ADDRESS_SPACE, "Binary too large");
+        store(0, file.data, file.size, file.size);
+    }
+
+    std::ranges::copy(pages, image->pages.begin());
+    return image;
+}
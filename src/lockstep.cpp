@@ -0,0 +1,719 @@
+#include "lockstep.hpp"
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+
+// Lockstep execution
+//
+// Every lane of a group is its own instance, with its own memory, of one
+// program. Registers are kept transposed, register n of every lane in one
+// vector, so an instruction is decoded once and runs for all lanes with
+// vector operations. Only loads and stores go lane by lane.
+//
+// Lanes drift apart at branches going different ways. Each step runs the
+// instruction at the lowest PC of any lane, for the lanes there, so lanes
+// behind catch up: a loop runs until its last lane has left, and lanes that
+// skipped ahead wait where the others join them.
+//
+// Anything out of the ordinary - devices, SR as a register, interrupts,
+// trapping, misaligned and protected accesses, DADD and RETI - is run for
+// each lane alone by its instance's run(1), with its registers copied over
+// and back.
+//
+// A lane taking a jump into a loop run() skips (see check_tight_loop), such
+// as a final jmp $ or a delay countdown, finishes alone: its instance's run()
+// gets the rest of its budget, which skips the loop and runs what follows.
+//
+// Lanes start from one snapshot, so pages no lane has written hold the same
+// code in all of them, which the decode cache holds once for every group.
+// Instructions in written pages are decoded each step, and only lanes
+// holding the same words run them together.
+
+static constexpr unsigned LANES = LOCKSTEP_LANES;
+
+// One element per lane. Comparisons give masks, all ones where true.
+typedef uint16_t Vec __attribute__((vector_size(2 * LANES)));
+typedef int16_t Mask __attribute__((vector_size(2 * LANES)));
+typedef uint64_t Count __attribute__((vector_size(8 * LANES)));
+
+struct Group;
+struct LaneInsn;
+
+// Runs the instruction for the lanes in mask at, returns those it ran
+using LaneHandler = Mask (*)(Group&, const LaneInsn&, Mask at);
+
+struct LaneInsn {
+    LaneHandler handler; // Null until decoded
+    uint16_t words[3];
+    uint16_t src_ext;
+    uint16_t dst_ext;
+    uint8_t src_reg: 4, src_kind: 4;
+    uint8_t dst_reg: 4, dst_kind: 4;
+    uint8_t length; // In bytes, 0 for instructions left to run()
+};
+
+struct Lockstep::DecodeCache {
+    LaneInsn entries[MSP430::RAM_SIZE / 2];
+};
+
+struct Group {
+    Vec registers[16];
+    Mask running;           // Lanes yet to stop
+    unsigned remaining = 0; // Of them
+    Count executed;         // Instructions run by each lane
+    uint32_t solo = 0;      // Lanes with an interrupt to take
+    uint32_t deferred = 0;  // Lanes of this step left to run()
+    uint32_t idle = 0;      // Lanes of this step that jumped into a tight loop
+    size_t max_instructions = 0;
+
+    // Lanes are restored from one snapshot and never instrumented, so share
+    // the page attributes of the first
+    const uint8_t* attributes;
+    std::array<bool, MSP430::PAGES> written = {}; // By any lane
+
+    MSP430* lanes[LANES];
+    FleetJob* jobs[LANES];
+};
+
+static inline Vec
+splat(uint16_t value)
+{
+    return Vec{} + value;
+}
+
+static inline void
+defer(Group& g, Mask m)
+{
+    for (unsigned i=0; i<LANES; i++)
+        g.deferred |= (m[i] & 1u) << i;
+}
+
+// Memory access
+
+static inline bool
+is_memory(OperandKind kind)
+{
+    return kind >= indexed;
+}
+
+static inline Vec
+operand_address(const Group& g, OperandKind kind, uint8_t reg, uint16_t ext)
+{
+    switch (kind) {
+        case indexed:
+            return g.registers[reg] + ext;
+        case absolute:
+            return splat(ext);
+        case indirect:
+        case autoincrement:
+            return g.registers[reg];
+        case reg_direct:
+        case constant:
+            return Vec{};
+    }
+    unreachable();
+}
+
+// Lanes whose access would take the slow path are left to run(), the rest
+// are returned. Called for every operand before anything is changed.
+template <ByteWord mode>
+static Mask
+plain_access(Group& g, Mask at, Vec address, uint8_t trap)
+{
+    Mask plain = at;
+    if constexpr (mode == Word)
+        plain &= (address & 1) == 0;
+    for (unsigned i=0; i<LANES; i++) {
+        if (plain[i] && (g.attributes[address[i] / MSP430::PAGE_BYTES] & trap))
+            plain[i] = 0;
+    }
+    defer(g, at & ~plain);
+    return plain;
+}
+
+template <ByteWord mode>
+static Vec
+load(const Group& g, Mask at, Vec address)
+{
+    Vec value = {};
+    for (unsigned i=0; i<LANES; i++) {
+        if (at[i])
+            value[i] = load_ram<mode>(*g.lanes[i], address[i]);
+    }
+    return value;
+}
+
+template <ByteWord mode>
+static void
+store(Group& g, Mask at, Vec address, Vec value)
+{
+    for (unsigned i=0; i<LANES; i++) {
+        if (at[i]) {
+            g.written[address[i] / MSP430::PAGE_BYTES] = true;
+            store_ram<mode>(*g.lanes[i], address[i], value[i]);
+        }
+    }
+}
+
+template <ByteWord access>
+static inline Vec
+operand_value(const Group& g, Mask at, OperandKind kind, uint8_t reg, uint16_t ext, Vec address)
+{
+    switch (kind) {
+        case reg_direct:
+            return g.registers[reg];
+        case constant:
+            return splat(ext);
+        default:
+            return load<access>(g, at, address);
+    }
+}
+
+// Flags
+//
+// Written to SR straight away, for all lanes that is a few vector operations
+
+static inline Vec
+flag(Mask condition, uint16_t bit)
+{
+    return Vec(condition) & bit;
+}
+
+static inline Vec
+with_lane_flags(Vec sr, Mask carry, Mask zero, Mask sign, Mask overflow)
+{
+    return (sr & uint16_t(~ALU))
+        | flag(carry, CF)
+        | flag(zero, ZF)
+        | flag(sign, NF)
+        | flag(overflow, VF);
+}
+
+// a + b + carry with the flags of alu_flags_update, b inverted already for
+// subtraction
+template <ByteWord mode>
+static inline Vec
+lane_add(Vec& sr, Vec a, Vec b, Vec carry)
+{
+    constexpr uint16_t sign = Constants<mode>::sign;
+    Vec sum;
+    Mask carry_out;
+
+    if constexpr (mode == Byte) {
+        sum = a + b + carry;
+        carry_out = (sum >> 8) != 0;
+        sum &= 0xff;
+    } else {
+        Vec partial = a + b;
+        sum = partial + carry;
+        carry_out = (partial < a) | (sum < partial);
+    }
+
+    Vec overflow = (a ^ sum) & (b ^ sum) & sign;
+    sr = with_lane_flags(sr, carry_out, sum == 0, (sum & sign) != 0, overflow != 0);
+    return sum;
+}
+
+template <ByteWord mode>
+static inline Vec
+lane_logic_flags(Vec sr, Vec value, Mask overflow)
+{
+    return with_lane_flags(sr, value != 0, value == 0, (value & Constants<mode>::sign) != 0, overflow);
+}
+
+// Execution
+
+template <DualOpCode op>
+static constexpr uint8_t dest_trap =
+    op == MOV ? MSP430::page_write_trap
+    : op == CMP || op == BIT ? MSP430::page_read_trap
+    : MSP430::page_read_trap | MSP430::page_write_trap;
+
+template <ByteWord mode, DualOpCode op>
+static Mask
+lane_dual_op(Group& g, const LaneInsn& e, Mask at)
+{
+    auto& r = g.registers;
+    auto src_kind = OperandKind(e.src_kind);
+    auto dst_kind = OperandKind(e.dst_kind);
+    uint16_t increment = (mode == Byte && e.src_reg > SP) ? 1 : 2;
+
+    Vec src_address = operand_address(g, src_kind, e.src_reg, e.src_ext);
+    Vec dst_address = operand_address(g, dst_kind, e.dst_reg, e.dst_ext);
+    if (src_kind == autoincrement && dst_kind == indexed && e.src_reg == e.dst_reg)
+        dst_address += increment;
+    if (is_memory(src_kind))
+        at = plain_access<mode>(g, at, src_address, MSP430::page_read_trap);
+    if (is_memory(dst_kind))
+        at = plain_access<mode>(g, at, dst_address, dest_trap<op>);
+
+    r[PC] = at ? r[PC] + e.length : r[PC];
+    Vec source = operand_value<mode>(g, at, src_kind, e.src_reg, e.src_ext, src_address);
+    if (src_kind == autoincrement)
+        r[e.src_reg] = at ? r[e.src_reg] + increment : r[e.src_reg];
+
+    Vec result;
+    if constexpr (op == MOV) {
+        result = source;
+    } else {
+        constexpr uint16_t mask = Constants<mode>::mask;
+        constexpr uint16_t sign = Constants<mode>::sign;
+        source &= mask;
+        Vec target = dst_kind == reg_direct ? r[e.dst_reg] & mask : load<mode>(g, at, dst_address);
+        Vec sr = r[SR];
+        Vec carry = sr & uint16_t(CF);
+
+        switch (op) {
+            case ADD:  result = lane_add<mode>(sr, target, source, Vec{}); break;
+            case ADDC: result = lane_add<mode>(sr, target, source, carry); break;
+            case SUBC: result = lane_add<mode>(sr, target, ~source & mask, carry); break;
+            case SUB:
+            case CMP:  result = lane_add<mode>(sr, target, ~source & mask, splat(1)); break;
+            case BIT:
+            case AND:
+                result = target & source;
+                sr = lane_logic_flags<mode>(sr, result, Mask{});
+                break;
+            case BIC:  result = target & ~source; break;
+            case BIS:  result = target | source; break;
+            case XOR:
+                result = target ^ source;
+                sr = lane_logic_flags<mode>(sr, result, (source & target & sign) != 0);
+                break;
+            default:
+                unreachable();
+        }
+
+        r[SR] = at ? sr : r[SR];
+        if constexpr (op == CMP || op == BIT)
+            return at;
+    }
+
+    if (dst_kind == reg_direct)
+        r[e.dst_reg] = at ? result & Constants<mode>::mask : r[e.dst_reg];
+    else
+        store<mode>(g, at, dst_address, result);
+    return at;
+}
+
+// Decoding leaves PUSH and CALL of SP operands to run(), they read SP part
+// way through updating it
+template <ByteWord mode, SingleOpCode op>
+static Mask
+lane_single_op(Group& g, const LaneInsn& e, Mask at)
+{
+    auto& r = g.registers;
+    auto kind = OperandKind(e.dst_kind);
+    uint16_t increment = (mode == Byte && e.dst_reg > SP) ? 1 : 2;
+    Vec address = operand_address(g, kind, e.dst_reg, e.dst_ext);
+
+    if constexpr (op == PUSH || op == CALL) {
+        constexpr ByteWord access = op == CALL ? Word : mode;
+        Vec sp = r[SP] - 2;
+        if (is_memory(kind))
+            at = plain_access<access>(g, at, address, MSP430::page_read_trap);
+        at = plain_access<mode>(g, at, sp, MSP430::page_write_trap);
+
+        r[PC] = at ? r[PC] + e.length : r[PC];
+        Vec value = operand_value<access>(g, at, kind, e.dst_reg, e.dst_ext, address);
+        if (kind == autoincrement)
+            r[e.dst_reg] = at ? r[e.dst_reg] + increment : r[e.dst_reg];
+        r[SP] = at ? sp : r[SP];
+
+        if constexpr (op == PUSH) {
+            store<mode>(g, at, sp, value);
+        } else {
+            store<Word>(g, at, sp, r[PC]);
+            r[PC] = at ? value : r[PC];
+        }
+        return at;
+    } else {
+        // SWPB and SXT write a whole word
+        constexpr ByteWord access = op == SWPB || op == SXT ? Word : mode;
+        constexpr ByteWord read = op == SXT ? Byte : access;
+        if (is_memory(kind))
+            at = plain_access<access>(g, at, address, MSP430::page_read_trap | MSP430::page_write_trap);
+
+        r[PC] = at ? r[PC] + e.length : r[PC];
+        if (kind == autoincrement)
+            r[e.dst_reg] = at ? r[e.dst_reg] + increment : r[e.dst_reg];
+        Vec value = kind == reg_direct
+            ? r[e.dst_reg] & Constants<read>::mask
+            : load<read>(g, at, address);
+
+        constexpr uint16_t sign = Constants<mode>::sign;
+        Vec sr = r[SR];
+        Vec result;
+
+        switch (op) {
+            case RRC:
+            case RRA: {
+                Vec high = op == RRC ? (sr & uint16_t(CF)) * sign : value & sign;
+                result = (value >> 1) | high;
+                sr = with_lane_flags(sr, (value & 1) != 0, result == 0, (result & sign) != 0, Mask{});
+                break;
+            }
+            case SWPB:
+                result = (value << 8) | (value >> 8);
+                break;
+            case SXT:
+                result = value | (Vec((value & 0x80) != 0) & 0xff00);
+                sr = lane_logic_flags<Word>(sr, result, Mask{});
+                break;
+            default:
+                unreachable();
+        }
+
+        r[SR] = at ? sr : r[SR];
+        if (kind == reg_direct)
+            r[e.dst_reg] = at ? result & Constants<access>::mask : r[e.dst_reg];
+        else
+            store<access>(g, at, address, result);
+        return at;
+    }
+}
+
+template <Condition cond>
+static Mask
+lane_conditional_op(Group& g, const LaneInsn& e, Mask at)
+{
+    auto& pc = g.registers[PC];
+    Vec sr = g.registers[SR];
+    Mask taken;
+
+    switch (cond) {
+        case not_equal:     taken = (sr & uint16_t(ZF)) == 0; break;
+        case equal:         taken = (sr & uint16_t(ZF)) != 0; break;
+        case no_carry:      taken = (sr & uint16_t(CF)) == 0; break;
+        case carry:         taken = (sr & uint16_t(CF)) != 0; break;
+        case negative:      taken = (sr & uint16_t(NF)) != 0; break;
+        case greater_equal: taken = ((sr & uint16_t(NF)) != 0) == ((sr & uint16_t(VF)) != 0); break;
+        case less:          taken = ((sr & uint16_t(NF)) != 0) != ((sr & uint16_t(VF)) != 0); break;
+        case always:        taken = at; break;
+    }
+
+    pc = at ? (taken ? splat(e.dst_ext) : pc + 2) : pc;
+    return at;
+}
+
+// Conditional jumps back over at most one instruction, noting the lanes that
+// jumped
+template <Condition cond>
+static Mask
+lane_tight_jump(Group& g, const LaneInsn& e, Mask at)
+{
+    lane_conditional_op<cond>(g, e, at);
+    Mask jumped = at & (g.registers[PC] == e.dst_ext);
+    for (unsigned i=0; i<LANES; i++)
+        g.idle |= (jumped[i] & 1u) << i;
+    return at;
+}
+
+static Mask
+lane_fallback(Group& g, const LaneInsn&, Mask at)
+{
+    defer(g, at);
+    return Mask{};
+}
+
+template <ByteWord mode>
+static constexpr LaneHandler lane_dual_op_handlers[16] = {
+    nullptr, nullptr, nullptr, nullptr,
+    lane_dual_op<mode, MOV>,
+    lane_dual_op<mode, ADD>,
+    lane_dual_op<mode, ADDC>,
+    lane_dual_op<mode, SUBC>,
+    lane_dual_op<mode, SUB>,
+    lane_dual_op<mode, CMP>,
+    lane_fallback,
+    lane_dual_op<mode, BIT>,
+    lane_dual_op<mode, BIC>,
+    lane_dual_op<mode, BIS>,
+    lane_dual_op<mode, XOR>,
+    lane_dual_op<mode, AND>,
+};
+
+template <ByteWord mode>
+static constexpr LaneHandler lane_single_op_handlers[8] = {
+    lane_single_op<mode, RRC>,
+    lane_single_op<mode, SWPB>,
+    lane_single_op<mode, RRA>,
+    lane_single_op<mode, SXT>,
+    lane_single_op<mode, PUSH>,
+    lane_single_op<mode, CALL>,
+    lane_fallback,
+    lane_fallback,
+};
+
+static constexpr LaneHandler lane_conditional_handlers[8] = {
+    lane_conditional_op<not_equal>,
+    lane_conditional_op<equal>,
+    lane_conditional_op<no_carry>,
+    lane_conditional_op<carry>,
+    lane_conditional_op<negative>,
+    lane_conditional_op<greater_equal>,
+    lane_conditional_op<less>,
+    lane_conditional_op<always>,
+};
+
+static constexpr LaneHandler lane_tight_jump_handlers[8] = {
+    lane_tight_jump<not_equal>,
+    lane_tight_jump<equal>,
+    lane_tight_jump<no_carry>,
+    lane_tight_jump<carry>,
+    lane_tight_jump<negative>,
+    lane_tight_jump<greater_equal>,
+    lane_tight_jump<less>,
+    lane_tight_jump<always>,
+};
+
+// Decoding, as for the decode cache
+
+static LaneInsn
+decode(const Group& g, const uint16_t* words, uint16_t pc)
+{
+    LaneInsn fallback = {};
+    fallback.handler = lane_fallback;
+
+    if (pc > MMIO_BASE - 6 || (pc & 1))
+        return fallback;
+
+    Fetch fetch = {
+        .words = words,
+        .pc = pc,
+        .count = 1,
+    };
+    auto instruction = fetch.words[0];
+
+    LaneInsn e = {};
+    Operand src = {}, dst = {};
+
+    switch (MSP430::classify(instruction)) {
+        case MSP430::invalid:
+            return fallback;
+
+        case MSP430::conditional: {
+            auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+            e.handler = is_tight_jump(op)
+                ? lane_tight_jump_handlers[op.condition]
+                : lane_conditional_handlers[op.condition];
+            dst.ext = pc + 2 + (uint16_t(int16_t(op.offset)) << 1);
+            break;
+        }
+
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            if (op.opcode == RETI || not decode_single(op, fetch, dst))
+                return fallback;
+            if ((op.opcode == PUSH || op.opcode == CALL) && dst.kind != constant && dst.reg == SP)
+                return fallback;
+            e.handler = op.bw
+                ? lane_single_op_handlers<Byte>[op.opcode]
+                : lane_single_op_handlers<Word>[op.opcode];
+            break;
+        }
+
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            if (not decode_source(op, fetch, src) || not decode_dest(op, fetch, dst))
+                return fallback;
+            e.handler = op.bw
+                ? lane_dual_op_handlers<Byte>[op.opcode]
+                : lane_dual_op_handlers<Word>[op.opcode];
+            break;
+        }
+    }
+
+    // SR as a register and fetches run() would check are also left to it
+    if ((src.kind == reg_direct && src.reg == SR) || (dst.kind == reg_direct && dst.reg == SR))
+        return fallback;
+    for (unsigned i=0; i<fetch.count; i++) {
+        if (g.attributes[(pc + 2 * i) / MSP430::PAGE_BYTES] & MSP430::page_fetch_trap)
+            return fallback;
+    }
+
+    if (e.handler == lane_fallback)
+        return fallback;
+
+    for (unsigned i=0; i<fetch.count; i++)
+        e.words[i] = fetch.words[i];
+    e.src_ext = src.ext;
+    e.src_reg = src.reg;
+    e.src_kind = src.kind;
+    e.dst_ext = dst.ext;
+    e.dst_reg = dst.reg;
+    e.dst_kind = dst.kind;
+    e.length = 2 * fetch.count;
+    return e;
+}
+
+static inline const uint16_t*
+lane_words(const Group& g, unsigned lane, uint16_t pc)
+{
+    return reinterpret_cast<const uint16_t*>(&(*g.lanes[lane]->ram)[pc]);
+}
+
+// Lanes in at holding the words e was decoded from
+static Mask
+same_code(const Group& g, Mask at, uint16_t pc, const LaneInsn& e)
+{
+    for (unsigned i=0; i<LANES; i++) {
+        if (at[i] && memcmp(lane_words(g, i, pc), e.words, e.length) != 0)
+            at[i] = 0;
+    }
+    return at;
+}
+
+// Stepping
+
+static void
+stop_lane(Group& g, unsigned lane, MSP430::RunResult result)
+{
+    result.instructions = g.executed[lane];
+    g.jobs[lane]->result = std::move(result);
+    g.running[lane] = 0;
+    g.remaining--;
+    g.solo &= ~(1u << lane);
+}
+
+// Runs the lane alone for up to budget instructions
+static void
+run_lane(Group& g, unsigned lane, size_t budget = 1)
+{
+    auto& msp = *g.lanes[lane];
+    for (unsigned reg=0; reg<16; reg++)
+        msp.registers[reg] = g.registers[reg][lane];
+
+    auto result = msp.run(budget);
+
+    for (unsigned reg=0; reg<16; reg++)
+        g.registers[reg][lane] = msp.registers[reg];
+    for (unsigned page=0; page<MSP430::PAGES; page++)
+        g.written[page] |= msp.dirty[page];
+    g.executed[lane] += result.instructions;
+
+    if (result.reason != MSP430::StopReason::budget || g.executed[lane] >= g.max_instructions)
+        return stop_lane(g, lane, std::move(result));
+
+    // Interrupts are taken by run() before the next instruction
+    bool interrupt = msp.pending_interrupts && (msp.registers[SR] & IF);
+    g.solo = (g.solo & ~(1u << lane)) | interrupt << lane;
+}
+
+static void
+step(Group& g, Lockstep::DecodeCache& cache)
+{
+    auto& r = g.registers;
+
+    Vec pcs = r[PC] | ~Vec(g.running);
+    uint16_t pc = UINT16_MAX;
+    for (unsigned i=0; i<LANES; i++)
+        pc = std::min(pc, pcs[i]);
+
+    Mask at = g.running & (r[PC] == pc);
+    g.deferred = 0;
+    g.idle = 0;
+    if (g.solo) {
+        for (unsigned i=0; i<LANES; i++) {
+            if (at[i] && (g.solo >> i & 1)) {
+                g.deferred |= 1u << i;
+                at[i] = 0;
+            }
+        }
+    }
+
+    unsigned first = 0;
+    while (first < LANES && not at[first])
+        first++;
+
+    if (first < LANES) {
+        auto page = pc / MSP430::PAGE_BYTES;
+        auto last = uint16_t(pc + 4) / MSP430::PAGE_BYTES;
+        auto words = lane_words(g, first, pc);
+
+        Mask done;
+        if (not g.written[page] && not g.written[last]) {
+            auto& entry = cache.entries[pc >> 1];
+            if (not entry.handler)
+                entry = decode(g, words, pc);
+            done = entry.handler(g, entry, at);
+        } else {
+            auto entry = decode(g, words, pc);
+            done = entry.handler(g, entry, same_code(g, at, pc, entry));
+        }
+        g.executed -= __builtin_convertvector(done, Count);
+    }
+
+    for (auto lanes = g.deferred; lanes; lanes &= lanes - 1)
+        run_lane(g, std::countr_zero(lanes));
+
+    // As check_tight_loop, with the lane's registers
+    for (auto lanes = g.idle; lanes; lanes &= lanes - 1) {
+        auto lane = std::countr_zero(lanes);
+        auto& msp = *g.lanes[lane];
+        for (unsigned reg=0; reg<16; reg++)
+            msp.registers[reg] = r[reg][lane];
+        if (is_tight_loop(msp, msp.registers[PC]))
+            run_lane(g, lane, g.max_instructions - g.executed[lane]);
+    }
+}
+
+Lockstep::Lockstep(std::shared_ptr<const MSP430::Image> image, MSP430::RamPool& pool, unsigned partition)
+    : image(std::move(image)), pool(pool), partition(partition), decode_cache(std::make_unique<DecodeCache>())
+{
+}
+
+Lockstep::~Lockstep() = default;
+
+void
+Lockstep::run(std::span<FleetJob> jobs, size_t max_instructions)
+{
+    if (jobs.size() > LANES)
+        throw Error("Too many jobs for one lockstep group");
+
+    Group g = {};
+    g.max_instructions = max_instructions;
+
+    for (unsigned i=0; i<jobs.size(); i++) {
+        if (not lanes[i]) {
+            lanes[i] = std::make_unique<MSP430>(pool, partition);
+            lanes[i]->engine = MSP430::Engine::reference; // Only steps single instructions
+        }
+        auto& msp = *lanes[i];
+        msp.load(image);
+        msp.restart_timer();
+        connect_job(msp, jobs[i]);
+
+        for (unsigned reg=0; reg<16; reg++)
+            g.registers[reg][i] = msp.registers[reg];
+        g.running[i] = -1;
+        g.remaining++;
+        g.lanes[i] = &msp;
+        g.jobs[i] = &jobs[i];
+    }
+    if (jobs.empty())
+        return;
+    g.attributes = lanes[0]->page_attributes.data();
+
+    // Each step runs any lane at most once, so no lane can reach the budget
+    // for as many steps as the furthest along is short of it
+    size_t runway = 0;
+
+    while (g.remaining) {
+        if (runway == 0) {
+            size_t furthest = 0;
+            for (unsigned i=0; i<LANES; i++) {
+                if (g.running[i] && g.executed[i] >= max_instructions)
+                    stop_lane(g, i, { MSP430::StopReason::budget, 0, {} });
+                else if (g.running[i])
+                    furthest = std::max<size_t>(furthest, g.executed[i]);
+            }
+            if (not g.remaining)
+                return;
+            runway = max_instructions - furthest;
+        }
+
+        step(g, *decode_cache);
+        runway--;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+// Runs groups of instances of one program together, each instance a lane of
+// vector registers
+
+#include "fleet.hpp"
+
+#include <memory>
+#include <span>
+
+// 16 bit registers of every lane fill a 256 bit vector
+static constexpr unsigned LOCKSTEP_LANES = 16;
+
+struct Lockstep {
+    // Decoded instructions of image, kept for every group run from it
+    struct DecodeCache;
+
+    // Lanes take their ram from pool, first from partition
+    Lockstep(std::shared_ptr<const MSP430::Image> image, MSP430::RamPool& pool, unsigned partition = 0);
+    ~Lockstep();
+
+    // Runs up to LOCKSTEP_LANES jobs until every one has stopped, with the
+    // results run_fleet gives running them alone
+    void run(std::span<FleetJob> jobs, size_t max_instructions);
+
+    std::shared_ptr<const MSP430::Image> image;
+    MSP430::RamPool& pool;
+    unsigned partition;
+    std::unique_ptr<DecodeCache> decode_cache;
+
+    // Made by the first group needing them and kept, so later groups restore
+    // only the pages written before
+    std::unique_ptr<MSP430> lanes[LOCKSTEP_LANES];
+};
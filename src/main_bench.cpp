@@ -0,0 +1,152 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "msp430.hpp"
+
+// Built-in kernels, loaded at 0x1000 and looping forever
+struct Kernel {
+    const char* name;
+    std::vector<uint16_t> code;
+};
+
+static const Kernel kernels[] = {
+    { "alu", {
+        0x4034, 0x1234,     // mov #0x1234, r4
+        0x4035, 0x5678,     // mov #0x5678, r5
+        0x5405,             // 1: add r4, r5
+        0xe504,             //    xor r5, r4
+        0x5404,             //    rla r4
+        0x6506,             //    addc r5, r6
+        0x8607,             //    sub r6, r7
+        0x1085,             //    swpb r5
+        0x3ff9,             //    jmp 1b
+    } },
+    { "memcpy", {
+        0x4034, 0x2000,     // 1: mov #0x2000, r4
+        0x4035, 0x3000,     //    mov #0x3000, r5
+        0x4036, 0x0100,     //    mov #256, r6
+        0x44b5, 0x0000,     // 2: mov @r4+, 0(r5)
+        0x5325,             //    incd r5
+        0x8316,             //    dec r6
+        0x23fb,             //    jnz 2b
+        0x3ff4,             //    jmp 1b
+    } },
+    { "calls", {
+        0x12b0, 0x1006,     // 1: call #func
+        0x3ffd,             //    jmp 1b
+        0x1204,             // func: push r4
+        0x5314,             //    inc r4
+        0x12b0, 0x1012,     //    call #leaf
+        0x4134,             //    pop r4
+        0x4130,             //    ret
+        0x5405,             // leaf: add r4, r5
+        0x4130,             //    ret
+    } },
+};
+
+struct Program {
+    std::string name;
+    MSP430::Snapshot snapshot;
+    bool restart; // Runs again from snapshot each time it exits
+};
+
+// Instructions per microsecond running program until at least
+// instructions, or 0 if it stopped for any reason but budget or exit
+static double
+measure(const Program& program, MSP430::Engine engine, size_t instructions)
+{
+    MSP430 msp430{};
+    msp430.engine = engine;
+    msp430.uart_print = [](char) {};
+    msp430.uart_read = [] { return '\0'; };
+    msp430.restore(program.snapshot);
+
+    size_t executed = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (executed < instructions) {
+        auto result = msp430.run(instructions - executed);
+        executed += result.instructions;
+
+        if (result.reason == MSP430::StopReason::exit && program.restart) {
+            msp430.restore(program.snapshot);
+        } else if (result.reason != MSP430::StopReason::budget) {
+            fprintf(
+                stderr, "%s stopped after %zu steps: %s%s%s\n",
+                program.name.c_str(), executed, MSP430::stop_reason_name(result.reason),
+                result.message.empty() ? "" : ", ", result.message.c_str()
+            );
+            return 0;
+        }
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return executed / elapsed.count();
+}
+
+int main(int argc, char** argv)
+{
+    static const char* usage =
+        "Usage: %s [-e engine] [-n instructions] [file...]\n"
+        "Reports MIPS of each engine on the built-in kernels and each file,\n"
+        "which are restarted whenever they exit.\n";
+
+    std::vector<const char*> engines = { "reference", "cached", "threaded", "jit" };
+    size_t instructions = 50'000'000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:n:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (MSP430::Engine engine; not MSP430::parse_engine(optarg, engine)) {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                engines = { optarg };
+                break;
+            case 'n':
+                instructions = strtoull(optarg, nullptr, 0);
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+        }
+    }
+
+    std::vector<Program> programs;
+    for (auto& kernel : kernels) {
+        MSP430 msp430{};
+        for (size_t i=0; i<kernel.code.size(); i++)
+            memcpy(&(*msp430.ram)[0x1000 + 2*i], &kernel.code[i], 2);
+        msp430.registers[MSP430::PC] = 0x1000;
+        msp430.registers[MSP430::SP] = 0x8000;
+        programs.push_back({ kernel.name, msp430.snapshot(), false });
+    }
+    for (int i=optind; i<argc; i++) {
+        try {
+            programs.push_back({ argv[i], MSP430::load_image(argv[i])->snapshot, true });
+        } catch (std::exception& e) {
+            fprintf(stderr, "Failed to load file '%s', reason: %s\n", argv[i], e.what());
+            return 1;
+        }
+    }
+
+    printf("%-24s", "MIPS");
+    for (auto engine : engines)
+        printf(" %10s", engine);
+    printf("\n");
+
+    for (auto& program : programs) {
+        printf("%-24s", program.name.c_str());
+        for (auto name : engines) {
+            MSP430::Engine engine;
+            MSP430::parse_engine(name, engine);
+            printf(" %10.1f", measure(program, engine, instructions));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return 0;
+}
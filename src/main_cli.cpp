@@ -1,44 +1,134 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "msp430.hpp"
+#include "msp430x.hpp"
+#include "profile.hpp"
+#include "trace.hpp"
+#include "uart.hpp"
 
-void MSP430::uart_print(char c) {
-    putchar(c);
+static void write_profile(const char* prefix, const char* suffix, auto write)
+{
+    auto path = std::string(prefix) + suffix;
+    auto fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) {
+        fprintf(stderr, "Failed to write '%s', reason: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    write(fp);
+    fclose(fp);
 }
 
-char MSP430::uart_read() {
-    return getchar();
+// Runs path on the MSP430X core, which has no engines or tools
+static int run_extended(const char* path, UartIo& uart)
+{
+    MSP430X msp430x{};
+    msp430x.uart_print = [&](char c) { uart.print(c); };
+    msp430x.uart_read = [&] { return uart.read(); };
+    msp430x.uart_status = [&] { return uart.status(); };
+
+    try {
+        msp430x.load(MSP430X::load_image(path));
+    } catch (std::exception& e) {
+        fprintf(stderr, "Failed to load file '%s', reason: %s\n", path, e.what());
+        return 1;
+    }
+
+    auto result = msp430x.run(SIZE_MAX);
+    uart.drain();
+
+    fprintf(
+        stderr, "Terminated after %zu steps\nReason: %s%s%s\nState:\n",
+        result.instructions, MSP430::stop_reason_name(result.reason),
+        result.message.empty() ? "" : ", ", result.message.c_str()
+    );
+    for (unsigned reg=0; reg<16; reg++)
+        fprintf(stderr, "R%-2u %05x%s", reg, msp430x.registers[reg], reg % 4 == 3 ? "\n" : "  ");
+
+    return result.reason == MSP430::StopReason::exit ? 0 : 1;
 }
 
 int main(int argc, char** argv)
 {
     puts("=== msp430emu-cli ===");
+    fflush(stdout); // The UART writes to the descriptor
 
+    UartIo uart(STDIN_FILENO, STDOUT_FILENO);
     MSP430 msp430{};
+    uart.connect(msp430);
+
+    Profile profile{};
+    const char* profile_prefix = nullptr;
+    std::unique_ptr<Tracer> tracer;
+    bool extended = false;
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "ce:p:t:x")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (not MSP430::parse_engine(optarg, msp430.engine)) {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                msp430.timing = true;
+                break;
+            case 'p':
+                profile_prefix = optarg;
+                msp430.profile = &profile;
+                break;
+            case 't':
+                try {
+                    tracer = std::make_unique<Tracer>(optarg);
+                } catch (std::exception& e) {
+                    fprintf(stderr, "Failed to open trace '%s', reason: %s\n", optarg, e.what());
+                    return 1;
+                }
+                msp430.trace = tracer.get();
+                break;
+            case 'x':
+                extended = true;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-c] [-e reference|cached|threaded|jit] [-p profile_prefix] [-t trace_file] [-x] <file>\n", argv[0]);
         return 0;
     }
 
+    const char* path = argv[optind];
+    if (extended)
+        return run_extended(path, uart);
+
     try {
-        msp430.load_file(argv[1]);
+        msp430.load_file(path);
     } catch (std::exception& e) {
-        fprintf(stderr, "Failed to load file '%s', reason: %s\n", argv[1], e.what());
+        fprintf(stderr, "Failed to load file '%s', reason: %s\n", path, e.what());
         return 1;
     }
 
-    size_t instruction_counter = 0;
+    auto result = msp430.run(SIZE_MAX);
+    uart.drain();
 
-    try {
-        for (;;) {
-            msp430.step_instruction();
-            instruction_counter++;
-        }
-    } catch (std::exception& e) {
-        fprintf(
-            stderr, "Terminated after %zu steps\nReason: %s\nState:\n%s\n", 
-            instruction_counter, e.what(), msp430.print_array().data()
-        );
+    fprintf(
+        stderr, "Terminated after %zu steps\nReason: %s%s%s\nState:\n%s\n",
+        result.instructions, MSP430::stop_reason_name(result.reason),
+        result.message.empty() ? "" : ", ", result.message.c_str(),
+        msp430.print_array().data()
+    );
+
+    if (msp430.timing)
+        fprintf(stderr, "Cycles: %llu (%llu us)\n", (unsigned long long)msp430.cycles, (unsigned long long)msp430.virtual_microseconds());
+
+    if (profile_prefix) {
+        write_profile(profile_prefix, ".flat", [&](FILE* fp) { profile.write_flat(fp, msp430); });
+        write_profile(profile_prefix, ".folded", [&](FILE* fp) { profile.write_folded(fp, msp430); });
     }
-}
\ No newline at end of file
+
+    return result.reason == MSP430::StopReason::exit ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "fleet.hpp"
+
+static bool read_file(const char* path, std::string& out)
+{
+    struct Closer { void operator()(FILE* p) { fclose(p); }};
+    auto fp = std::unique_ptr<FILE, Closer>(fopen(path, "rb"));
+    if (fp == nullptr)
+        return false;
+
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp.get())) > 0)
+        out.append(buffer, n);
+    return not ferror(fp.get());
+}
+
+static bool write_file(const char* path, const std::string& data)
+{
+    struct Closer { void operator()(FILE* p) { fclose(p); }};
+    auto fp = std::unique_ptr<FILE, Closer>(fopen(path, "wb"));
+    if (fp == nullptr)
+        return false;
+    return fwrite(data.data(), 1, data.size(), fp.get()) == data.size();
+}
+
+static const char* base_name(const char* path)
+{
+    auto slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* usage =
+        "Usage: %s [-e engine] [-t threads] [-m max_steps] [-n copies] [-o outdir] [-l]"
+        " <file> [input...]\n"
+        "Runs one instance per input file, with the file as UART input,\n"
+        "or copies instances with no input. -l steps instances in lockstep\n"
+        "groups instead of running each alone with engine.\n";
+
+    FleetOptions options{};
+    size_t copies = 0;
+    const char* outdir = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:t:m:n:o:l")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (not MSP430::parse_engine(optarg, options.engine)) {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                options.threads = strtoul(optarg, nullptr, 0);
+                break;
+            case 'm':
+                options.max_instructions = strtoull(optarg, nullptr, 0);
+                break;
+            case 'n':
+                copies = strtoull(optarg, nullptr, 0);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'l':
+                options.lockstep = true;
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, usage, argv[0]);
+        return 0;
+    }
+
+    const char* path = argv[optind];
+    std::vector<const char*> inputs(argv + optind + 1, argv + argc);
+
+    std::shared_ptr<const MSP430::Image> image;
+    try {
+        image = MSP430::load_image(path);
+    } catch (std::exception& e) {
+        fprintf(stderr, "Failed to load file '%s', reason: %s\n", path, e.what());
+        return 1;
+    }
+
+    std::vector<FleetJob> jobs(inputs.empty() ? copies : inputs.size());
+    for (size_t i=0; i<inputs.size(); i++) {
+        if (not read_file(inputs[i], jobs[i].input)) {
+            fprintf(stderr, "Failed to read input '%s', reason: %s\n", inputs[i], strerror(errno));
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    run_fleet(image, jobs, options);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t total = 0;
+    int failures = 0;
+
+    for (size_t i=0; i<jobs.size(); i++) {
+        auto& job = jobs[i];
+        auto name = inputs.empty() ? std::to_string(i) : std::string(base_name(inputs[i]));
+
+        printf(
+            "%s\t%s\t%zu\t%zu\t%s\n",
+            name.c_str(), MSP430::stop_reason_name(job.result.reason),
+            job.result.instructions, job.output.size(), job.result.message.c_str()
+        );
+
+        if (outdir) {
+            auto out_path = std::string(outdir) + "/" + name + ".out";
+            if (not write_file(out_path.c_str(), job.output))
+                fprintf(stderr, "Failed to write '%s', reason: %s\n", out_path.c_str(), strerror(errno));
+        }
+
+        // Idle loops skipped up to a SIZE_MAX budget count as that many
+        if (__builtin_add_overflow(total, job.result.instructions, &total))
+            total = SIZE_MAX;
+        failures += job.result.reason != MSP430::StopReason::exit;
+    }
+
+    if (total == SIZE_MAX)
+        fprintf(stderr, "%zu runs, %i did not exit, too many steps to count in %.3fs\n", jobs.size(), failures, elapsed.count());
+    else
+        fprintf(
+            stderr, "%zu runs, %i did not exit, %zu steps in %.3fs (%.1f MIPS)\n",
+            jobs.size(), failures, total, elapsed.count(), total / elapsed.count() / 1e6
+        );
+
+    return failures ? 1 : 0;
+}
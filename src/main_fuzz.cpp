@@ -0,0 +1,145 @@
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fuzz.hpp"
+
+static bool read_file(const char* path, std::string& out)
+{
+    struct Closer { void operator()(FILE* p) { fclose(p); }};
+    auto fp = std::unique_ptr<FILE, Closer>(fopen(path, "rb"));
+    if (fp == nullptr)
+        return false;
+
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp.get())) > 0)
+        out.append(buffer, n);
+    return not ferror(fp.get());
+}
+
+static void write_file(const std::string& path, const std::string& data)
+{
+    struct Closer { void operator()(FILE* p) { fclose(p); }};
+    auto fp = std::unique_ptr<FILE, Closer>(fopen(path.c_str(), "wb"));
+    if (fp == nullptr || fwrite(data.data(), 1, data.size(), fp.get()) != data.size())
+        fprintf(stderr, "Failed to write '%s', reason: %s\n", path.c_str(), strerror(errno));
+}
+
+int main(int argc, char** argv)
+{
+    static const char* usage =
+        "Usage: %s [-e engine] [-m max_steps] [-l max_length] [-s seed] [-n runs] [-o outdir]"
+        " <file> [seed_input...]\n"
+        "Fuzzes the program's UART input. Crashes, one per PC, and inputs\n"
+        "reaching new coverage are written to outdir.\n";
+
+    FuzzOptions options{};
+    size_t runs = SIZE_MAX;
+    const char* outdir = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:m:l:s:n:o:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (not MSP430::parse_engine(optarg, options.engine)) {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                options.max_instructions = strtoull(optarg, nullptr, 0);
+                break;
+            case 'l':
+                options.max_input = strtoull(optarg, nullptr, 0);
+                break;
+            case 's':
+                options.seed = strtoull(optarg, nullptr, 0);
+                break;
+            case 'n':
+                runs = strtoull(optarg, nullptr, 0);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, usage, argv[0]);
+        return 0;
+    }
+
+    const char* path = argv[optind];
+
+    std::shared_ptr<const MSP430::Image> image;
+    try {
+        image = MSP430::load_image(path);
+    } catch (std::exception& e) {
+        fprintf(stderr, "Failed to load file '%s', reason: %s\n", path, e.what());
+        return 1;
+    }
+
+    Fuzzer fuzzer(image, options);
+
+    fuzzer.add_seed({});
+    for (int i=optind+1; i<argc; i++) {
+        std::string seed;
+        if (not read_file(argv[i], seed)) {
+            fprintf(stderr, "Failed to read seed '%s', reason: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        fuzzer.add_seed(std::move(seed));
+    }
+
+    auto save_crash = [&](const FuzzCrash& crash) {
+        fprintf(
+            stderr, "Crash at %04x: %s %s\n", crash.pc,
+            MSP430::stop_reason_name(crash.result.reason), crash.result.message.c_str()
+        );
+        if (outdir) {
+            char name[16];
+            snprintf(name, sizeof(name), "/crash-%04x", crash.pc);
+            write_file(outdir + std::string(name), crash.input);
+        }
+    };
+
+    for (auto& [pc, crash] : fuzzer.crashes)
+        save_crash(crash);
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto last_report = start;
+    size_t saved = 0;
+
+    auto report = [&] {
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        fprintf(
+            stderr, "%zu runs (%.0f/s), %zu edges, corpus %zu, %zu crashes, %zu hangs\n",
+            fuzzer.executions, fuzzer.executions / elapsed.count(), fuzzer.edges,
+            fuzzer.corpus.size(), fuzzer.crashes.size(), fuzzer.hangs
+        );
+    };
+
+    while (fuzzer.executions < runs) {
+        if (auto crash = fuzzer.fuzz_one())
+            save_crash(*crash);
+
+        for (; outdir && saved < fuzzer.corpus.size(); saved++)
+            write_file(outdir + ("/queue-" + std::to_string(saved)), fuzzer.corpus[saved]);
+
+        if (Clock::now() - last_report > std::chrono::seconds(1)) {
+            last_report = Clock::now();
+            report();
+        }
+    }
+
+    report();
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gdb.hpp"
+#include "msp430.hpp"
+
+// Waits for one connection on a Unix socket at path, -1 on failure
+static int accept_one(const char* path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        fprintf(stderr, "Failed to listen on '%s', reason: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(stderr, "Waiting for gdb on '%s'\n", path);
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0)
+        fprintf(stderr, "Failed to accept on '%s', reason: %s\n", path, strerror(errno));
+
+    close(listener);
+    unlink(path);
+    return connection;
+}
+
+int main(int argc, char** argv)
+{
+    MSP430 msp430{};
+    const char* socket_path = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ce:s:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (not MSP430::parse_engine(optarg, msp430.engine)) {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                msp430.timing = true;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(
+            stderr,
+            "Usage: %s [-c] [-e reference|cached|threaded|jit] [-s socket_path] <file>\n"
+            "Serves gdb on a Unix socket, or on stdin and stdout for 'target remote | %s <file>'.\n",
+            argv[0], argv[0]
+        );
+        return 0;
+    }
+
+    const char* path = argv[optind];
+
+    try {
+        msp430.load_file(path);
+    } catch (std::exception& e) {
+        fprintf(stderr, "Failed to load file '%s', reason: %s\n", path, e.what());
+        return 1;
+    }
+
+    // Stdout may be the debugger, so the UART goes to stderr and only a
+    // socket session reads stdin
+    msp430.uart_print = [](char c) { fputc(c, stderr); };
+    if (socket_path)
+        msp430.uart_read = [] { return char(getchar()); };
+    else
+        msp430.uart_read = [] { return char(-1); };
+
+    if (socket_path) {
+        int connection = accept_one(socket_path);
+        if (connection < 0)
+            return 1;
+        serve_gdb(msp430, connection, connection);
+        close(connection);
+    } else {
+        serve_gdb(msp430, STDIN_FILENO, STDOUT_FILENO);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.hpp"
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace_file>\nWrites a trace from msp430emu-cli -t as text.\n", argv[0]);
+        return 1;
+    }
+
+    auto in = fopen(argv[1], "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "Failed to open '%s', reason: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    bool ok = decode_trace(in, stdout);
+    fclose(in);
+
+    if (not ok) {
+        fprintf(stderr, "'%s' is not a trace or is truncated\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,18 +1,112 @@
+#include "history.hpp"
 #include "msp430.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <termbox2.h>
+#include <thread>
 
-static std::string uart_out{};
+static std::string uart_out{}; // The last UART_KEEP to 2 * UART_KEEP bytes printed
+static constexpr size_t UART_KEEP = 4096;
 static MSP430 msp430{};
+static std::unique_ptr<History> history;
+static std::string status{};
 
-void MSP430::uart_print(char c) {
-    uart_out += c;
+// Free running
+//
+// The worker runs the machine in batches while running is set, holding
+// machine_lock throughout. The interface only touches the machine while it is
+// paused, setting interrupt to pause it first, and draws from the frame the
+// worker publishes after each batch. Breakpoints are the machine's own, so a
+// batch stops at them.
+
+static constexpr size_t BATCH = 1 << 16;
+static constexpr auto FRAME_INTERVAL = std::chrono::milliseconds(33);
+
+static std::mutex machine_lock;
+static std::condition_variable machine_changed;
+static std::atomic<bool> running = false, interrupt = false;
+static bool quitting = false;
+
+struct Frame {
+    std::array<char, MSP430::PRINT_LENGTH> registers;
+    uint64_t position;
+    size_t breakpoints;
+    bool running;
+    std::string status;
+    std::string uart;
+    MSP430::RAM ram;
+};
+
+static std::mutex frame_lock;
+static Frame published{};
+
+static void publish()
+{
+    std::lock_guard guard(frame_lock);
+    published.registers = msp430.print_array();
+    published.position = history->position;
+    published.breakpoints = msp430.breakpoint_count;
+    published.running = running;
+    published.status = status;
+    published.uart = uart_out;
+    published.ram = *msp430.ram;
 }
 
-char MSP430::uart_read() {
-    return -1;
+static void set_status(const MSP430::RunResult& result)
+{
+    status.clear();
+    if (result.reason != MSP430::StopReason::budget)
+        status = result.message.empty() ? MSP430::stop_reason_name(result.reason) : result.message;
+}
+
+static void worker()
+{
+    std::unique_lock guard(machine_lock);
+    for (;;) {
+        machine_changed.wait(guard, [] { return running || quitting; });
+        if (quitting)
+            return;
+
+        // A batch ending at a breakpoint stops there, the next would skip it
+        auto result = msp430.run(BATCH);
+        if (result.reason == MSP430::StopReason::budget && msp430.has_breakpoint(msp430.registers[MSP430::PC]))
+            result.reason = MSP430::StopReason::breakpoint;
+        if (result.reason != MSP430::StopReason::budget || interrupt) {
+            running = false;
+            set_status(result);
+        }
+
+        publish();
+        if (not running)
+            machine_changed.notify_all();
+    }
+}
+
+// Returns holding the lock on the paused machine
+static std::unique_lock<std::mutex> pause_machine()
+{
+    interrupt = true;
+    std::unique_lock guard(machine_lock);
+    machine_changed.wait(guard, [] { return not running; });
+    interrupt = false;
+    return guard;
+}
+
+static void resume_machine(std::unique_lock<std::mutex>& guard)
+{
+    running = true;
+    status.clear();
+    publish();
+    guard.unlock();
+    machine_changed.notify_all();
 }
 
+// Drawing
+
 static void fill(int x, int y, int w, int h, uintattr_t bg)
 {
     for (int i=0; i<w; i++) {
@@ -44,13 +138,22 @@ static void box(int x, int y, int w, int h, uintattr_t fg, uintattr_t bg)
 
 static uint16_t memdump_address{};
 
-static void memdump()
+// What is on screen, parts are only drawn again when they differ
+static Frame shown{};
+static std::array<char, MSP430::PRINT_LENGTH> shown_registers{};
+static std::array<uint8_t, 16*16> shown_rows{};
+static uint16_t shown_address{};
+static bool redraw_all = true;
+
+static void memdump(const MSP430::RAM& ram)
 {
 
     for (unsigned i=0; i<16; i++) {
         auto line_start = memdump_address + i * 16;
 
         if (line_start >= MSP430::RAM_SIZE) {
+            if (not redraw_all && shown_address == memdump_address)
+                continue;
             char line[100];
             memset(line, ' ', sizeof(line));
             line[sizeof(line)-1] = 0;
@@ -58,10 +161,16 @@ static void memdump()
             continue;
         }
 
+        auto row = &ram[line_start];
+        auto shown_row = &shown_rows[16 * i];
+        if (not redraw_all && shown_address == memdump_address && memcmp(row, shown_row, 16) == 0)
+            continue;
+        memcpy(shown_row, row, 16);
+
         tb_printf(2, 12+i, TB_DEFAULT, TB_BLACK, "% 4x:", line_start);
 
         for (int j=0; j<16; j++) {
-            unsigned char ch = msp430.ram->data()[line_start + j];
+            unsigned char ch = row[j];
             unsigned char pch = ch;
             uintattr_t fg = TB_GREEN;
 
@@ -77,6 +186,108 @@ static void memdump()
             tb_set_cell(2+6+3*16+2+j, 12+i, pch, fg, TB_BLACK);
         }
     }
+    shown_address = memdump_address;
+}
+
+static void draw(int frame)
+{
+    {
+        std::lock_guard guard(frame_lock);
+        shown = published;
+    }
+
+    tb_printf(0, 0, TB_DEFAULT, TB_BLACK, "%i", frame);
+    tb_printf(
+        10, 0, TB_DEFAULT, TB_BLACK, "instruction %-12llu breakpoints %-4zu %-7s",
+        (unsigned long long)shown.position, shown.breakpoints, shown.running ? "running" : ""
+    );
+
+    if (redraw_all || shown_registers != shown.registers) {
+        shown_registers = shown.registers;
+        fill(1, 1, 39, 7, TB_BLUE);
+        box(1, 1, 39, 7, TB_YELLOW, TB_BLUE);
+        tb_print(3, 2, TB_WHITE, TB_BLUE, shown_registers.data());
+    }
+
+    tb_print(2, 8, TB_GREEN, TB_BLACK, shown.uart.c_str());
+
+    fill(2, 10, 40, 1, TB_BLACK);
+    if (not shown.status.empty())
+        tb_print(2, 10, TB_BLACK, TB_RED, shown.status.c_str());
+
+    memdump(shown.ram);
+    redraw_all = false;
+    tb_present();
+}
+
+// Input
+
+static bool prompt_number(const char* label, uint64_t& value)
+{
+    std::string text;
+    for (;;) {
+        fill(2, 10, 40, 1, TB_BLACK);
+        tb_printf(2, 10, TB_WHITE, TB_BLACK, "%s: %s_", label, text.c_str());
+        tb_present();
+
+        tb_event ev;
+        tb_poll_event(&ev);
+        if (ev.type != TB_EVENT_KEY)
+            continue;
+
+        if (ev.key == TB_KEY_ENTER && not text.empty()) {
+            value = std::stoull(text);
+            return true;
+        } else if (ev.key == TB_KEY_ESC) {
+            return false;
+        } else if ((ev.key == TB_KEY_BACKSPACE || ev.key == TB_KEY_BACKSPACE2) && not text.empty()) {
+            text.pop_back();
+        } else if (ev.ch >= '0' && ev.ch <= '9' && text.size() < 19) {
+            text += char(ev.ch);
+        }
+    }
+}
+
+static bool at_breakpoint(const MSP430& m)
+{
+    return m.has_breakpoint(m.registers[MSP430::PC]);
+}
+
+static void handle_paused(uint32_t ch)
+{
+    auto guard = pause_machine();
+
+    switch (ch) {
+        case 's':
+            set_status(msp430.run(1));
+            break;
+        case 'S':
+            history->step_back();
+            status.clear();
+            break;
+        case 'c':
+            return resume_machine(guard);
+        case 'C':
+            history->reverse_until(at_breakpoint);
+            status.clear();
+            break;
+        case 'x': {
+            auto pc = msp430.registers[MSP430::PC];
+            msp430.set_breakpoint(pc, not msp430.has_breakpoint(pc));
+            break;
+        }
+        case 'g': {
+            uint64_t target;
+            if (prompt_number("Go to instruction", target))
+                set_status(history->seek(target));
+            break;
+        }
+        case 'r':
+            history->seek(0);
+            status.clear();
+            break;
+    }
+    publish();
 }
 
 static bool handle_event(tb_event e)
@@ -85,19 +296,8 @@ static bool handle_event(tb_event e)
         return true;
 
     switch (e.ch) {
-        case 's': 
-            try {
-                msp430.step_instruction();
-            } catch (std::runtime_error& e) {
-                tb_print(2, 10, TB_BLACK, TB_RED, e.what());
-            }
-            break;
         case 'q':
             return false;
-        case 'r':
-            msp430.registers[MSP430::PC] = 0;
-            fill(2, 10, 40, 1, TB_BLACK);
-            break;
         case 'j':
             memdump_address += 16;
             break;
@@ -110,29 +310,55 @@ static bool handle_event(tb_event e)
         case 'd':
             memdump_address += 16*16;
             break;
+        case 's':
+        case 'S':
+        case 'c':
+        case 'C':
+        case 'x':
+        case 'g':
+        case 'r':
+            // Keys other than c only act once paused
+            if (running && e.ch != 'c')
+                break;
+            if (running)
+                pause_machine();
+            else
+                handle_paused(e.ch);
+            break;
         case 0:
-            if (e.key == TB_KEY_CTRL_C && e.mod == TB_MOD_CTRL)
-                return false;
+            // Pauses a run, or quits
+            if (e.key == TB_KEY_CTRL_C && e.mod == TB_MOD_CTRL) {
+                if (not running)
+                    return false;
+                pause_machine();
+            }
     }
     return true;
 }
 
 static void console_run()
 {
-    fill(1, 1, 39, 7, TB_BLUE);
-    box(1, 1, 39, 7, TB_YELLOW, TB_BLUE);
-    for (int i=0;; i++) {
-        tb_printf(0, 0, TB_DEFAULT, TB_BLACK, "%i", i);
-        tb_print(3, 2, TB_WHITE, TB_BLUE, msp430.print_array().data());
-        tb_print(2, 8, TB_GREEN, TB_BLACK, uart_out.c_str());
-        memdump();
-        tb_present();
+    using clock = std::chrono::steady_clock;
+    auto next_frame = clock::now();
 
+    for (int i=0;;) {
+        auto now = clock::now();
+        if (now >= next_frame) {
+            draw(i++);
+            next_frame = now + FRAME_INTERVAL;
+        }
+
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(next_frame - now).count();
         tb_event ev;
-        tb_poll_event(&ev);
+        if (tb_peek_event(&ev, int(timeout)) != TB_OK)
+            continue;
 
         if (not handle_event(ev))
             return;
+
+        // Show the result of a key at once, unless running
+        if (not running)
+            next_frame = clock::now();
     }
 }
 
@@ -143,6 +369,14 @@ int main(int argc, char** argv)
         return 0;
     }
 
+    msp430.uart_print = [](char c) {
+        if (uart_out.size() == 2 * UART_KEEP)
+            uart_out.erase(0, UART_KEEP);
+        uart_out += c;
+    };
+    msp430.uart_read = [] { return char(-1); };
+    msp430.timing = true; // The timer must replay the same when stepping back
+
     try {
         msp430.load_file(argv[1]);
     } catch (std::exception& e) {
@@ -150,11 +384,23 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    history = std::make_unique<History>(msp430);
+    publish();
+
     if (tb_init() != TB_OK) {
         fprintf(stderr, "Failed to initialise termbox\n");
         exit(1);
     }
 
+    std::thread thread(worker);
     console_run();
+
+    {
+        auto guard = pause_machine();
+        quitting = true;
+    }
+    machine_changed.notify_all();
+    thread.join();
+
     tb_shutdown();
 }
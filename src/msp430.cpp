@@ -1,69 +1,11 @@
-#include "msp430.hpp"
+#include "msp430_impl.hpp"
+#include "history.hpp"
+#include "profile.hpp"
+#include "trace.hpp"
 
-#include <bit>
-#include <cstdint>
-#include <elf.h>
-#include <string.h>
-#include <stdexcept>
+#include <algorithm>
 #include <stdio.h>
-
-void MSP430::load_file(const char* path)
-{
-    struct Closer { void operator()(FILE* p) { fclose(p); }};
-    auto fp = std::unique_ptr<FILE, Closer>(fopen(path, "rb"));
-
-    if (fp == nullptr)
-        throw std::runtime_error(strerror(errno));
-
-    auto read_into = [&](void* ptr, size_t len, size_t offset){
-        // fprintf(stderr, "read %zu: %zu  ->  %p\n", offset, len, ptr);
-
-        if (fseek(fp.get(), offset, SEEK_SET) == -1)
-            throw std::runtime_error(strerror(errno));
-
-        auto dst = static_cast<char*>(ptr);
-        while (len > 0) {
-            auto n = fread(dst, 1, len, fp.get());
-            if (n == 0) {
-                if (feof(fp.get()))
-                    throw std::runtime_error("Unexpected end-of-file");
-                else
-                    throw std::runtime_error(strerror(errno));
-            }
-            len -= n;
-            dst += n;
-        }
-    };
-
-    Elf32_Ehdr header;
-    read_into(&header, sizeof(header), 0);
-
-    if (header.e_machine != EM_MSP430)
-        throw std::runtime_error("Bad e_machine value");
-
-    if (header.e_phentsize != sizeof(Elf32_Phdr))
-        throw std::runtime_error("Bad e_phentsize value");
-
-    memset(ram->data(), 0, ram->size());
-
-    for (size_t i=0; i<header.e_phnum; i++) {
-        Elf32_Phdr program;
-        read_into(&program, sizeof(program), header.e_phoff + i * sizeof(program));
-
-        if (program.p_type != PT_LOAD)
-            continue;
-
-        if (program.p_filesz + program.p_paddr > RAM_SIZE)
-            throw std::runtime_error("LOAD segment too large");
-
-        auto* memp = ram->data();
-
-        read_into(memp + program.p_paddr, program.p_filesz, program.p_offset);
-    }
-
-    memset(&registers, 0, sizeof(registers));
-    registers[PC] = header.e_entry;
-}
+#include <utility>
 
 void MSP430::print(std::span<char, PRINT_LENGTH> out) const
 {
@@ -85,158 +27,126 @@ void MSP430::print(std::span<char, PRINT_LENGTH> out) const
         }
     };
 
+    uint16_t sr = current_sr(*this);
+
     for (int y=0; y<4; y++) {
         for (int x=0; x<4; x++) {
-            print_u16(&out[36*y + 9*x + 4], registers[4*y + x]);
+            int reg = 4*y + x;
+            print_u16(&out[36*y + 9*x + 4], reg == SR ? sr : registers[reg]);
         }
     }
 
-    if (registers[SR] & CF) out[150] = 'C';
-    if (registers[SR] & ZF) out[151] = 'Z';
-    if (registers[SR] & NF) out[152] = 'N';
-    if (registers[SR] & VF) out[153] = 'V';
-    if (registers[SR] & IF) out[154] = 'I';
+    if (sr & CF) out[150] = 'C';
+    if (sr & ZF) out[151] = 'Z';
+    if (sr & NF) out[152] = 'N';
+    if (sr & VF) out[153] = 'V';
+    if (sr & IF) out[154] = 'I';
 }
 
-using Error = std::runtime_error;
-using RAM = MSP430::RAM;
-using enum MSP430::Registers;
-using enum MSP430::Flags;
-
-// Byte/word instruction mode selector
-
-enum ByteWord : bool {
-    Byte = true,
-    Word = false,
-};
-
-template <ByteWord mode>
-struct Constants {
-    static const uint32_t mask;
-    static const uint32_t sign;
-    static const uint32_t carry;
-    static const uint16_t size;
-};
-
-template<> const uint32_t Constants<Byte>::mask = 0xff;
-template<> const uint32_t Constants<Byte>::sign = 0x80;
-template<> const uint32_t Constants<Byte>::carry = 0x100;
-template<> const uint16_t Constants<Byte>::size = 1;
-
-template<> const uint32_t Constants<Word>::mask = 0xffff;
-template<> const uint32_t Constants<Word>::sign = 0x8000;
-template<> const uint32_t Constants<Word>::carry = 0x10000;
-template<> const uint16_t Constants<Word>::size = 2;
-
-// MMIO
-
-static constexpr uint16_t MMIO_BASE = 0xff00;
-static constexpr uint16_t MMIO_UART = 0xffa2;
-static constexpr uint16_t MMIO_EXIT = 0xfffe;
-
-template <ByteWord mode>
-static uint16_t
-read_mmio(uint16_t address)
+void MSP430::sync_flags()
 {
-    if constexpr (mode == Byte)
-        throw Error("MMIO accessed in byte-mode");
+    ::sync_flags(*this);
+}
 
-    if (address & 1)
-        throw Error("Misaligned MMIO read");
+void MSP430::DecodeCacheDeleter::operator()(DecodeCache* p) const
+{
+    delete p;
+}
 
-    if (address == MMIO_UART) {
-        return uint8_t(MSP430::uart_read());
-    }
+void MSP430::set_breakpoint(uint16_t address, bool enabled)
+{
+    if (breakpoints.empty())
+        breakpoints.resize(RAM_SIZE / 2 / 64);
 
-    throw Error("Read from unknown MMIO device");
+    unsigned word = address >> 1;
+    uint64_t bit = uint64_t(1) << (word % 64);
+    if (bool(breakpoints[word / 64] & bit) == enabled)
+        return;
+    breakpoints[word / 64] ^= bit;
+    breakpoint_count += enabled ? 1 : -1;
+
+    // Decoded again on the next visit, with or without the breakpoint
+    if (decode_cache)
+        decode_cache->entries[word].handler = decode_miss;
+    if (jit)
+        jit_invalidate(*this, address);
 }
 
-template <ByteWord mode>
-static void
-write_mmio(uint16_t address, uint16_t value)
+void MSP430::set_watchpoint(uint16_t address, uint16_t length, Watch kind, bool enabled)
 {
-    if constexpr (mode == Byte)
-        throw Error("MMIO accessed in byte-mode");
-
-    if (address & 1)
-        throw Error("Misaligned MMIO write");
+    if (not watchpoints) {
+        watchpoints.reset(new uint8_t[RAM_SIZE]);
+        memset(watchpoints.get(), 0, RAM_SIZE);
+    }
 
-    switch (address) {
-        case MMIO_UART:
-            MSP430::uart_print(value);
-            return;
-        case MMIO_EXIT:
-            throw Error("MMIO exit triggered");
+    for (unsigned i=0; i<length; i++) {
+        auto& flags = watchpoints[uint16_t(address + i)];
+        watchpoint_count -= flags != 0;
+        flags = enabled ? flags | kind : flags & ~kind;
+        watchpoint_count += flags != 0;
     }
 
-    throw Error("Write to unknown MMIO device");
+    for (unsigned page=0; page<PAGES; page++) {
+        auto* flags = &watchpoints[page * PAGE_BYTES];
+        bool watched = std::any_of(flags, flags + PAGE_BYTES, [](uint8_t f) { return f != 0; });
+        page_attributes[page] = watched ? page_attributes[page] | page_watched : page_attributes[page] & ~page_watched;
+    }
 }
 
-// Memory accessors
-
-template <ByteWord mode>
-static inline uint16_t
-read_ram(const RAM& ram, uint16_t address)
+void MSP430::protect(uint16_t address, uint32_t length, uint8_t denied)
 {
-    // printf("Read (b=%i) 0x%04x\n", mode==Byte, address);
-
-    if (address >= MMIO_BASE)
-        return read_mmio<mode>(address);
+    if (length == 0)
+        return;
 
-    if constexpr (mode == Word) {
-        if (address & 1)
-            throw Error("Misaligned read");
-        return *reinterpret_cast<const uint16_t*>(&ram[address]);
-    } else {
-        return ram[address];
+    // Wrapping around past the top of memory
+    size_t first = address / PAGE_BYTES;
+    size_t last = std::min((address + length - 1) / PAGE_BYTES, first + PAGES - 1);
+
+    bool changed = false;
+    for (size_t page=first; page<=last; page++) {
+        auto& attributes = page_attributes[page % PAGES];
+        auto allowed = attributes & page_mmio ? page_no_exec : page_protection;
+        auto updated = (attributes & ~page_protection) | (denied & allowed);
+        changed |= attributes != updated;
+        attributes = updated;
     }
+    // Cached and compiled code was only checked for execution once
+    if (changed)
+        invalidate_decode_cache();
 }
 
-template <ByteWord mode>
-static inline void
-write_ram(RAM& ram, uint16_t address, uint16_t value)
+void
+protection_fault(MSP430& msp, const char* access, uint16_t address)
 {
-    // printf("Write (b=%i) 0x%04x <- 0x%04x\n", mode==Byte, address, value);
-
-    if (address >= MMIO_BASE)
-        return write_mmio<mode>(address, value);
-
-    if constexpr (mode == Word) {
-        if (address & 1)
-            throw Error("Misaligned write");
-        *reinterpret_cast<uint16_t*>(&ram[address]) = value;
-    } else {
-        ram[address] = value;
-    }
+    bool unmapped = (msp.page_attributes[address / MSP430::PAGE_BYTES] & MSP430::page_protection) == MSP430::page_protection;
+    char message[64];
+    snprintf(message, sizeof(message), "%s %s memory at 0x%04x", access, unmapped ? "unmapped" : "protected", address);
+    throw Error(message);
 }
 
-static inline uint16_t
-read_pc_immediate(MSP430& msp)
+void MSP430::invalidate_decode_cache()
 {
-    auto v = read_ram<Word>(*msp.ram, msp.registers[PC]);
-    msp.registers[PC] += 2;
-    return v;
+    dirty.fill(true);
+    for (auto& attributes : page_attributes)
+        attributes &= ~page_code;
+    if (decode_cache)
+        decode_cache->clear();
+    if (jit)
+        jit_flush(*this);
 }
 
 // Argument Decoding
 
-#define unreachable __builtin_trap
-
 template <ByteWord mode>
 static inline uint16_t
 dual_op_source(MSP430& msp, uint16_t instruction)
 {
     auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
 
-    if (op.source == PC) {
-        switch (uint16_t(op.as)) {
-            case 2: throw Error("Unsupported @PC immediate mode");
-            case 3: return read_pc_immediate(msp);
+    if (op.source == PC && op.as == 3)
+        return read_pc_immediate(msp);
 
-            /* case 0, 1 as regular register -- fall through */
-            default: (void)0;
-        }
-    }
+    /* @PC reads the word after the instruction, the others as regular register */
 
     if (op.source == SR) { /* a.k.a. CG1 */
         switch (op.as) {
@@ -245,7 +155,7 @@ dual_op_source(MSP430& msp, uint16_t instruction)
             case 3: return 8;
             case 1: {
                 auto address = read_pc_immediate(msp);
-                return read_ram<mode>(*msp.ram, address);
+                return read_ram<mode>(msp, address);
             }
         }
         unreachable();
@@ -261,11 +171,11 @@ dual_op_source(MSP430& msp, uint16_t instruction)
         case 1: {
             auto base = msp.registers[op.source];
             auto offset = read_pc_immediate(msp);
-            return read_ram<mode>(*msp.ram, base + offset);
+            return read_ram<mode>(msp, base + offset);
         }
         case 2: {
             auto address = msp.registers[op.source];
-            return read_ram<mode>(*msp.ram, address);
+            return read_ram<mode>(msp, address);
         }
         case 3: {
             auto address = msp.registers[op.source];
@@ -273,33 +183,12 @@ dual_op_source(MSP430& msp, uint16_t instruction)
                 msp.registers[SP] += 2; // POP always keeps stack aligned
             else
                 msp.registers[op.source] += Constants<mode>::size;
-            return read_ram<mode>(*msp.ram, address);
+            return read_ram<mode>(msp, address);
         }
     }
     unreachable();
 }
 
-struct Destination {
-    uint16_t target;
-    bool is_memory;
-
-    template <ByteWord mode>
-    void write(MSP430& msp, uint16_t value) {
-        if (is_memory)
-            write_ram<mode>(*msp.ram, target, value);
-        else
-            msp.registers[target] = Constants<mode>::mask & value;
-    }
-
-    template <ByteWord mode>
-    uint16_t read(MSP430& msp) {
-        if (is_memory)
-            return read_ram<mode>(*msp.ram, target);
-        else
-            return Constants<mode>::mask & msp.registers[target];
-    }
-};
-
 static Destination
 dual_op_dest(MSP430& msp, uint16_t instruction)
 {
@@ -312,7 +201,7 @@ dual_op_dest(MSP430& msp, uint16_t instruction)
         return { read_pc_immediate(msp), true };
 
     if (op.dest == CG)
-        throw Error("Illegal x(CG2) address mode");
+        throw IllegalInstruction("Illegal x(CG2) address mode");
 
     auto base = msp.registers[op.dest];
     auto offset = read_pc_immediate(msp);
@@ -328,13 +217,13 @@ single_op_loc(MSP430& msp, uint16_t instruction)
         return { op.target, false };
 
     if (op.target == CG)
-        throw Error("Illegal target register CG2");
+        throw IllegalInstruction("Illegal target register CG2");
 
     if (op.target == SR) {
         if (op.as == 1)
             return { read_pc_immediate(msp), true };
         else
-            throw Error("Illegal target register CG1");
+            throw IllegalInstruction("Illegal target register CG1");
     }
 
     switch (op.as) {
@@ -357,329 +246,1077 @@ single_op_loc(MSP430& msp, uint16_t instruction)
     unreachable();
 }
 
-// Execution
-
-static void
-flags_update(MSP430& msp, bool carry, bool zero, bool sign, bool overflow)
-{
-    msp.registers[SR] =
-        (msp.registers[SR] & ~ALU)
-        | (carry * CF)
-        | (zero * ZF)
-        | (sign * NF)
-        | (overflow * VF);
-}
-
-template <ByteWord mode>
-static void
-alu_flags_update(MSP430& msp, bool s1_in, bool s2_in, uint32_t out)
-{
-    bool sign_out = out & Constants<mode>::sign;
-    bool carry_out = out & Constants<mode>::carry;
-    bool zero_out = !(out & Constants<mode>::mask);
-    bool overflow_out = (s1_in ^ sign_out) & (s2_in ^ sign_out);
-
-    flags_update(msp, carry_out, zero_out, sign_out, overflow_out);
-}
-
-enum DualOpCode {
-    MOV = 0x4,
-    ADD,
-    ADDC,
-    SUBC,
-    SUB,
-    CMP,
-    DADD, /* unsupported */
-    BIT,
-    BIC,
-    BIS, /* a.k.a OR */
-    XOR,
-    AND,
-};
-
+// PUSH and CALL also take constants from the generators
 template <ByteWord mode>
-static void
-execute_decoded_dual_op(MSP430& msp, DualOpCode op, uint16_t source, Destination dest)
+static uint16_t
+single_op_source(MSP430& msp, uint16_t instruction)
 {
-    if (op == MOV) {
-        dest.write<mode>(msp, source);
-        return;
-    }
-
-    bool carry_in = msp.registers[SR] & CF;
-    bool sign1_in = source & Constants<mode>::sign;
-    uint32_t target = dest.read<mode>(msp);
-    bool sign2_in = target & Constants<mode>::sign;
-
-    switch (op) {
-        case MOV:
-            unreachable();
-
-        case ADD:
-            target = target + source;
-            alu_flags_update<mode>(msp, sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
-
-        case ADDC:
-            target = target + source + carry_in;
-            alu_flags_update<mode>(msp, sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
-
-        case SUBC:
-            target = target + (uint16_t)~source + carry_in;
-            alu_flags_update<mode>(msp, not sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
-
-        case SUB:
-            target = target + (uint16_t)~source + 1;
-            alu_flags_update<mode>(msp, not sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
-
-        case CMP:
-            target = target + (uint16_t)~source + 1;
-            alu_flags_update<mode>(msp, not sign1_in, sign2_in, target);
-            break;
+    auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
 
-        case DADD:
-            throw Error("DADD not implemented");
+    if (op.target == CG) {
+        static constexpr uint16_t constants[4] = { 0, 1, 2, 0xffff };
+        return constants[op.as];
+    }
 
-        case BIT:
-            target = target & source;
-            alu_flags_update<mode>(msp, not sign1_in, sign2_in, target);
-            break;
+    if (op.target == SR && op.as >= 2)
+        return op.as == 2 ? 4 : 8;
 
-        case BIC:
-            target = target & ~source;
-            dest.write<mode>(msp, target);
-            break;
+    return single_op_loc(msp, instruction).read<mode>(msp);
+}
 
-        case BIS:
-            target = target | source;
-            dest.write<mode>(msp, target);
-            break;
+static void
+execute_conditional_op(MSP430& msp, uint16_t instruction)
+{
+    auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
 
-        case XOR:
-            target = target ^ source;
-            alu_flags_update<mode>(msp, sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
+    if (is_condition(read_flags(msp), Condition(op.condition))) {
+        msp.registers[PC] += uint16_t(int16_t(op.offset)) << 1;
+        if (is_tight_jump(op)) [[unlikely]]
+            check_tight_loop(msp);
+    }
+}
 
-        case AND:
-            target = target & source;
-            alu_flags_update<mode>(msp, sign1_in, sign2_in, target);
-            dest.write<mode>(msp, target);
-            break;
+static void
+execute_dual_op(MSP430& msp, uint16_t instruction)
+{
+    auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
 
-        default:
-            throw Error("Invalid opcode for dual operand instruction");
+    if (op.bw) {
+        auto source = dual_op_source<Byte>(msp, instruction);
+        auto dest = dual_op_dest(msp, instruction);
+        execute_decoded_dual_op<Byte>(msp, DualOpCode(op.opcode), source, dest);
+    } else {
+        auto source = dual_op_source<Word>(msp, instruction);
+        auto dest = dual_op_dest(msp, instruction);
+        execute_decoded_dual_op<Word>(msp, DualOpCode(op.opcode), source, dest);
     }
 }
 
-enum SingleOpCode {
-    RRC = 0x0,
-    SWPB,
-    RRA,
-    SXT,
-    PUSH,
-    CALL,
-    RETI,
-};
-
 template <ByteWord mode>
 static void
-execute_decoded_single_op(MSP430& msp, SingleOpCode op, uint16_t instruction)
+execute_single_op(MSP430& msp, SingleOpCode op, uint16_t instruction)
 {
     switch (op) {
         case PUSH: {
             msp.registers[SP] -= 2;
-            auto value = single_op_loc(msp, instruction).read<mode>(msp);
-            write_ram<mode>(*msp.ram, msp.registers[SP], value);
+            auto value = single_op_source<mode>(msp, instruction);
+            write_ram<mode>(msp, msp.registers[SP], value);
             break;
         }
         case CALL: {
-            auto dest = single_op_loc(msp, instruction).read<Word>(msp);
-            msp.registers[SP] -= 2;
-            write_ram<Word>(*msp.ram, msp.registers[SP], msp.registers[PC]);
+            auto dest = single_op_source<Word>(msp, instruction);
+            push(msp, msp.registers[PC]);
             msp.registers[PC] = dest;
             break;
         }
-        case SWPB: {
-            auto target = single_op_loc(msp, instruction);
-            target.write<Word>(msp, __builtin_bswap16(target.read<Word>(msp)));
-            break;
-        }
         case RETI: {
             if (instruction & 0x3f)
-                throw Error("Illegal argument for RETI");
-
-            msp.registers[SR] = read_ram<Word>(*msp.ram, msp.registers[SP]);
-            msp.registers[PC] = read_ram<Word>(*msp.ram, msp.registers[SP] + 2);
-            msp.registers[SP] += 4;
+                throw IllegalInstruction("Illegal argument for RETI");
+            reti(msp);
             break;
         }
-        case RRC: {
-            auto target = single_op_loc(msp, instruction);
-            bool carry_in = msp.registers[SR] & CF;
-            uint32_t value = target.read<mode>(msp) | carry_in * Constants<mode>::carry;
-            bool carry_out = value & 1;
-            value >>= 1;
-            bool sign_out = value & Constants<mode>::sign;
-            bool zero_out = value == 0;
-            target.write<mode>(msp, value);
-            flags_update(msp, carry_out, zero_out, sign_out, 0);
+        case RRC:
+        case SWPB:
+        case RRA:
+        case SXT:
+            execute_decoded_single_op<mode>(msp, op, single_op_loc(msp, instruction));
             break;
-        }
-        case RRA: {
-            auto target = single_op_loc(msp, instruction);
-            uint32_t value = target.read<mode>(msp);
-            bool carry_in = value & Constants<mode>::sign;
-            value |= carry_in * Constants<mode>::carry;
-            bool carry_out = value & 1;
-            value >>= 1;
-            bool sign_out = value & Constants<mode>::sign;
-            bool zero_out = value == 0;
-            target.write<mode>(msp, value);
-            flags_update(msp, carry_out, zero_out, sign_out, 0);
+        default:
+            throw IllegalInstruction("Illegal instruction");
+    }
+}
+
+static void
+execute_single_op(MSP430& msp, uint16_t instruction)
+{
+    auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+    if (op.bw) {
+        execute_single_op<Byte>(msp, SingleOpCode(op.opcode), instruction);
+    } else {
+        execute_single_op<Word>(msp, SingleOpCode(op.opcode), instruction);
+    }
+}
+
+void
+step_reference(MSP430& msp)
+{
+    // printf("%04x: ", msp.registers[PC]);
+
+    // Operands below read SR as a plain register
+    sync_flags(msp);
+
+    auto instruction = read_pc_immediate(msp);
+    auto instruction_type = MSP430::classify(instruction);
+
+    // printf("%04x %i\n", instruction, instruction_type);
+
+    switch (instruction_type) {
+        case MSP430::invalid:
+            throw IllegalInstruction("Illegal instruction");
+        case MSP430::single_operand:
+            execute_single_op(msp, instruction);
             break;
-        }
-        case SXT: {
-            auto target = single_op_loc(msp, instruction);
-            uint16_t value = target.read<Byte>(msp);
-            value = int16_t(int8_t(value));
-            target.write<Word>(msp, value);
-            bool sign_out = value & Constants<Word>::sign;
-            bool zero_out = value == 0;
-            bool carry_out = value != 0;
-            flags_update(msp, carry_out, zero_out, sign_out, 0);
+        case MSP430::conditional:
+            execute_conditional_op(msp, instruction);
+            break;
+        case MSP430::dual_operand:
+            execute_dual_op(msp, instruction);
             break;
-        }
-        default:
-            unreachable();
     }
+
+    // puts(msp.print_array().data());
 }
 
-enum Condition {
-    not_equal = 0x0,
-    equal, // == zero
-    no_carry, // == lower
-    carry, // == higher_or_same
-    negative,
-    greater_equal,
-    less,
-    always,
-};
+// Cached execution
 
-static bool
-is_condition(uint16_t flags, Condition cond)
-{
-    switch (cond) {
-        case not_equal:     return not(flags & ZF);
-        case equal:         return flags & ZF;
-        case no_carry:      return not(flags & CF);
-        case carry:         return flags & CF;
-        case negative:      return flags & NF;
-        case greater_equal: return bool(flags & NF) == bool(flags & VF);
-        case less:          return bool(flags & NF) != bool(flags & VF);
-        case always:        return true;
+// Autoincrement follows the instruction mode, CALL.B still reads a word
+template <ByteWord mode, ByteWord access = mode>
+static inline uint16_t
+cached_source(MSP430& msp, OperandKind kind, uint8_t reg, uint16_t ext)
+{
+    switch (kind) {
+        case reg_direct:
+            return msp.registers[reg];
+        case constant:
+            return ext;
+        case indexed:
+            return read_ram<access>(msp, msp.registers[reg] + ext);
+        case absolute:
+            return read_ram<access>(msp, ext);
+        case indirect:
+            return read_ram<access>(msp, msp.registers[reg]);
+        case autoincrement: {
+            auto address = msp.registers[reg];
+            msp.registers[reg] += (mode == Byte && reg > SP) ? 1 : 2;
+            return read_ram<access>(msp, address);
+        }
     }
     unreachable();
 }
 
-static void
-execute_conditional_op(MSP430& msp, uint16_t instruction)
+template <ByteWord mode>
+static inline Destination
+cached_location(MSP430& msp, OperandKind kind, uint8_t reg, uint16_t ext)
 {
-    auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
-
-    if (is_condition(msp.registers[SR], Condition(op.condition)))
-        msp.registers[PC] += uint16_t(int16_t(op.offset)) << 1;
+    switch (kind) {
+        case reg_direct:
+            return { reg, false };
+        case indexed:
+            return { uint16_t(msp.registers[reg] + ext), true };
+        case absolute:
+            return { ext, true };
+        case indirect:
+            return { msp.registers[reg], true };
+        case autoincrement: {
+            auto address = msp.registers[reg];
+            msp.registers[reg] += (mode == Byte && reg > SP) ? 1 : 2;
+            return { address, true };
+        }
+        case constant:
+            break;
+    }
+    unreachable();
 }
 
+// Entries are only executed with PC at the entry address. PC is advanced past
+// the whole instruction first, operands reading PC were resolved at decode.
+
+template <ByteWord mode, DualOpCode op>
 static void
-execute_dual_op(MSP430& msp, uint16_t instruction)
+cached_dual_op(MSP430& msp, const DecodedInsn& e)
 {
-    auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+    msp.registers[PC] += e.length;
+    auto source = cached_source<mode>(msp, OperandKind(e.src_kind), e.src_reg, e.src_ext);
+    auto dest = cached_location<mode>(msp, OperandKind(e.dst_kind), e.dst_reg, e.dst_ext);
+    execute_decoded_dual_op<mode>(msp, op, source, dest);
+}
 
-    if (op.bw) {
-        auto source = dual_op_source<Byte>(msp, instruction);
-        auto dest = dual_op_dest(msp, instruction);
-        execute_decoded_dual_op<Byte>(msp, DualOpCode(op.opcode), source, dest);
+template <ByteWord mode, SingleOpCode op>
+static void
+cached_single_op(MSP430& msp, const DecodedInsn& e)
+{
+    msp.registers[PC] += e.length;
+
+    if constexpr (op == PUSH) {
+        msp.registers[SP] -= 2;
+        auto value = cached_source<mode>(msp, OperandKind(e.dst_kind), e.dst_reg, e.dst_ext);
+        write_ram<mode>(msp, msp.registers[SP], value);
+    } else if constexpr (op == CALL) {
+        auto dest = cached_source<mode, Word>(msp, OperandKind(e.dst_kind), e.dst_reg, e.dst_ext);
+        push(msp, msp.registers[PC]);
+        msp.registers[PC] = dest;
+    } else if constexpr (op == RETI) {
+        reti(msp);
     } else {
-        auto source = dual_op_source<Word>(msp, instruction);
-        auto dest = dual_op_dest(msp, instruction);
-        execute_decoded_dual_op<Word>(msp, DualOpCode(op.opcode), source, dest);
+        auto target = cached_location<mode>(msp, OperandKind(e.dst_kind), e.dst_reg, e.dst_ext);
+        execute_decoded_single_op<mode>(msp, op, target);
     }
 }
 
+template <Condition cond>
 static void
-execute_single_op(MSP430& msp, uint16_t instruction)
+cached_conditional_op(MSP430& msp, const DecodedInsn& e)
 {
-    auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
-    if (op.bw) {
-        execute_decoded_single_op<Byte>(msp, SingleOpCode(op.opcode), instruction);
+    if (is_condition(read_flags(msp), cond))
+        msp.registers[PC] = e.dst_ext;
+    else
+        msp.registers[PC] += 2;
+}
+
+// Conditional jumps back over at most one instruction
+template <Condition cond>
+static void
+cached_tight_jump(MSP430& msp, const DecodedInsn& e)
+{
+    if (is_condition(read_flags(msp), cond)) {
+        msp.registers[PC] = e.dst_ext;
+        check_tight_loop(msp);
     } else {
-        execute_decoded_single_op<Word>(msp, SingleOpCode(op.opcode), instruction);
+        msp.registers[PC] += 2;
     }
 }
 
-void MSP430::step_instruction()
+// Instructions the cache does not handle, executed by decoding from memory
+static void
+cached_fallback(MSP430& msp, const DecodedInsn&)
 {
-    // printf("%04x: ", registers[PC]);
+    step_reference(msp);
+}
 
-    auto instruction = read_pc_immediate(*this);
-    auto instruction_type = classify(instruction);
+// Entries at breakpoints, also decoded from memory once past them. They mark
+// no code words, so writes nearby leave them in place.
+static void
+cached_breakpoint(MSP430& msp, const DecodedInsn&)
+{
+    hit_breakpoint(msp);
+    step_reference(msp);
+}
 
-    // printf("%04x %i\n", instruction, instruction_type);
+template <ByteWord mode>
+static constexpr Handler dual_op_handlers[16] = {
+    nullptr, nullptr, nullptr, nullptr,
+    cached_dual_op<mode, MOV>,
+    cached_dual_op<mode, ADD>,
+    cached_dual_op<mode, ADDC>,
+    cached_dual_op<mode, SUBC>,
+    cached_dual_op<mode, SUB>,
+    cached_dual_op<mode, CMP>,
+    cached_dual_op<mode, DADD>,
+    cached_dual_op<mode, BIT>,
+    cached_dual_op<mode, BIC>,
+    cached_dual_op<mode, BIS>,
+    cached_dual_op<mode, XOR>,
+    cached_dual_op<mode, AND>,
+};
 
-    switch (instruction_type) {
-        case invalid:
-            throw Error("Illegal instruction");
-        case single_operand:
-            execute_single_op(*this, instruction);
-            break;
-        case conditional:
-            execute_conditional_op(*this, instruction);
-            break;
-        case dual_operand:
-            execute_dual_op(*this, instruction);
-            break;
+template <ByteWord mode>
+static constexpr Handler single_op_handlers[8] = {
+    cached_single_op<mode, RRC>,
+    cached_single_op<mode, SWPB>,
+    cached_single_op<mode, RRA>,
+    cached_single_op<mode, SXT>,
+    cached_single_op<mode, PUSH>,
+    cached_single_op<mode, CALL>,
+    cached_single_op<mode, RETI>,
+    cached_fallback,
+};
+
+static constexpr Handler conditional_handlers[8] = {
+    cached_conditional_op<not_equal>,
+    cached_conditional_op<equal>,
+    cached_conditional_op<no_carry>,
+    cached_conditional_op<carry>,
+    cached_conditional_op<negative>,
+    cached_conditional_op<greater_equal>,
+    cached_conditional_op<less>,
+    cached_conditional_op<always>,
+};
+
+static constexpr Handler tight_jump_handlers[8] = {
+    cached_tight_jump<not_equal>,
+    cached_tight_jump<equal>,
+    cached_tight_jump<no_carry>,
+    cached_tight_jump<carry>,
+    cached_tight_jump<negative>,
+    cached_tight_jump<greater_equal>,
+    cached_tight_jump<less>,
+    cached_tight_jump<always>,
+};
+
+// Decoding reads the instruction and extension words straight from ram.
+// Encodings the cache does not handle are left to the fallback handler,
+// which also reports their errors.
+
+bool
+decode_source(MSP430::DualOpInsn op, Fetch& fetch, Operand& out)
+{
+    if (op.source == PC) {
+        switch (op.as) {
+            case 0:
+                out = { constant, PC, uint16_t(fetch.pc + 2) };
+                return true;
+            case 1: {
+                auto base = fetch.address();
+                out = { absolute, PC, uint16_t(base + fetch.next()) };
+                return true;
+            }
+            case 2:
+                out = { absolute, PC, fetch.address() };
+                return true;
+            case 3:
+                out = { constant, PC, fetch.next() };
+                return true;
+        }
     }
 
-    // puts(print_array().data());
-}
+    if (op.source == SR) {
+        switch (op.as) {
+            case 0: out = { reg_direct, SR, 0 }; return true;
+            case 1: out = { absolute, SR, fetch.next() }; return true;
+            case 2: out = { constant, SR, 4 }; return true;
+            case 3: out = { constant, SR, 8 }; return true;
+        }
+    }
 
-#ifdef MSP430TEST
+    if (op.source == CG) {
+        static constexpr uint16_t constants[4] = { 0, 1, 2, 0xffff };
+        out = { constant, CG, constants[op.as] };
+        return true;
+    }
 
-void MSP430::uart_print(char) {
-    throw Error("IO operation in test");
+    static constexpr OperandKind kinds[4] = { reg_direct, indexed, indirect, autoincrement };
+    out = { kinds[op.as], uint8_t(op.source), 0 };
+    if (op.as == 1)
+        out.ext = fetch.next();
+    return true;
 }
 
-char MSP430::uart_read() {
-    throw Error("IO operation in test");
+bool
+decode_dest(MSP430::DualOpInsn op, Fetch& fetch, Operand& out)
+{
+    if (op.ad == 0) {
+        out = { reg_direct, uint8_t(op.dest), 0 };
+        return true;
+    }
+
+    switch (op.dest) {
+        case CG:
+            return false;
+        case SR:
+            out = { absolute, SR, fetch.next() };
+            return true;
+        case PC: {
+            auto base = fetch.address();
+            out = { absolute, PC, uint16_t(base + fetch.next()) };
+            return true;
+        }
+    }
+
+    out = { indexed, uint8_t(op.dest), fetch.next() };
+    return true;
 }
 
-static void test_alu2_word()
+bool
+decode_single(MSP430::SingleOpInsn op, Fetch& fetch, Operand& out)
 {
-    MSP430 m{};
-    int successes{};
+    // PUSH and CALL also take constants from the generators
+    bool read_only = op.opcode == PUSH || op.opcode == CALL;
+    if (read_only && (op.target == CG || (op.target == SR && op.as >= 2))) {
+        static constexpr uint16_t constants[2][4] = { { 0, 0, 4, 8 }, { 0, 1, 2, 0xffff } };
+        out = { constant, uint8_t(op.target), constants[op.target == CG][op.as] };
+        return true;
+    }
 
-    struct TestCase {
-        DualOpCode opp;
-        uint16_t src, dst, flags;
-        uint16_t expected, flags_out;
-    };
+    if (op.as == 0) {
+        out = { reg_direct, uint8_t(op.target), 0 };
+        return true;
+    }
 
-    static constexpr struct TestCase tests[] = {
-        TestCase( ADD, 1, 1, 0, 2, 0 ),
-        TestCase( SUB, 1, 2, 0, 1, CF ),
-        TestCase( SUB, 1, 1, 0, 0, ZF|CF ),
-        TestCase( CMP, 1, -1, 0, -1, NF|CF ),
-        TestCase( SUB, 1, -1, 0, -2, NF|CF ),
-        TestCase( ADD, 30000, 30000, 0, 60000, VF|NF ),
-        TestCase( SUB, 30000, -30000, 0, 5536, VF|CF ),
+    if (op.target == CG)
+        return false;
+
+    if (op.target == SR) {
+        if (op.as != 1)
+            return false;
+        out = { absolute, SR, fetch.next() };
+        return true;
+    }
+
+    if (op.target == PC) {
+        switch (op.as) {
+            case 1: {
+                auto base = fetch.address();
+                out = { absolute, PC, uint16_t(base + fetch.next()) };
+                return true;
+            }
+            case 2:
+                return false;
+            case 3:
+                if (not read_only)
+                    return false;
+                out = { constant, PC, fetch.next() };
+                return true;
+        }
+    }
+
+    static constexpr OperandKind kinds[4] = { reg_direct, indexed, indirect, autoincrement };
+    out = { kinds[op.as], uint8_t(op.target), 0 };
+    if (op.as == 1)
+        out.ext = fetch.next();
+    return true;
+}
+
+static DecodedInsn
+decode(const MSP430& msp, uint16_t pc)
+{
+    DecodedInsn fallback = {};
+    fallback.handler = cached_fallback;
+
+    // Keep the longest instruction clear of MMIO, fetches there have effects
+    if (pc > MMIO_BASE - 6)
+        return fallback;
+
+    Fetch fetch = {
+        .words = reinterpret_cast<const uint16_t*>(&(*msp.ram)[pc]),
+        .pc = pc,
+        .count = 1,
+    };
+    auto instruction = fetch.words[0];
+
+    DecodedInsn e = {};
+    Operand src = {}, dst = {};
+
+    switch (MSP430::classify(instruction)) {
+        case MSP430::invalid:
+            return fallback;
+
+        case MSP430::conditional: {
+            auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+            e.handler = is_tight_jump(op)
+                ? tight_jump_handlers[op.condition]
+                : conditional_handlers[op.condition];
+            dst.ext = pc + 2 + (uint16_t(int16_t(op.offset)) << 1);
+            break;
+        }
+
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            if (op.opcode == RETI && (instruction & 0x3f))
+                return fallback;
+            if (op.opcode != RETI && not decode_single(op, fetch, dst))
+                return fallback;
+            e.handler = op.bw
+                ? single_op_handlers<Byte>[op.opcode]
+                : single_op_handlers<Word>[op.opcode];
+            break;
+        }
+
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            if (not decode_source(op, fetch, src) || not decode_dest(op, fetch, dst))
+                return fallback;
+            e.handler = op.bw
+                ? dual_op_handlers<Byte>[op.opcode]
+                : dual_op_handlers<Word>[op.opcode];
+            break;
+        }
+    }
+
+    // Register access to SR has to see pending flags, left to the reference
+    // engine which syncs them
+    if ((src.kind == reg_direct && src.reg == SR) || (dst.kind == reg_direct && dst.reg == SR))
+        return fallback;
+
+    e.src_ext = src.ext;
+    e.src_reg = src.reg;
+    e.src_kind = src.kind;
+    e.dst_ext = dst.ext;
+    e.dst_reg = dst.reg;
+    e.dst_kind = dst.kind;
+    e.length = 2 * fetch.count;
+    return e;
+}
+
+void
+decode_miss(MSP430& msp, const DecodedInsn&)
+{
+    auto& cache = *msp.decode_cache;
+    auto pc = msp.registers[PC];
+    auto& entry = cache.entries[pc >> 1];
+
+    if (msp.has_breakpoint(pc)) {
+        entry = {};
+        entry.handler = cached_breakpoint;
+        return entry.handler(msp, entry);
+    }
+
+    entry = decode(msp, pc);
+
+    if (entry.handler != cached_fallback) {
+        // Only the reference engine fetches, checked once here instead
+        for (unsigned i=0; i<entry.length; i+=2) {
+            if (page_attributes(msp, pc + i) & MSP430::page_no_exec) {
+                entry.handler = decode_miss;
+                protection_fault(msp, "Execute from", pc + i);
+            }
+        }
+        for (unsigned i=0; i<entry.length; i+=2)
+            mark_code(msp, pc + i);
+    }
+
+    entry.handler(msp, entry);
+}
+
+void
+step_cached(MSP430& msp)
+{
+    if (not msp.decode_cache) [[unlikely]]
+        msp.decode_cache.reset(new MSP430::DecodeCache);
+
+    auto pc = msp.registers[PC];
+    if (pc & 1) [[unlikely]]
+        return at_instruction(msp, pc, [&] { step_reference(msp); });
+
+    auto& entry = msp.decode_cache->entries[pc >> 1];
+    at_instruction(msp, pc, [&] { entry.handler(msp, entry); });
+}
+
+// Execution loop
+
+// Edges are hashed from the word addresses of both ends
+static inline void
+record_edge(MSP430& msp, uint16_t from, uint16_t to)
+{
+    msp.coverage[uint16_t((from >> 1) * 0x9e37U ^ (to >> 1))]++;
+}
+
+// The reference engine has no cache to hold breakpoints, so checks them here
+static inline void
+step_checked(MSP430& msp, uint16_t pc)
+{
+    if (msp.has_breakpoint(pc)) [[unlikely]]
+        hit_breakpoint(msp);
+    at_instruction(msp, pc, [&] { step_reference(msp); });
+}
+
+// Coverage, profiling, timing, tracing and history need every instruction, so
+// always interpret. Each is compiled in only where enabled.
+
+static constexpr unsigned INSTRUMENT_COVERAGE = 1;
+static constexpr unsigned INSTRUMENT_PROFILE = 2;
+static constexpr unsigned INSTRUMENT_TIMING = 4;
+static constexpr unsigned INSTRUMENT_TRACE = 8;
+static constexpr unsigned INSTRUMENT_HISTORY = 16;
+
+template <unsigned instruments>
+static void
+execute_instrumented(MSP430& msp, size_t& count)
+{
+    constexpr bool coverage = instruments & INSTRUMENT_COVERAGE;
+    constexpr bool profile = instruments & INSTRUMENT_PROFILE;
+    constexpr bool timing = instruments & INSTRUMENT_TIMING;
+    constexpr bool trace = instruments & INSTRUMENT_TRACE;
+    constexpr bool history = instruments & INSTRUMENT_HISTORY;
+
+    // Each engine gets its own loop so the step inlines
+    auto loop = [&](auto step) {
+        for (; count > 0 && not msp.stop_requested; count--) {
+            if constexpr (timing) {
+                if (msp.cycles >= msp.cycle_limit)
+                    return;
+            }
+            if (msp.until.check && msp.until.check(msp.until.predicate, msp)) [[unlikely]] {
+                msp.stop_requested |= MSP430::stop_until;
+                return;
+            }
+
+            auto from = msp.registers[PC];
+            [[maybe_unused]] uint16_t instruction;
+            if constexpr (profile || timing || trace)
+                instruction = *reinterpret_cast<const uint16_t*>(&(*msp.ram)[from & ~1]);
+
+            if constexpr (history)
+                msp.history->before();
+            step(msp, from);
+
+            if constexpr (coverage)
+                record_edge(msp, from, msp.registers[PC]);
+            if constexpr (profile)
+                msp.profile->record(msp, from, instruction, instruction_cycles(instruction));
+            if constexpr (timing)
+                msp.cycles += instruction_cycles(instruction);
+            if constexpr (trace)
+                msp.trace->record(msp, from, instruction);
+            if constexpr (history)
+                msp.history->after();
+        }
+    };
+
+    if (msp.engine == MSP430::Engine::reference)
+        loop([](MSP430& msp, uint16_t pc) { step_checked(msp, pc); });
+    else
+        loop([](MSP430& msp, uint16_t) { step_cached(msp); });
+}
+
+static constexpr auto INSTRUMENTED = []<unsigned... i>(std::integer_sequence<unsigned, i...>) {
+    return std::array{ execute_instrumented<i>... };
+}(std::make_integer_sequence<unsigned, 32>());
+
+static void
+execute(MSP430& msp, size_t& count)
+{
+    unsigned instruments = (msp.coverage ? INSTRUMENT_COVERAGE : 0U)
+        | (msp.profile ? INSTRUMENT_PROFILE : 0U)
+        | (msp.timing ? INSTRUMENT_TIMING : 0U)
+        | (msp.trace ? INSTRUMENT_TRACE : 0U)
+        | (msp.history ? INSTRUMENT_HISTORY : 0U);
+
+    // Recording sees every data access, so no page is plain while it is on
+    bool hooked = msp.trace || msp.history;
+    if (hooked != bool(msp.page_attributes[0] & MSP430::page_hooked)) [[unlikely]] {
+        for (auto& attributes : msp.page_attributes)
+            attributes ^= MSP430::page_hooked;
+    }
+
+    // run_until predicates are checked by the same loops
+    if (instruments || msp.until.check) [[unlikely]]
+        return INSTRUMENTED[instruments](msp, count);
+
+    // Threaded handlers can not stop at breakpoints, compiled code can not
+    // check watchpoints
+    auto engine = msp.engine;
+    if ((engine == MSP430::Engine::threaded && msp.breakpoint_count)
+        || (engine == MSP430::Engine::jit && msp.watchpoint_count)) [[unlikely]]
+        engine = MSP430::Engine::cached;
+
+    switch (engine) {
+        case MSP430::Engine::reference:
+            for (; count > 0 && not msp.stop_requested; count--)
+                step_checked(msp, msp.registers[PC]);
+            return;
+        case MSP430::Engine::cached:
+            for (; count > 0 && not msp.stop_requested; count--)
+                step_cached(msp);
+            return;
+        case MSP430::Engine::threaded:
+            return execute_threaded(msp, count);
+        case MSP430::Engine::jit:
+            return execute_jit(msp, count);
+    }
+}
+
+// Takes the highest pending interrupt while GIE is set. The 1xx family
+// clears all of SR, ending any low power mode.
+static void
+take_interrupt(MSP430& msp)
+{
+    unsigned pending = msp.pending_interrupts & 0x7fff;
+    if (not pending || not (current_sr(msp) & IF))
+        return;
+
+    // Both words are written before SP moves, so a fault leaves the interrupt
+    // pending with nothing changed
+    unsigned vector = 31 - __builtin_clz(pending);
+    sync_flags(msp);
+    auto sp = msp.registers[SP];
+    write_ram<Word>(msp, sp - 2, msp.registers[PC]);
+    write_ram<Word>(msp, sp - 4, msp.registers[SR]);
+    msp.registers[SP] = sp - 4;
+    msp.registers[SR] = 0;
+    auto return_pc = msp.registers[PC];
+    msp.registers[PC] = *reinterpret_cast<const uint16_t*>(&(*msp.ram)[MSP430::VECTORS + 2 * vector]);
+    if (msp.profile)
+        msp.profile->interrupt(msp.registers[PC], return_pc, sp);
+    msp.pending_interrupts &= ~(1u << vector);
+    msp.skip_breakpoint = false;
+    if (msp.timing)
+        msp.cycles += MSP430::INTERRUPT_CYCLES;
+}
+
+// Tight loops
+//
+// A conditional jump back to itself, or over one instruction, may make a loop
+// that run() can skip instead of executing:
+// - countdowns, dec Rn then jnz, which go round Rn more times
+// - steady loops, whose body only compares registers, ram and steady devices
+//   (see Device::steady). Every time round sets the same flags, so once the
+//   jump is taken after the body it always is.
+// Nothing else runs while the guest spins, and devices only raise interrupts
+// when accessed, so no event can end these early. run() moves registers,
+// flags, instruction count and cycles on by whole iterations, as far as the
+// budget and cycle limit allow.
+
+struct TightLoop {
+    enum Kind : uint8_t { busy, countdown, steady } kind;
+    uint8_t reg;            // Counter of a countdown
+    uint8_t length;         // Instructions, 1 for a jump to itself
+    uint8_t cycles;         // Each time round
+    Condition condition;
+    uint16_t jump;          // Address of the jump
+};
+
+// Whether an operand reads the same value each time round
+static bool
+steady_operand(const MSP430& msp, const Operand& operand, bool byte)
+{
+    uint16_t address;
+    switch (operand.kind) {
+        case reg_direct:
+            return operand.reg != PC && operand.reg != SR;
+        case constant:
+            return true;
+        case indexed:
+            address = msp.registers[operand.reg] + operand.ext;
+            break;
+        case absolute:
+            address = operand.ext;
+            break;
+        case indirect:
+            address = msp.registers[operand.reg];
+            break;
+        default:
+            return false;
+    }
+
+    if (not byte && (address & 1))
+        return false;
+    auto attributes = page_attributes(msp, address);
+    if (not (attributes & MSP430::page_read_trap))
+        return true;
+    if (byte || attributes != MSP430::page_mmio)
+        return false;
+    if (auto device = msp.mmio[address - MMIO_BASE])
+        return device->steady(msp, address);
+    return msp.unmapped_policy == MSP430::UnmappedPolicy::ignore;
+}
+
+static TightLoop
+tight_loop(const MSP430& msp, uint16_t pc)
+{
+    TightLoop loop = {};
+
+    // Body and jump on one page, clear of MMIO
+    if ((pc & 1) || (page_attributes(msp, pc) & MSP430::page_fetch_trap) || pc % MSP430::PAGE_BYTES > MSP430::PAGE_BYTES - 8)
+        return loop;
+
+    Fetch fetch = {
+        .words = reinterpret_cast<const uint16_t*>(&(*msp.ram)[pc]),
+        .pc = pc,
+        .count = 1,
+    };
+    auto instruction = fetch.words[0];
+    Operand src = {}, dst = {};
+
+    if (MSP430::classify(instruction) == MSP430::dual_operand) {
+        auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+        if (not decode_source(op, fetch, src) || not decode_dest(op, fetch, dst))
+            return loop;
+
+        auto jump_word = fetch.next();
+        auto jump = std::bit_cast<MSP430::ConditionalInsn>(jump_word);
+        if (MSP430::classify(jump_word) != MSP430::conditional || -jump.offset != fetch.count)
+            return loop;
+
+        loop.length = 2;
+        loop.cycles = instruction_cycles(instruction) + instruction_cycles(jump_word);
+        loop.condition = Condition(jump.condition);
+        loop.jump = fetch.address() - 2;
+
+        // sub #1, Rn or add #-1, Rn
+        bool decrement = src.kind == constant
+            && ((op.opcode == SUB && src.ext == 1) || (op.opcode == ADD && src.ext == 0xffff));
+        if (decrement && not op.bw && dst.kind == reg_direct && dst.reg > CG && loop.condition == not_equal) {
+            loop.kind = TightLoop::countdown;
+            loop.reg = dst.reg;
+        }
+
+        bool compare = op.opcode == CMP || op.opcode == BIT;
+        if (compare && steady_operand(msp, src, op.bw) && steady_operand(msp, dst, op.bw))
+            loop.kind = TightLoop::steady;
+        return loop;
+    }
+
+    auto jump = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+    if (MSP430::classify(instruction) == MSP430::conditional && jump.offset == -1) {
+        loop = { TightLoop::steady, 0, 1, 2, Condition(jump.condition), pc };
+    }
+    return loop;
+}
+
+bool
+is_tight_loop(const MSP430& msp, uint16_t pc)
+{
+    return tight_loop(msp, pc).kind != TightLoop::busy;
+}
+
+void
+check_tight_loop(MSP430& msp)
+{
+    // Recording and stopping need every instruction executed
+    if (msp.coverage || msp.profile || msp.trace || msp.history || msp.until.check
+        || msp.breakpoint_count || msp.watchpoint_count)
+        return;
+
+    if (is_tight_loop(msp, msp.registers[PC]))
+        msp.stop_requested |= MSP430::stop_idle;
+}
+
+static void
+skip_tight_loop(MSP430& msp, size_t& count)
+{
+    // With the budget spent, even the body of a steady loop must not run
+    if (count == 0)
+        return;
+
+    auto loop = tight_loop(msp, msp.registers[PC]);
+
+    // Whole iterations within what is left of the budget and cycle limit
+    auto room = [&]() -> uint64_t {
+        uint64_t iterations = count / loop.length;
+        if (msp.timing) {
+            auto cycles = msp.cycles < msp.cycle_limit ? msp.cycle_limit - msp.cycles : 0;
+            iterations = std::min(iterations, cycles / loop.cycles);
+        }
+        return iterations;
+    };
+
+    switch (loop.kind) {
+        case TightLoop::busy:
+            return;
+
+        case TightLoop::countdown: {
+            // The last time round falls through the jump, executed as usual
+            auto& counter = msp.registers[loop.reg];
+            auto iterations = std::min(room(), uint64_t(uint16_t(counter - 1)));
+            if (not iterations)
+                return;
+            counter -= iterations;
+            uint16_t before = counter + 1;
+            alu_flags_update<Word>(msp, true, before & 0x8000, before + 0xffffu);
+            count -= loop.length * iterations;
+            if (msp.timing)
+                msp.cycles += loop.cycles * iterations;
+            return;
+        }
+
+        case TightLoop::steady: {
+            // The flags the jump sees from here on come from the body
+            if (loop.length == 2) {
+                size_t one = 1;
+                execute(msp, one);
+                count -= 1 - one;
+                if (msp.stop_requested || msp.registers[PC] != loop.jump)
+                    return;
+            }
+            if (not is_condition(current_sr(msp), loop.condition))
+                return;
+
+            // Round from the jump, back to it
+            auto iterations = room();
+            count -= loop.length * iterations;
+            if (msp.timing)
+                msp.cycles += loop.cycles * iterations;
+            return;
+        }
+    }
+}
+
+// Undoes the register changes of the instruction at pc, which faulted, see
+// at_instruction. With PC still there it faulted fetching its first word.
+static void
+rewind_instruction(MSP430& msp, uint16_t pc)
+{
+    if (msp.registers[PC] == pc)
+        return;
+
+    auto instruction = load_ram<Word>(msp, pc & ~1);
+    unsigned reg = 0, as = 0;
+    bool byte = false, push = false;
+
+    switch (MSP430::classify(instruction)) {
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            reg = op.source, as = op.as, byte = op.bw;
+            break;
+        }
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            if (op.opcode <= CALL)
+                reg = op.target, as = op.as, byte = op.bw, push = op.opcode == PUSH;
+            break;
+        }
+        default:
+            break;
+    }
+
+    // @PC+ is an immediate and PC is restored anyway, SR and CG give constants
+    if (as == 3 && (reg == SP || reg > CG))
+        msp.registers[reg] -= byte && reg != SP ? 1 : 2;
+    if (push)
+        msp.registers[SP] += 2;
+    msp.registers[PC] = pc;
+}
+
+// Result for an error thrown by run(), once the faulting instruction is undone
+static MSP430::RunResult
+fault_result(MSP430& msp, MSP430::StopReason reason, const std::exception& e)
+{
+    if (msp.faulting_pc)
+        rewind_instruction(msp, *msp.faulting_pc);
+    msp.faulting_pc.reset();
+
+    auto pc = msp.registers[PC];
+    char where[16];
+    snprintf(where, sizeof(where), " (pc 0x%04x)", pc);
+    return { reason, 0, std::string(e.what()) + where, pc };
+}
+
+MSP430::RunResult MSP430::run(size_t max_instructions)
+{
+    size_t count = max_instructions;
+    RunResult result = { StopReason::budget, 0, {} };
+    stop_requested = 0;
+    skip_breakpoint = has_breakpoint(registers[PC]);
+    watch_hit = {};
+
+    // Faults are rare, so engines throw and the loop is not slowed by checks.
+    // Interrupts are only looked at between batches, a device raising one
+    // ends the batch.
+    try {
+        for (;;) {
+            if (pending_interrupts) [[unlikely]]
+                take_interrupt(*this);
+            if (trace)
+                trace->start(*this);
+
+            execute(*this, count);
+
+            // Engines stop at loops to skip, see check_tight_loop
+            bool idle = stop_requested & stop_idle;
+            if (idle) [[unlikely]] {
+                stop_requested &= ~stop_idle;
+                skip_tight_loop(*this, count);
+            }
+            if (count == 0 || (stop_requested & ~stop_interrupt) || not (stop_requested || idle))
+                break;
+            stop_requested = 0;
+        }
+
+        if (stop_requested & stop_watch)
+            result.reason = StopReason::watchpoint;
+        else if (stop_requested & stop_exit)
+            result.reason = StopReason::exit;
+        else if (stop_requested & stop_until)
+            result.reason = StopReason::breakpoint;
+    } catch (BreakpointHit&) {
+        result.reason = StopReason::breakpoint;
+    } catch (IllegalInstruction& e) {
+        result = fault_result(*this, StopReason::illegal, e);
+    } catch (MisalignedAccess& e) {
+        result = fault_result(*this, StopReason::misaligned, e);
+    } catch (std::exception& e) {
+        result = fault_result(*this, StopReason::fault, e);
+    }
+
+    faulting_pc.reset();
+    stop_requested = 0;
+    skip_breakpoint = false;
+    ::sync_flags(*this);
+    if (trace && result.reason != StopReason::budget)
+        trace->stop(result.reason);
+    result.instructions = max_instructions - count;
+    return result;
+}
+
+MSP430::RunResult MSP430::run_cycles(uint64_t max_cycles, size_t max_instructions)
+{
+    auto saved_timing = timing;
+    auto saved_limit = cycle_limit;
+    timing = true;
+    cycle_limit = cycles + std::min(max_cycles, UINT64_MAX - cycles);
+
+    auto result = run(max_instructions);
+
+    timing = saved_timing;
+    cycle_limit = saved_limit;
+    return result;
+}
+
+void MSP430::step_instruction()
+{
+    auto result = run(1);
+    if (result.reason != StopReason::budget)
+        throw Error(result.message.empty() ? stop_reason_name(result.reason) : result.message);
+}
+
+bool MSP430::parse_engine(const char* name, Engine& engine)
+{
+    static constexpr struct {
+        const char* name;
+        Engine engine;
+    } engines[] = {
+        { "reference", Engine::reference },
+        { "cached", Engine::cached },
+        { "threaded", Engine::threaded },
+        { "jit", Engine::jit },
+    };
+
+    for (auto& e : engines) {
+        if (strcmp(name, e.name) == 0) {
+            engine = e.engine;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* MSP430::stop_reason_name(StopReason reason)
+{
+    switch (reason) {
+        case StopReason::budget:        return "budget";
+        case StopReason::exit:          return "exit";
+        case StopReason::illegal:       return "illegal instruction";
+        case StopReason::misaligned:    return "misaligned access";
+        case StopReason::breakpoint:    return "breakpoint";
+        case StopReason::watchpoint:    return "watchpoint";
+        case StopReason::fault:         return "fault";
+    }
+    unreachable();
+}
+
+#ifdef MSP430TEST
+
+#include "fleet.hpp"
+#include "fuzz.hpp"
+#include "gdb.hpp"
+#include "msp430x.hpp"
+#include "uart.hpp"
+
+#include <elf.h>
+#include <random>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+static void test_alu2_word()
+{
+    MSP430 m{};
+    int successes{};
+
+    struct TestCase {
+        DualOpCode opp;
+        uint16_t src, dst, flags;
+        uint16_t expected, flags_out;
+    };
+
+    static constexpr struct TestCase tests[] = {
+        TestCase( ADD, 1, 1, 0, 2, 0 ),
+        TestCase( SUB, 1, 2, 0, 1, CF ),
+        TestCase( SUB, 1, 1, 0, 0, ZF|CF ),
+        TestCase( CMP, 1, -1, 0, -1, NF|CF ),
+        TestCase( SUB, 1, -1, 0, -2, NF|CF ),
+        TestCase( ADD, 30000, 30000, 0, 60000, VF|NF ),
+        TestCase( SUB, 30000, -30000, 0, 5536, VF|CF ),
     };
 
     for (auto& test : tests) {
@@ -691,7 +1328,7 @@ static void test_alu2_word()
             .source = 4,
             .opcode = test.opp,
         };
-        write_ram<Word>(*m.ram, 0, std::bit_cast<uint16_t>(insn));
+        write_ram<Word>(m, 0, std::bit_cast<uint16_t>(insn));
 
         m.registers[PC] = 0;
         m.registers[SR] = test.flags;
@@ -734,9 +1371,1761 @@ static void test_alu2_word()
     printf("test-alu2: count %zu success %i\n", std::size(tests), successes);
 }
 
+static void test_self_modifying()
+{
+    static constexpr MSP430::Engine engines[] = {
+        MSP430::Engine::reference,
+        MSP430::Engine::cached,
+        MSP430::Engine::threaded,
+        MSP430::Engine::jit,
+    };
+
+    // Executes "inc r5", replaces it with "incd r5" and loops back to it
+    static constexpr uint16_t program[] = {
+        0x5315,             // add #1, r5
+        0x4482, 0x0000,     // mov r4, &0x0000
+        0x3ffc,             // jmp 0x0000
+    };
+
+    int successes{};
+
+    for (auto engine : engines) {
+        MSP430 m{};
+        m.engine = engine;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 2*i, program[i]);
+        m.registers[4] = 0x5325; // add #2, r5
+
+        auto result = m.run(4);
+        if (result.reason == MSP430::StopReason::budget && m.registers[5] == 3)
+            successes++;
+        else
+            printf(
+                "SMC test fail (engine %i): stopped by %s, r5 = %i\n",
+                int(engine), MSP430::stop_reason_name(result.reason), m.registers[5]
+            );
+    }
+
+    printf("test-smc: count %zu success %i\n", std::size(engines), successes);
+}
+
+static void test_run_stop()
+{
+    using enum MSP430::StopReason;
+
+    struct TestCase {
+        uint16_t program[3];
+        MSP430::StopReason reason;
+        size_t instructions;
+    };
+
+    static constexpr TestCase tests[] = {
+        { { 0x4382, MMIO_EXIT }, exit, 1 },     // mov #0, &MMIO_EXIT
+        { { 0x4425 }, misaligned, 0 },          // mov @r4, r5
+        { { 0x1380 }, illegal, 0 },             // single operand opcode 7
+        { { 0x5315, 0x3ffe }, budget, 10 },     // inc r5; jmp $
+    };
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        for (auto& test : tests) {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(test.program); i++)
+                write_ram<Word>(m, 2*i, test.program[i]);
+            m.registers[4] = 0x4001;
+
+            auto result = m.run(10);
+            count++;
+            if (result.reason == test.reason && result.instructions == test.instructions)
+                successes++;
+            else
+                printf(
+                    "Run test fail (engine %i): %04x stopped by %s after %zu\n",
+                    int(engine), test.program[0],
+                    MSP430::stop_reason_name(result.reason), result.instructions
+                );
+        }
+    }
+
+    printf("test-run: count %i success %i\n", count, successes);
+}
+
+static void test_devices()
+{
+    struct Latch : MSP430::Device {
+        uint16_t value = 0;
+        uint16_t read(MSP430&, uint16_t) override { return value; }
+        void write(MSP430&, uint16_t, uint16_t v) override { value = v; }
+    };
+
+    static constexpr uint16_t program[] = {
+        0x40b2, 0x1234, 0xff10, // mov #0x1234, &0xff10
+        0x4215, 0xff10,         // mov &0xff10, r5
+        0x4216, 0xff20,         // mov &0xff20, r6
+        0x4382, MMIO_EXIT,      // mov #0, &MMIO_EXIT
+    };
+
+    int count{}, successes{};
+
+    for (auto policy : { MSP430::UnmappedPolicy::fault, MSP430::UnmappedPolicy::ignore }) {
+        MSP430 m{};
+        m.attach_device(0xff10, 2, std::make_shared<Latch>());
+        m.unmapped_policy = policy;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 2*i, program[i]);
+        m.registers[6] = 1;
+
+        // Faulting leaves r6 alone, ignoring reads zero into it
+        bool ignore = policy == MSP430::UnmappedPolicy::ignore;
+        auto expected = ignore ? MSP430::StopReason::exit : MSP430::StopReason::fault;
+
+        auto result = m.run(10);
+        count++;
+        if (result.reason == expected && m.registers[5] == 0x1234 && m.registers[6] == !ignore)
+            successes++;
+        else
+            printf(
+                "Device test fail (policy %i): stopped by %s, r5 = %04x, r6 = %04x\n",
+                int(policy), MSP430::stop_reason_name(result.reason), m.registers[5], m.registers[6]
+            );
+    }
+
+    printf("test-devices: count %i success %i\n", count, successes);
+}
+
+static void test_misaligned()
+{
+    static constexpr uint16_t program[] = {
+        0x4425,             // mov @r4, r5
+        0x4586, 0x0000,     // mov r5, 0(r6)
+        0x4382, MMIO_EXIT,  // mov #0, &MMIO_EXIT
+    };
+
+    int count{}, successes{};
+
+    for (auto policy : { MSP430::MisalignedPolicy::trap, MSP430::MisalignedPolicy::align }) {
+        for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                             MSP430::Engine::threaded, MSP430::Engine::jit }) {
+            MSP430 m{};
+            m.engine = engine;
+            m.misaligned_policy = policy;
+            for (size_t i=0; i<std::size(program); i++)
+                write_ram<Word>(m, 2*i, program[i]);
+            write_ram<Word>(m, 0x1000, 0xbeef);
+            m.registers[4] = 0x1001;
+            m.registers[6] = 0x2003;
+
+            // Aligning reads 0x1000 and writes 0x2002
+            bool align = policy == MSP430::MisalignedPolicy::align;
+            auto expected = align ? MSP430::StopReason::exit : MSP430::StopReason::misaligned;
+
+            auto result = m.run(10);
+            count++;
+            if (result.reason == expected && m.registers[5] == (align ? 0xbeef : 0)
+                && read_ram<Word>(m, 0x2002) == (align ? 0xbeef : 0))
+                successes++;
+            else
+                printf(
+                    "Misaligned test fail (policy %i, engine %i): stopped by %s, r5 = %04x\n",
+                    int(policy), int(engine), MSP430::stop_reason_name(result.reason), m.registers[5]
+                );
+        }
+    }
+
+    printf("test-misaligned: count %i success %i\n", count, successes);
+}
+
+static void test_protection()
+{
+    struct Case {
+        uint16_t code[4];
+        uint16_t page;
+        uint8_t denied;
+        const char* message;
+        uint16_t pc;    // Of the faulting instruction
+    };
+    static constexpr Case cases[] = {
+        { { 0x4505, 0x40b2, 0x1234, 0x2000 }, 0x2000, MSP430::page_no_write, "Write to protected memory at 0x2000 (pc 0x1002)", 0x1002 },
+        { { 0x4215, 0x3000 }, 0x3000, MSP430::page_protection, "Read from unmapped memory at 0x3000 (pc 0x1000)", 0x1000 },
+        { { 0x4305 }, 0x1000, MSP430::page_no_exec, "Execute from protected memory at 0x1000 (pc 0x1000)", 0x1000 },
+        // @R5+, PUSH and CALL put back R5 and SP, ADD leaves the flags
+        { { 0x4536 }, 0x3000, MSP430::page_protection, "Read from unmapped memory at 0x30fe (pc 0x1000)", 0x1000 },
+        { { 0x1205 }, 0x2000, MSP430::page_no_write, "Write to protected memory at 0x20fe (pc 0x1000)", 0x1000 },
+        { { 0x12b5 }, 0x2000, MSP430::page_no_write, "Write to protected memory at 0x20fe (pc 0x1000)", 0x1000 },
+        { { 0x55b2, 0x2000 }, 0x2000, MSP430::page_no_write, "Write to protected memory at 0x2000 (pc 0x1000)", 0x1000 },
+    };
+
+    int count{}, successes{};
+
+    for (auto& c : cases) {
+        for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                             MSP430::Engine::threaded, MSP430::Engine::jit }) {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(c.code); i++)
+                write_ram<Word>(m, 0x1000 + 2*i, c.code[i]);
+            m.protect(c.page, MSP430::PAGE_BYTES, c.denied);
+            m.registers[PC] = 0x1000;
+            m.registers[SP] = 0x2100;
+            m.registers[5] = 0x30fe;
+
+            uint16_t expected[16];
+            memcpy(expected, m.registers, sizeof(expected));
+            expected[PC] = c.pc;
+
+            // Faulting before the access, the write never lands and the
+            // registers are as before the instruction
+            auto result = m.run(10);
+            count++;
+            if (result.reason == MSP430::StopReason::fault && result.message == c.message
+                    && result.pc == c.pc && result.instructions == (c.pc - 0x1000u) / 2
+                    && memcmp(m.registers, expected, sizeof(expected)) == 0 && (*m.ram)[0x2000] == 0)
+                successes++;
+            else
+                printf(
+                    "Protection test fail (engine %i): stopped by %s, %s, pc %04x r5 %04x sp %04x sr %04x\n",
+                    int(engine), MSP430::stop_reason_name(result.reason), result.message.c_str(),
+                    m.registers[PC], m.registers[5], m.registers[SP], m.registers[SR]
+                );
+        }
+    }
+
+    // An interrupt whose entry faults stays pending, with nothing pushed
+    MSP430 m{};
+    write_ram<Word>(m, 0x1000, 0x4305);
+    m.protect(0x2000, MSP430::PAGE_BYTES, MSP430::page_no_write);
+    m.registers[PC] = 0x1000;
+    m.registers[SP] = 0x2100;
+    m.registers[SR] = IF;
+    m.pending_interrupts = 1;
+    auto result = m.run(10);
+    count++;
+    if (result.reason == MSP430::StopReason::fault && m.registers[SP] == 0x2100
+            && m.registers[PC] == 0x1000 && m.registers[SR] == IF && m.pending_interrupts == 1)
+        successes++;
+    else
+        printf("Protection test fail: interrupt entry, %s, sp %04x\n", result.message.c_str(), m.registers[SP]);
+
+    printf("test-protection: count %i success %i\n", count, successes);
+}
+
+static void test_snapshot()
+{
+    // Self-modifying loop that also writes r5 to 0x1000
+    static constexpr uint16_t program[] = {
+        0x5315,             // add #1, r5
+        0x4482, 0x0000,     // mov r4, &0x0000
+        0x4582, 0x1000,     // mov r5, &0x1000
+        0x3ffa,             // jmp 0x0000
+    };
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        MSP430 m{};
+        m.engine = engine;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 2*i, program[i]);
+        m.registers[4] = 0x5325; // add #2, r5
+
+        auto snapshot = m.snapshot();
+        auto initial = *m.ram;
+
+        m.run(12);
+        auto r5 = m.registers[5];
+
+        // Restored state must match and run the same, including the old code
+        m.restore(snapshot);
+        bool restored = *m.ram == initial && m.registers[4] == 0x5325 && m.registers[5] == 0;
+        m.run(12);
+
+        MSP430 fork{};
+        fork.engine = engine;
+        fork.restore(snapshot);
+        fork.run(12);
+
+        count++;
+        if (restored && r5 == 5 && m.registers[5] == r5 && fork.registers[5] == r5 && *fork.ram == *m.ram)
+            successes++;
+        else
+            printf(
+                "Snapshot test fail (engine %i): restored %i, r5 = %i, %i, %i\n",
+                int(engine), restored, r5, m.registers[5], fork.registers[5]
+            );
+    }
+
+    printf("test-snapshot: count %i success %i\n", count, successes);
+}
+
+static void test_ram_pool()
+{
+    int count{}, successes{};
+
+    static constexpr uint16_t program[] = {
+        0x4035, 0x1234,         // mov #0x1234, r5
+        0x4582, 0x2000,         // mov r5, &0x2000
+        0x4382, MMIO_EXIT,      // mov #0, &MMIO_EXIT
+    };
+
+    MSP430::RamPool pool(2, 1);
+    MSP430::RAM* slots[2];
+    {
+        MSP430 a{pool}, b{pool};
+        slots[0] = a.ram.get();
+        slots[1] = b.ram.get();
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(a, 2*i, program[i]);
+        auto image = a.snapshot();
+
+        // Restored by copying, instances stay apart
+        b.restore(image);
+        auto result = b.run(10);
+        count++;
+        if (result.reason == MSP430::StopReason::exit && load_ram<Word>(b, 0x2000) == 0x1234 && load_ram<Word>(a, 0x2000) == 0)
+            successes++;
+        else
+            printf("RAM pool test fail: pooled instance stopped by %s\n", MSP430::stop_reason_name(result.reason));
+
+        // The built-in devices are shared, not allocated per instance
+        count++;
+        if (a.devices.empty() && a.mmio == b.mmio)
+            successes++;
+        else
+            printf("RAM pool test fail: pooled instances own %zu devices\n", a.devices.size());
+
+        count++;
+        try {
+            MSP430 c{pool};
+            printf("RAM pool test fail: took more slots than the pool holds\n");
+        } catch (std::bad_alloc&) {
+            successes++;
+        }
+    }
+
+    // Slots are reused, zeroed for the new instance
+    MSP430 c{pool}, d{pool};
+    count++;
+    bool reused = (c.ram.get() == slots[0] || c.ram.get() == slots[1]) && d.ram.get() != c.ram.get();
+    if (reused && load_ram<Word>(c, 0) == 0 && load_ram<Word>(d, 0x2000) == 0)
+        successes++;
+    else
+        printf("RAM pool test fail: slots not reused\n");
+
+    // Instances take from the partition they name, then borrow from the next
+    MSP430::RamPool partitioned(4, 2);
+    auto slot_of = [&](const MSP430& m) {
+        return (reinterpret_cast<uint8_t*>(m.ram.get()) - partitioned.arena) / MSP430::RAM_SIZE;
+    };
+    MSP430 e{partitioned, 1}, f{partitioned, 3}, g{partitioned, 1}, h{partitioned, 0};
+    count++;
+    if (slot_of(e) == 2 && slot_of(f) == 3 && slot_of(g) == 0 && slot_of(h) == 1)
+        successes++;
+    else
+        printf("RAM pool test fail: slots %zu %zu %zu %zu from their partitions\n", slot_of(e), slot_of(f), slot_of(g), slot_of(h));
+
+    printf("test-ram-pool: count %i success %i\n", count, successes);
+}
+
+static void test_cycles()
+{
+    static constexpr struct {
+        uint16_t instruction;
+        uint8_t cycles;
+    } tests[] = {
+        { 0x4f0e, 1 },  // mov r15, r14
+        { 0x4130, 3 },  // ret
+        { 0x4215, 3 },  // mov &EDE, r5
+        { 0x40b2, 5 },  // mov #N, &EDE
+        { 0x5392, 4 },  // add #1, &EDE
+        { 0x1204, 3 },  // push r4
+        { 0x12b0, 5 },  // call #N
+        { 0x1300, 5 },  // reti
+        { 0x3c00, 2 },  // jmp
+    };
+
+    int successes{};
+
+    for (auto& test : tests) {
+        auto cycles = instruction_cycles(test.instruction);
+        if (cycles == test.cycles)
+            successes++;
+        else
+            printf("Cycles test fail: %04x took %i, expected %i\n", test.instruction, cycles, test.cycles);
+    }
+
+    printf("test-cycles: count %zu success %i\n", std::size(tests), successes);
+}
+
+static void test_timing()
+{
+    static constexpr uint16_t program[] = {
+        0x4034, 0x0005,     // mov #5, r4       2 cycles
+        0x8314,             // dec r4           1
+        0x23fe,             // jnz 0x0004       2
+        0x4382, MMIO_EXIT,  // mov #0, &EXIT    4
+    };
+
+    struct TestCase {
+        uint64_t max_cycles;
+        MSP430::StopReason reason;
+        size_t instructions;
+        uint64_t cycles;
+    };
+
+    static constexpr TestCase tests[] = {
+        { 1000, MSP430::StopReason::exit, 12, 21 },
+        { 10, MSP430::StopReason::budget, 7, 11 },
+    };
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::jit }) {
+        for (auto& test : tests) {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(program); i++)
+                write_ram<Word>(m, 2*i, program[i]);
+
+            auto result = m.run_cycles(test.max_cycles);
+            count++;
+            if (result.reason == test.reason && result.instructions == test.instructions && m.cycles == test.cycles)
+                successes++;
+            else
+                printf(
+                    "Timing test fail (engine %i): stopped by %s after %zu, %llu cycles\n",
+                    int(engine), MSP430::stop_reason_name(result.reason),
+                    result.instructions, (unsigned long long)m.cycles
+                );
+        }
+    }
+
+    printf("test-timing: count %i success %i\n", count, successes);
+}
+
+static void test_tight_loops()
+{
+    static constexpr uint16_t program[] = {
+        0x4034, 1000,       // mov #1000, r4    2 cycles
+        0x8314,             // dec r4           1
+        0x23fe,             // jnz 0x0004       2
+        0x9382, MMIO_EXIT,  // tst &EXIT        4, reads zero forever
+        0x27fd,             // jz 0x0008        2
+    };
+
+    struct TestCase {
+        uint64_t max_cycles; // Zero to run without timing
+        size_t instructions;
+        uint64_t cycles;
+        uint16_t pc;
+    };
+
+    // Far more instructions than executing them one by one would finish
+    static constexpr TestCase tests[] = {
+        { 0, 1'000'000'000, 0, 0x000c },
+        { 10'000'000, 3'334'334, 10'000'002, 0x000c },
+    };
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        for (auto& test : tests) {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(program); i++)
+                write_ram<Word>(m, 2*i, program[i]);
+
+            auto result = test.max_cycles
+                ? m.run_cycles(test.max_cycles, 1'000'000'000)
+                : m.run(1'000'000'000);
+            count++;
+            bool ok = result.reason == MSP430::StopReason::budget
+                && result.instructions == test.instructions && m.cycles == test.cycles
+                && m.registers[PC] == test.pc && m.registers[4] == 0 && (m.registers[SR] & ZF);
+            if (ok)
+                successes++;
+            else
+                printf(
+                    "Tight loop test fail (engine %i): %zu instructions, %llu cycles, pc 0x%04x, r4 %u\n",
+                    int(engine), result.instructions, (unsigned long long)m.cycles,
+                    m.registers[PC], m.registers[4]
+                );
+        }
+    }
+
+    // A steady loop of two instructions, cmp r5, r6 then jne, with budgets
+    // ending on the jump, as when single stepping
+    static constexpr uint16_t steady[] = {
+        0x9506,             // cmp r5, r6
+        0x23fe,             // jne 0x0000
+    };
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        for (size_t budget : { 1, 2, 3, 4, 1000, 1'000'000'001 }) {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(steady); i++)
+                write_ram<Word>(m, 2*i, steady[i]);
+            m.registers[5] = 1;
+            m.registers[6] = 2;
+
+            auto result = m.run(budget);
+            count++;
+            if (result.reason == MSP430::StopReason::budget && result.instructions == budget
+                    && m.registers[PC] == (budget & 1 ? 0x0002 : 0x0000))
+                successes++;
+            else
+                printf(
+                    "Tight loop test fail (engine %i): steady run(%zu), %zu instructions, pc 0x%04x\n",
+                    int(engine), budget, result.instructions, m.registers[PC]
+                );
+        }
+
+        MSP430 m{};
+        m.engine = engine;
+        for (size_t i=0; i<std::size(steady); i++)
+            write_ram<Word>(m, 2*i, steady[i]);
+        m.registers[5] = 1;
+        m.registers[6] = 2;
+
+        bool ok = true;
+        for (unsigned i=0; i<10; i++) {
+            auto result = m.run(1);
+            ok = ok && result.reason == MSP430::StopReason::budget && result.instructions == 1
+                && m.registers[PC] == (i & 1 ? 0x0000 : 0x0002);
+        }
+        count++;
+        if (ok)
+            successes++;
+        else
+            printf("Tight loop test fail (engine %i): steady run(1), pc 0x%04x\n", int(engine), m.registers[PC]);
+    }
+
+    printf("test-tight-loops: count %i success %i\n", count, successes);
+}
+
+static void test_uart_io()
+{
+    static constexpr uint16_t program[] = {
+        0x4215, MMIO_UART,          // mov &UART, r5
+        0x9375,                     // cmp.b #-1, r5
+        0x2403,                     // jeq 0x000e
+        0x4582, MMIO_UART,          // mov r5, &UART
+        0x3ff9,                     // jmp 0x0000
+        0x4216, MMIO_UART_STATUS,   // mov &UART_STATUS, r6
+        0x4382, MMIO_EXIT,          // mov #0, &EXIT
+    };
+
+    // Echoes more than both rings and pipes hold, so every side waits on
+    // another at some point
+    std::string input(200'000, '\0');
+    for (size_t i=0; i<input.size(); i++)
+        input[i] = char(i % 251);
+
+    int in[2], out[2];
+    if (pipe(in) || pipe(out)) {
+        printf("UART test fail: %s\n", strerror(errno));
+        printf("test-uart-io: count 1 success 0\n");
+        return;
+    }
+
+    std::thread writer([&] {
+        (void)!write(in[1], input.data(), input.size());
+        close(in[1]);
+    });
+    std::string output;
+    std::thread reader([&] {
+        char buffer[4096];
+        ssize_t count;
+        while ((count = read(out[0], buffer, sizeof(buffer))) > 0)
+            output.append(buffer, count);
+    });
+
+    MSP430 m{};
+    for (size_t i=0; i<std::size(program); i++)
+        write_ram<Word>(m, 2*i, program[i]);
+
+    MSP430::RunResult result;
+    {
+        UartIo uart(in[0], out[1]);
+        uart.connect(m);
+        result = m.run(10'000'000);
+    }
+    close(out[1]);
+    writer.join();
+    reader.join();
+    close(in[0]);
+    close(out[0]);
+
+    int successes{};
+    uint16_t ready = MSP430::UART_RX_READY | MSP430::UART_TX_READY;
+    if (result.reason == MSP430::StopReason::exit && output == input && m.registers[6] == ready)
+        successes++;
+    else
+        printf(
+            "UART test fail: stopped by %s, %zu of %zu bytes echoed, status %04x\n",
+            MSP430::stop_reason_name(result.reason), output.size(), input.size(), m.registers[6]
+        );
+
+    printf("test-uart-io: count 1 success %i\n", successes);
+}
+
+static void test_load_bin()
+{
+    static constexpr uint16_t program[] = {
+        0x5315,             // inc r5
+        0x4382, MMIO_EXIT,  // mov #0, &MMIO_EXIT
+    };
+
+    char path[] = "/tmp/msp430test-XXXXXX.bin";
+    int fd = mkstemps(path, 4);
+    bool written = fd >= 0 && write(fd, program, sizeof(program)) == sizeof(program);
+    if (fd >= 0)
+        close(fd);
+
+    int successes{};
+
+    // Two instances share the image memory, one writing must not affect the other
+    try {
+        auto image = MSP430::load_image(path);
+        MSP430 a{}, b{};
+        a.load(image);
+        b.load(image);
+        write_ram<Word>(a, 0, 0x5325); // incd r5
+        auto result = b.run(10);
+        if (written && result.reason == MSP430::StopReason::exit && b.registers[5] == 1)
+            successes++;
+        else
+            printf("Load test fail: stopped by %s, r5 = %i\n", MSP430::stop_reason_name(result.reason), b.registers[5]);
+    } catch (std::exception& e) {
+        printf("Load test fail: %s\n", e.what());
+    }
+    unlink(path);
+
+    printf("test-load: count 1 success %i\n", successes);
+}
+
+// Code at 0 and a read-only vector table at VECTORS, as linker scripts lay
+// them out. The table shares its page with MMIO, which must stay writable.
+static void test_load_protection()
+{
+    static constexpr uint16_t program[] = {
+        0x4392, MMIO_EXIT,  // mov #1, &MMIO_EXIT
+    };
+    static constexpr uint16_t vector_table[16] = {}; // Reset to the code at 0
+
+    struct {
+        Elf32_Ehdr header;
+        Elf32_Phdr programs[2];
+        uint16_t code[std::size(program)];
+        uint16_t vectors[std::size(vector_table)];
+    } file = {};
+
+    memcpy(file.header.e_ident, ELFMAG, SELFMAG);
+    file.header.e_ident[EI_CLASS] = ELFCLASS32;
+    file.header.e_ident[EI_DATA] = ELFDATA2LSB;
+    file.header.e_ident[EI_VERSION] = EV_CURRENT;
+    file.header.e_type = ET_EXEC;
+    file.header.e_machine = EM_MSP430;
+    file.header.e_version = EV_CURRENT;
+    file.header.e_phoff = offsetof(decltype(file), programs);
+    file.header.e_ehsize = sizeof(Elf32_Ehdr);
+    file.header.e_phentsize = sizeof(Elf32_Phdr);
+    file.header.e_phnum = 2;
+
+    file.programs[0] = { PT_LOAD, offsetof(decltype(file), code), 0, 0, sizeof(program), sizeof(program), PF_R | PF_X, 2 };
+    file.programs[1] = { PT_LOAD, offsetof(decltype(file), vectors), MSP430::VECTORS, MSP430::VECTORS, sizeof(vector_table), sizeof(vector_table), PF_R, 2 };
+    memcpy(file.code, program, sizeof(program));
+    memcpy(file.vectors, vector_table, sizeof(vector_table));
+
+    char path[] = "/tmp/msp430test-XXXXXX";
+    int fd = mkstemp(path);
+    bool written = fd >= 0 && write(fd, &file, sizeof(file)) == sizeof(file);
+    if (fd >= 0)
+        close(fd);
+
+    int count{}, successes{};
+
+    try {
+        auto image = MSP430::load_image(path);
+        auto mmio_page = MSP430::MMIO_BASE / MSP430::PAGE_BYTES;
+        count++;
+        if (written && image->protection[mmio_page] == MSP430::page_no_exec
+                && image->protection[0] == MSP430::page_no_write)
+            successes++;
+        else
+            printf("Load protection test fail: page protection %02x, %02x\n", image->protection[0], image->protection[mmio_page]);
+
+        for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                             MSP430::Engine::threaded, MSP430::Engine::jit }) {
+            MSP430 m{};
+            m.engine = engine;
+            m.load(image);
+            auto result = m.run(10);
+            count++;
+            if (result.reason == MSP430::StopReason::exit)
+                successes++;
+            else
+                printf(
+                    "Load protection test fail (engine %i): stopped by %s, %s\n",
+                    int(engine), MSP430::stop_reason_name(result.reason), result.message.c_str()
+                );
+        }
+
+        // Explicit protection keeps MMIO writable too
+        MSP430 m{};
+        m.load(image);
+        m.protect(MSP430::MMIO_BASE, MSP430::PAGE_BYTES, MSP430::page_protection);
+        count++;
+        if (m.run(10).reason == MSP430::StopReason::exit)
+            successes++;
+        else
+            printf("Load protection test fail: protect() denied MMIO access\n");
+    } catch (std::exception& e) {
+        count++;
+        printf("Load protection test fail: %s\n", e.what());
+    }
+    unlink(path);
+
+    printf("test-load-protection: count %i success %i\n", count, successes);
+}
+
+static void test_trace()
+{
+    static constexpr uint16_t program[] = {
+        0x4034, 0x0003,     // mov #3, r4
+        0x8314,             // dec r4
+        0x23fe,             // jnz 0x0004
+        0x4382, MMIO_EXIT,  // mov #0, &MMIO_EXIT
+    };
+
+    static constexpr const char* expected =
+        "sync pc=0000 sp=0000 sr=0000 cg=0000 r4=0000 r5=0000 r6=0000 r7=0000"
+        " r8=0000 r9=0000 r10=0000 r11=0000 r12=0000 r13=0000 r14=0000 r15=0000\n"
+        "         0 0000: 4034  r4=0003\n"
+        "         1 0004: 8314  sr=0001 r4=0002\n"
+        "         2 0006: 23fe \n"
+        "         3 0004: 8314  r4=0001\n"
+        "         4 0006: 23fe \n"
+        "         5 0004: 8314  sr=0003 r4=0000\n"
+        "         6 0006: 23fe \n"
+        "         7 0008: 4382  [fffe]<-0000\n"
+        "stop exit\n";
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached }) {
+        char path[] = "/tmp/msp430test-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd >= 0)
+            close(fd);
+
+        std::string text;
+        try {
+            MSP430 m{};
+            m.engine = engine;
+            for (size_t i=0; i<std::size(program); i++)
+                write_ram<Word>(m, 2*i, program[i]);
+
+            // Destroying the tracer flushes it
+            {
+                Tracer tracer(path, 2 * Tracer::CHUNK_BYTES);
+                m.trace = &tracer;
+                m.run(100);
+                m.trace = nullptr;
+            }
+
+            char* buffer = nullptr;
+            size_t length = 0;
+            auto in = fopen(path, "rb");
+            auto out = open_memstream(&buffer, &length);
+            if (in && out && decode_trace(in, out)) {
+                fflush(out);
+                text.assign(buffer, length);
+            }
+            if (in)
+                fclose(in);
+            if (out)
+                fclose(out);
+            free(buffer);
+        } catch (std::exception& e) {
+            printf("Trace test fail: %s\n", e.what());
+        }
+        unlink(path);
+
+        count++;
+        if (text == expected)
+            successes++;
+        else
+            printf("Trace test fail (engine %i), decoded:\n%s", int(engine), text.c_str());
+    }
+
+    printf("test-trace: count %i success %i\n", count, successes);
+}
+
+static void test_profile()
+{
+    // An interrupt is taken first, its handler at 0x1020. main calls f twice,
+    // f calls g, which returns by pop and br rather than ret.
+    static constexpr uint16_t program[] = {
+        0x12b0, 0x1010,     // 1000: call #0x1010
+        0x12b0, 0x1010,     // 1004: call #0x1010
+        0x4382, MMIO_EXIT,  // 1008: mov #0, &MMIO_EXIT
+        0x4303, 0x4303,     // 100c: nop, nop
+        0x5315,             // 1010: inc r5
+        0x12b0, 0x1018,     // 1012: call #0x1018
+        0x4130,             // 1016: ret
+        0x5316,             // 1018: inc r6
+        0x4137,             // 101a: pop r7
+        0x4700,             // 101c: br r7
+        0x4303,             // 101e: nop
+        0x5318,             // 1020: inc r8
+        0x1300,             // 1022: reti
+    };
+
+    auto cycles = [](std::initializer_list<uint16_t> instructions) {
+        uint64_t total = 0;
+        for (auto instruction : instructions)
+            total += instruction_cycles(instruction);
+        return total;
+    };
+
+    int count{}, successes{};
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached }) {
+        MSP430 m{};
+        m.engine = engine;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 0x1000 + 2*i, program[i]);
+        uint16_t handler = 0x1020;
+        memcpy(&(*m.ram)[MSP430::VECTORS], &handler, 2);
+        m.registers[PC] = 0x1000;
+        m.registers[SP] = 0x2000;
+        m.registers[SR] = IF;
+        m.pending_interrupts = 1;
+
+        Profile profile;
+        m.profile = &profile;
+        auto result = m.run(100);
+
+        auto node = [&](uint32_t parent, uint16_t function) -> const Profile::Node* {
+            auto it = profile.children.find({ parent, function });
+            return it == profile.children.end() ? nullptr : &profile.nodes[it->second];
+        };
+        auto isr = node(0, 0x1020);
+        auto f = node(0, 0x1010);
+        auto g = f ? node(f - profile.nodes.data(), 0x1018) : nullptr;
+
+        count++;
+        if (result.reason == MSP430::StopReason::exit
+                && profile.counts[0x1000 >> 1] == 1 && profile.counts[0x1010 >> 1] == 2
+                && profile.counts[0x1018 >> 1] == 2 && profile.counts[0x1020 >> 1] == 1
+                && profile.counts[0x100c >> 1] == 0
+                && profile.cycles[0x1012 >> 1] == 2 * cycles({ 0x12b0 })
+                && profile.cycles[0x1022 >> 1] == cycles({ 0x1300 }))
+            successes++;
+        else
+            printf("Profile test fail (engine %i): counts\n", int(engine));
+
+        count++;
+        if (profile.nodes.size() == 4 && profile.nodes[0].function == 0x1000
+                && profile.nodes[0].cycles == cycles({ 0x12b0, 0x12b0, 0x4382 })
+                && isr && isr->calls == 1 && isr->cycles == cycles({ 0x5318, 0x1300 })
+                && f && f->calls == 2 && f->cycles == 2 * cycles({ 0x5315, 0x12b0, 0x4130 })
+                && g && g->calls == 2 && g->cycles == 2 * cycles({ 0x5316, 0x4137, 0x4700 })
+                && profile.stack.size() == 1)
+            successes++;
+        else
+            printf(
+                "Profile test fail (engine %i): call tree, %zu nodes, stack %zu\n",
+                int(engine), profile.nodes.size(), profile.stack.size()
+            );
+    }
+
+    printf("test-profile: count %i success %i\n", count, successes);
+}
+
+static void test_history()
+{
+    static constexpr uint16_t program[] = {
+        0x4034, 0x0200,     // mov #0x200, r4
+        0x4035, 0x0014,     // mov #20, r5
+        0x4584, 0x0000,     // mov r5, 0(r4)
+        0x5324,             // incd r4
+        0x8315,             // dec r5
+        0x23fb,             // jnz 0x0008
+        0x4382, MMIO_EXIT,  // mov #0, &MMIO_EXIT
+    };
+
+    struct State {
+        uint16_t registers[16];
+        uint64_t cycles;
+        MSP430::RAM ram;
+    };
+
+    auto load = [&](MSP430& m) {
+        m.timing = true;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 2*i, program[i]);
+    };
+
+    auto state = [](MSP430& m) {
+        m.sync_flags();
+        auto s = std::make_unique<State>();
+        memcpy(s->registers, m.registers, sizeof(s->registers));
+        s->cycles = m.cycles;
+        s->ram = *m.ram;
+        return s;
+    };
+
+    // Every state stepping forward, to compare against
+    MSP430 expected{};
+    load(expected);
+    std::vector<std::unique_ptr<State>> states;
+    states.push_back(state(expected));
+    while (expected.run(1).reason == MSP430::StopReason::budget)
+        states.push_back(state(expected));
+    states.push_back(state(expected));
+
+    // Checkpoints every instruction overflow and thin out, a short undo log
+    // makes most moves replay
+    MSP430 m{};
+    load(m);
+    History history(m, 1, 8);
+    m.run(1000);
+
+    int count{}, successes{};
+
+    auto check = [&](uint64_t position) {
+        auto s = state(m);
+        auto& e = *states[position];
+        count++;
+        if (history.position == position && memcmp(s->registers, e.registers, sizeof(e.registers)) == 0
+                && s->cycles == e.cycles && s->ram == e.ram)
+            successes++;
+        else
+            printf("History test fail: at %llu, expected %llu\n", (unsigned long long)history.position, (unsigned long long)position);
+    };
+
+    check(83);
+    for (uint64_t position : { 80, 40, 0, 61, 83, 10 }) {
+        history.seek(position);
+        check(position);
+    }
+
+    // The last time PC was at dec r5 before the end
+    history.seek(83);
+    history.reverse_until([](const MSP430& m) { return m.registers[PC] == 0x000e; });
+    check(80);
+
+    printf("test-history: count %i success %i\n", count, successes);
+}
+
+static void test_fuzz()
+{
+    static constexpr uint16_t program[] = {
+        0x4214, MMIO_UART,  // 1000: mov &MMIO_UART, r4
+        0x9074, 'A',        //       cmp.b #'A', r4
+        0x2002,             //       jne not_a
+        0x4382, 0x3000,     //       mov #0, &0x3000
+        0x9074, 'B',        // not_a: cmp.b #'B', r4
+        0x2007,             //       jne done
+        0x4215, MMIO_UART,  //       mov &MMIO_UART, r5
+        0x9075, 'C',        //       cmp.b #'C', r5
+        0x2002,             //       jne done
+        0x4382, 0x3002,     //       mov #0, &0x3002
+        0x4382, MMIO_EXIT,  // done: mov #0, &MMIO_EXIT
+    };
+
+    MSP430 m{};
+    for (size_t i=0; i<std::size(program); i++)
+        write_ram<Word>(m, 0x1000 + 2*i, program[i]);
+    m.registers[PC] = 0x1000;
+    auto image = std::make_shared<MSP430::Image>();
+    image->snapshot = m.snapshot();
+    image->protection[0x3000 / MSP430::PAGE_BYTES] = MSP430::page_protection;
+
+    int count{}, successes{};
+    auto check = [&](bool ok, const char* what) {
+        count++;
+        if (ok)
+            successes++;
+        else
+            printf("Fuzz test fail: %s\n", what);
+    };
+
+    // Seeds join the corpus only with new coverage, crashes are kept once
+    // per faulting instruction
+    Fuzzer fuzzer(image, {});
+    const FuzzCrash* crash;
+    check(fuzzer.add_seed("x"), "first seed");
+    check(not fuzzer.add_seed("y"), "seed with no new coverage");
+    check(fuzzer.add_seed("B"), "seed reaching the second compare");
+    check(not fuzzer.execute("A", crash) && crash && crash->pc == 0x100a, "crash at the faulting instruction");
+    check(not fuzzer.execute("A!", crash) && not crash && fuzzer.crashes.size() == 1, "repeated crash");
+
+    // Mutation finds the deeper crash from the corpus
+    Fuzzer mutating(image, { .seed = 1 });
+    mutating.add_seed("x");
+    while (mutating.executions < 200'000 && mutating.crashes.size() < 2)
+        mutating.fuzz_one();
+    auto deeper = mutating.crashes.find(0x101e);
+    check(mutating.crashes.size() == 2 && mutating.crashes.contains(0x100a)
+          && deeper != mutating.crashes.end() && deeper->second.input.starts_with("BC"), "crashes found by mutation");
+    check(std::ranges::any_of(mutating.corpus, [](auto& input) { return input.starts_with('B'); }), "corpus growth");
+
+    printf("test-fuzz: count %i success %i\n", count, successes);
+}
+
+static void test_breakpoints()
+{
+    using enum MSP430::StopReason;
+
+    static constexpr uint16_t program[] = {
+        0x4034, 0x0200, // mov #0x200, r4
+        0x5315,         // inc r5
+        0x4584, 0x0000, // mov r5, 0(r4)
+        0x3ffc,         // jmp inc
+    };
+
+    int count{}, successes{};
+    auto check = [&](bool ok, MSP430::Engine engine, const char* what) {
+        count++;
+        if (ok)
+            successes++;
+        else
+            printf("Breakpoint test fail (engine %i): %s\n", int(engine), what);
+    };
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        MSP430 m{};
+        m.engine = engine;
+        for (size_t i=0; i<std::size(program); i++)
+            write_ram<Word>(m, 2*i, program[i]);
+
+        // Warm up so cached and compiled code has to be dropped
+        m.run(1000);
+
+        m.set_breakpoint(0x0006, true);
+        auto result = m.run(1000);
+        check(result.reason == breakpoint && m.registers[PC] == 0x0006, engine, "stop at breakpoint");
+
+        result = m.run(1000);
+        check(result.reason == breakpoint && result.instructions == 3, engine, "resume from breakpoint");
+
+        result = m.run_until([](const MSP430&) { return false; }, 1000);
+        check(
+            result.reason == breakpoint && result.instructions == 3 && m.registers[PC] == 0x0006,
+            engine, "run_until stops at breakpoint"
+        );
+        result = m.run_until([](const MSP430& m) { return m.registers[PC] == 0x000a; }, 1000);
+        check(
+            result.reason == breakpoint && result.instructions == 1 && not m.until.check,
+            engine, "run_until stops at match"
+        );
+        result = m.run_until([](const MSP430&) { return false; }, 1000);
+        check(result.reason == breakpoint && result.instructions == 2, engine, "run_until stops at next breakpoint");
+
+        m.set_breakpoint(0x0006, false);
+        m.set_watchpoint(0x0200, 2, MSP430::watch_write, true);
+        result = m.run(1000);
+        check(
+            result.reason == watchpoint && result.instructions == 1 && m.registers[PC] == 0x000a
+                && m.watch_hit.address == 0x0200 && m.watch_hit.kind == MSP430::watch_write,
+            engine, "stop after watched write"
+        );
+    }
+
+    printf("test-breakpoints: count %i success %i\n", count, successes);
+}
+
+static void test_gdb()
+{
+    static constexpr uint16_t program[] = {
+        0x4315,             // 1000: mov #1, r5
+        0x5315,             // 1002: inc r5
+        0x4582, 0x2000,     // 1004: mov r5, &0x2000
+        0x3fff,             // 1008: jmp $
+    };
+
+    int count{}, successes{};
+    auto check = [&](bool ok, const char* what, const std::string& got) {
+        count++;
+        if (ok)
+            successes++;
+        else
+            printf("GDB test fail: %s, got \"%s\"\n", what, got.c_str());
+    };
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        printf("GDB test fail: socketpair\n");
+        return;
+    }
+    // A server that stops answering fails the test instead of hanging it
+    timeval timeout = { 5, 0 };
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    MSP430 m{};
+    for (size_t i=0; i<std::size(program); i++)
+        write_ram<Word>(m, 0x1000 + 2*i, program[i]);
+    m.registers[PC] = 0x1000;
+    m.registers[4] = 0x1234;
+    std::thread server([&] { serve_gdb(m, fds[1], fds[1]); });
+
+    int client = fds[0];
+    auto raw = [&](const std::string& data) {
+        return write(client, data.data(), data.size()) == ssize_t(data.size());
+    };
+    auto packet = [](const std::string& payload) {
+        uint8_t sum = 0;
+        for (char c : payload)
+            sum += c;
+        char tail[4];
+        snprintf(tail, sizeof(tail), "#%02x", sum);
+        return "$" + payload + tail;
+    };
+    auto get = [&] {
+        char c;
+        return read(client, &c, 1) == 1 ? int(uint8_t(c)) : -1;
+    };
+    // Bytes up to the end of the next packet, acks included, or up to an
+    // ack when only that is expected
+    auto receive = [&](bool ack_only = false) {
+        std::string text;
+        for (int c; (c = get()) >= 0;) {
+            text += char(c);
+            if (ack_only && (c == '+' || c == '-'))
+                break;
+            if (c == '#') {
+                for (int i=0; i<2 && (c = get()) >= 0; i++)
+                    text += char(c);
+                break;
+            }
+        }
+        return text;
+    };
+    // Sends payload, acks the reply and returns it as sent
+    auto exchange = [&](const std::string& payload) {
+        raw(packet(payload));
+        auto reply = receive();
+        raw("+");
+        return reply;
+    };
+
+    auto reply = exchange("?");
+    check(reply == "+" + packet("S05"), "initial stop", reply);
+
+    // Bad checksums are nacked and the packet resent, nacked replies resent
+    raw("$g#00");
+    reply = receive(true);
+    check(reply == "-", "nack bad checksum", reply);
+    raw(packet("p4"));
+    reply = receive();
+    check(reply == "+" + packet("34120000"), "register after nack", reply);
+    raw("-");
+    reply = receive();
+    check(reply == packet("34120000"), "resend after nack", reply);
+    raw("+");
+
+    reply = exchange("g");
+    std::string registers = "00100000" "00000000" "00000000" "00000000" "34120000";
+    registers.resize(16 * 8, '0');
+    check(reply == "+" + packet(registers), "g", reply);
+
+    reply = exchange("M2000,2:abcd");
+    check(reply == "+" + packet("OK"), "M", reply);
+    reply = exchange("m2000,2");
+    check(reply == "+" + packet("abcd"), "m", reply);
+    reply = exchange("m1000,4");
+    check(reply == "+" + packet("15431553"), "m program", reply);
+
+    reply = exchange("Z0,1002,2");
+    check(reply == "+" + packet("OK"), "Z0", reply);
+    reply = exchange("c");
+    check(reply == "+" + packet("S05"), "c to breakpoint", reply);
+    reply = exchange("p0");
+    check(reply == "+" + packet("02100000"), "PC at breakpoint", reply);
+
+    reply = exchange("z0,1002,2");
+    check(reply == "+" + packet("OK"), "z0", reply);
+    reply = exchange("Z2,2000,2");
+    check(reply == "+" + packet("OK"), "Z2", reply);
+    reply = exchange("c");
+    check(reply == "+" + packet("T05watch:2000;"), "c to watchpoint", reply);
+    reply = exchange("m2000,2");
+    check(reply == "+" + packet("0200"), "watched write", reply);
+
+    raw(packet("k"));
+    reply = receive(true);
+    check(reply == "+", "kill", reply);
+    server.join();
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("test-gdb: count %i success %i\n", count, successes);
+}
+
+static void test_isa()
+{
+    int count{}, successes{};
+    auto check = [&](bool ok, MSP430::Engine engine, const char* what) {
+        count++;
+        if (ok)
+            successes++;
+        else
+            printf("ISA test fail (engine %i): %s\n", int(engine), what);
+    };
+
+    struct DaddCase {
+        uint16_t instruction;   // dadd r4, r5 or dadd.b r4, r5
+        uint16_t source, dest;
+        bool carry_in;
+        uint16_t result;
+        uint16_t flags;         // C and Z
+    };
+
+    static constexpr DaddCase dadd_cases[] = {
+        { 0xa405, 0x1234, 0x5678, false, 0x6912, 0 },
+        { 0xa405, 0x9999, 0x0001, false, 0x0000, CF|ZF },
+        { 0xa405, 0x0999, 0x0000, true, 0x1000, 0 },
+        { 0xa445, 0x0045, 0x0055, true, 0x0001, CF },
+        { 0xa445, 0x0009, 0x0008, false, 0x0017, 0 },
+    };
+
+    // Device raising interrupt vector 2 on writes
+    struct Raiser : MSP430::Device {
+        uint16_t read(MSP430&, uint16_t) override { return 0; }
+        void write(MSP430& msp, uint16_t, uint16_t) override { msp.raise_interrupt(2); }
+    };
+
+    static constexpr uint16_t interrupt_program[] = {
+        0x4031, 0x0400, // mov #0x400, sp
+        0x4392, 0xff10, // mov #1, &0xff10, pending while GIE is clear
+        0x5315,         // inc r5
+        0xd232,         // eint
+        0x5316,         // inc r6
+        0x4382, 0xfffe, // mov #0, &MMIO_EXIT
+    };
+
+    // As above, GIE set by a single operand instruction
+    static constexpr uint16_t swpb_program[] = {
+        0x4031, 0x0400, // mov #0x400, sp
+        0x4392, 0xff10, // mov #1, &0xff10, pending while GIE is clear
+        0x5315,         // inc r5
+        0x1082,         // swpb sr, with IF in the high byte
+        0x5316,         // inc r6
+        0x4382, 0xfffe, // mov #0, &MMIO_EXIT
+    };
+
+    static constexpr uint16_t handler[] = {
+        0x5317,         // inc r7
+        0x4608,         // mov r6, r8
+        0x1300,         // reti
+    };
+
+    for (auto engine : { MSP430::Engine::reference, MSP430::Engine::cached,
+                         MSP430::Engine::threaded, MSP430::Engine::jit }) {
+        for (auto& test : dadd_cases) {
+            MSP430 m{};
+            m.engine = engine;
+            write_ram<Word>(m, 0, test.carry_in ? 0xd312 : 0xc312); // setc or clrc
+            write_ram<Word>(m, 2, test.instruction);
+            m.registers[4] = test.source;
+            m.registers[5] = test.dest;
+            m.run(2);
+            check(m.registers[5] == test.result && (m.registers[SR] & (CF|ZF)) == test.flags, engine, "dadd");
+        }
+
+        // Repeated so the jit compiles it
+        MSP430 m{};
+        m.engine = engine;
+        write_ram<Word>(m, 0, 0x4025); // mov @pc, r5
+        write_ram<Word>(m, 2, 0x4066); // mov.b @pc, r6
+        write_ram<Word>(m, 4, 0x5315); // inc r5
+        bool ok = true;
+        for (int i=0; i<64; i++) {
+            m.registers[PC] = 0;
+            m.run(3);
+            ok &= m.registers[5] == 0x4067 && m.registers[6] == 0x0015;
+        }
+        check(ok, engine, "@pc source");
+
+        MSP430 n{};
+        n.engine = engine;
+        n.attach_device(0xff10, 2, std::make_shared<Raiser>());
+        for (size_t i=0; i<std::size(interrupt_program); i++)
+            write_ram<Word>(n, 2*i, interrupt_program[i]);
+        for (size_t i=0; i<std::size(handler); i++)
+            write_ram<Word>(n, 0x20 + 2*i, handler[i]);
+        *reinterpret_cast<uint16_t*>(&(*n.ram)[MSP430::VECTORS + 4]) = 0x0020;
+
+        auto result = n.run(100);
+        check(
+            result.reason == MSP430::StopReason::exit && result.instructions == 9
+                && n.registers[5] == 1 && n.registers[6] == 1 && n.registers[7] == 1
+                && n.registers[8] == 0 && n.registers[SP] == 0x0400 && (n.registers[SR] & IF)
+                && n.pending_interrupts == 0,
+            engine, "interrupt"
+        );
+
+        for (size_t i=0; i<std::size(swpb_program); i++)
+            write_ram<Word>(n, 2*i, swpb_program[i]);
+        n.invalidate_decode_cache();
+        n.registers[PC] = 0;
+        n.registers[SR] = IF << 8;
+        n.registers[5] = n.registers[6] = n.registers[7] = 0;
+        result = n.run(100);
+        check(
+            result.reason == MSP430::StopReason::exit && n.registers[6] == 1 && n.registers[7] == 1
+                && n.registers[8] == 0 && n.pending_interrupts == 0,
+            engine, "interrupt after swpb sr"
+        );
+    }
+
+    printf("test-isa: count %i success %i\n", count, successes);
+}
+
+static void test_msp430x()
+{
+    int count{}, successes{};
+
+    static constexpr uint16_t program[] = {
+        0x0181, 0x0400, // mova #0x10400, sp
+        0x13b0, 0x0100, // calla #0x00100
+        0x4382, 0xfffe, // mov #0, &MMIO_EXIT
+    };
+
+    static constexpr uint16_t function[] = {
+        0x1415,         // pushm.a #2, r5
+        0x0284, 0x3456, // mova #0x23456, r4
+        0x0085, 0x0001, // mova #1, r5
+        0x04e5,         // adda r4, r5
+        0x0562, 0x0000, // mova r5, &0x20000
+        0x05c9,         // mova r5, r9
+        0x1614,         // popm.a #2, r4
+        0x1943, 0x1006, // rpt #4 rrux r6
+        0x1900, 0x425a, 0x0000, // movx.a &0x20000, r10
+        0x0110,         // reta
+    };
+
+    MSP430X m{};
+    auto put = [&](uint32_t address, auto& words) {
+        for (auto word : words) {
+            m.poke(address++, word);
+            m.poke(address++, word >> 8);
+        }
+    };
+    put(0, program);
+    put(0x100, function);
+    m.registers[4] = 0x1234;
+    m.registers[5] = 0x5678;
+    m.registers[6] = 0x8000;
+
+    auto result = m.run(100);
+    count++;
+    if (result.reason == MSP430::StopReason::exit && result.instructions == 13)
+        successes++;
+    else
+        printf("MSP430X test fail: %s after %zu, %s\n", MSP430::stop_reason_name(result.reason), result.instructions, result.message.c_str());
+
+    auto& r = m.registers;
+    count++;
+    if (r[4] == 0x1234 && r[5] == 0x5678 && r[6] == 0x0800 && r[9] == 0x23457 && r[10] == 0x23457 && r[SP] == 0x10400)
+        successes++;
+    else
+        printf("MSP430X test fail: registers\n");
+
+    // Program, stack and data pages only
+    count++;
+    if (m.peek(0x20002) == 0x02 && m.owned_pages() == 3)
+        successes++;
+    else
+        printf("MSP430X test fail: %zu pages owned\n", m.owned_pages());
+
+    printf("test-msp430x: count %i success %i\n", count, successes);
+}
+
+// Jobs taking different paths by their input, in lockstep and alone
+static void test_lockstep()
+{
+    int count{}, successes{};
+
+    static constexpr uint16_t program[] = {
+        0x4214, MMIO_UART,      // 1000: mov &MMIO_UART, r4
+        0x9374,                 //       cmp.b #-1, r4
+        0x240e,                 //       jeq done
+        0x4405,                 //       mov r4, r5
+        0xf035, 0x0007,         //       and #7, r5
+        0x4306,                 //       mov #0, r6
+        0x5406,                 // loop: add r4, r6
+        0x46c5, 0x2000,         //       mov.b r6, 0x2000(r5)
+        0x12b0, 0x1028,         //       call #sub
+        0x8315,                 //       dec r5
+        0x37f9,                 //       jge loop
+        0x4682, MMIO_UART,      //       mov r6, &MMIO_UART
+        0x3fee,                 //       jmp 1000
+        0x4382, MMIO_EXIT,      // done: mov #0, &MMIO_EXIT
+        0x1206,                 // sub:  push r6
+        0x4136,                 //       pop r6
+        0xe506,                 //       xor r5, r6
+        0x1006,                 //       rrc r6
+        0x4130,                 //       ret
+    };
+
+    MSP430 m{};
+    for (size_t i=0; i<std::size(program); i++)
+        write_ram<Word>(m, 0x1000 + 2*i, program[i]);
+    m.registers[PC] = 0x1000;
+    m.registers[SP] = 0x8000;
+    auto image = std::make_shared<MSP430::Image>();
+    image->snapshot = m.snapshot();
+
+    // More than one group, the longest inputs run out of budget
+    std::vector<FleetJob> alone(20);
+    for (size_t i=0; i<alone.size(); i++) {
+        for (size_t j=0; j<i; j++)
+            alone[i].input += char('a' + (i * 7 + j * 3) % 26);
+    }
+    auto lockstep = alone;
+
+    FleetOptions options{};
+    options.threads = 1;
+    options.max_instructions = 800;
+    options.engine = MSP430::Engine::reference;
+    run_fleet(image, alone, options);
+    options.lockstep = true;
+    run_fleet(image, lockstep, options);
+
+    // Both apply the protection of the image
+    auto protected_image = std::make_shared<MSP430::Image>(*image);
+    protected_image->protection[0x1000 / MSP430::PAGE_BYTES] = MSP430::page_no_exec;
+    std::vector<FleetJob> denied(2);
+    options.lockstep = false;
+    run_fleet(protected_image, std::span(denied).first(1), options);
+    options.lockstep = true;
+    run_fleet(protected_image, std::span(denied).last(1), options);
+    for (auto& job : denied) {
+        count++;
+        if (job.result.reason == MSP430::StopReason::fault && job.result.instructions == 0)
+            successes++;
+        else
+            printf("Lockstep test fail: %s running protected image\n", MSP430::stop_reason_name(job.result.reason));
+    }
+
+    // Lanes reaching loops run() skips finish alone, skipping them too, so a
+    // budget far beyond stepping every lane still ends
+    static constexpr uint16_t idle_program[] = {
+        0x4215, MMIO_UART,      // 1000: mov &MMIO_UART, r5
+        0x8315,                 //       dec r5
+        0x23fe,                 //       jnz 1004
+        0x3fff,                 //       jmp $
+    };
+    MSP430 n{};
+    for (size_t i=0; i<std::size(idle_program); i++)
+        write_ram<Word>(n, 0x1000 + 2*i, idle_program[i]);
+    n.registers[PC] = 0x1000;
+    auto idle_image = std::make_shared<MSP430::Image>();
+    idle_image->snapshot = n.snapshot();
+
+    for (size_t budget : { size_t(2'000'000'000), SIZE_MAX }) {
+        std::vector<FleetJob> idle_alone(3);
+        for (size_t i=0; i<idle_alone.size(); i++)
+            idle_alone[i].input = std::string(1, char('a' + 10 * i));
+        auto idle_lockstep = idle_alone;
+
+        options.max_instructions = budget;
+        options.lockstep = false;
+        run_fleet(idle_image, idle_alone, options);
+        options.lockstep = true;
+        run_fleet(idle_image, idle_lockstep, options);
+
+        for (size_t i=0; i<idle_alone.size(); i++) {
+            auto& a = idle_alone[i].result;
+            auto& b = idle_lockstep[i].result;
+            count++;
+            if (a.reason == MSP430::StopReason::budget && b.reason == a.reason && b.instructions == budget)
+                successes++;
+            else
+                printf(
+                    "Lockstep test fail (idle job %zu): %s after %zu, lockstep %s after %zu\n",
+                    i, MSP430::stop_reason_name(a.reason), a.instructions,
+                    MSP430::stop_reason_name(b.reason), b.instructions
+                );
+        }
+    }
+
+    // One thread reuses its instances, or lanes, from job to job, which
+    // must give the results of a fresh instance for each
+    for (size_t i=0; i<alone.size(); i++) {
+        FleetJob fresh = { alone[i].input };
+        MSP430 f{};
+        f.engine = MSP430::Engine::reference;
+        f.load(image);
+        connect_job(f, fresh);
+        fresh.result = f.run(800);
+        count++;
+        if (fresh.result.reason == alone[i].result.reason && fresh.result.instructions == alone[i].result.instructions
+                && fresh.output == alone[i].output)
+            successes++;
+        else
+            printf("Lockstep test fail (job %zu): reused instance differs from a fresh one\n", i);
+    }
+
+    // Reused decode caches and compiled code drop only what jobs wrote over
+    for (auto engine : { MSP430::Engine::cached, MSP430::Engine::jit }) {
+        auto reused = alone;
+        auto engine_options = options;
+        engine_options.lockstep = false;
+        engine_options.max_instructions = 800;
+        engine_options.engine = engine;
+        run_fleet(image, reused, engine_options);
+        for (size_t i=0; i<alone.size(); i++) {
+            count++;
+            if (reused[i].result.reason == alone[i].result.reason
+                    && reused[i].result.instructions == alone[i].result.instructions
+                    && reused[i].output == alone[i].output)
+                successes++;
+            else
+                printf("Lockstep test fail (job %zu, engine %i): reused instance differs\n", i, int(engine));
+        }
+    }
+
+    for (size_t i=0; i<alone.size(); i++) {
+        auto& a = alone[i].result;
+        auto& b = lockstep[i].result;
+        count++;
+        if (a.reason == b.reason && a.instructions == b.instructions && alone[i].output == lockstep[i].output)
+            successes++;
+        else
+            printf(
+                "Lockstep test fail (job %zu): %s after %zu, lockstep %s after %zu\n",
+                i, MSP430::stop_reason_name(a.reason), a.instructions,
+                MSP430::stop_reason_name(b.reason), b.instructions
+            );
+    }
+
+    printf("test-lockstep: count %i success %i\n", count, successes);
+}
+
+// Every dual operand, single operand and jump encoding, from random state,
+// on every engine and on MSP430X as an independent model of the ISA. Each
+// case runs the instruction then an exit write, and compares stop reasons,
+// registers and the memory pages any engine wrote.
+static void test_conformance()
+{
+    int count{}, successes{};
+    std::mt19937 rng(430);
+
+    static constexpr MSP430::Engine engines[] = {
+        MSP430::Engine::reference, MSP430::Engine::cached,
+        MSP430::Engine::threaded, MSP430::Engine::jit,
+    };
+
+    // Words mostly even so they work as addresses, and never the encodings
+    // only MSP430X executes, which jumps may land on
+    auto random_word = [&] {
+        uint16_t word = rng();
+        if (word < 0x1000 || (word >= 0x1340 && word < 0x2000))
+            word |= 0x4000;
+        return uint16_t(rng() % 4 ? word & ~1 : word);
+    };
+
+    MSP430 base{};
+    for (size_t i=0; i<MSP430::RAM_SIZE; i+=2) {
+        uint16_t word = random_word();
+        memcpy(&(*base.ram)[i], &word, 2);
+    }
+    auto snapshot = base.snapshot();
+
+    // Repeated every 64 KB for MSP430X, as its addresses wrap at 1 MB
+    auto image = std::make_shared<MSP430X::Image>();
+    for (size_t page=0; page<MSP430::RAM_SIZE / MSP430X::PAGE_BYTES; page++) {
+        auto copy = std::make_shared<MSP430X::Page>();
+        memcpy(copy->data(), base.ram->data() + page * MSP430X::PAGE_BYTES, MSP430X::PAGE_BYTES);
+        for (size_t bank=page; bank<MSP430X::PAGES; bank+=MSP430::RAM_SIZE / MSP430X::PAGE_BYTES)
+            image->pages[bank] = copy;
+    }
+
+    MSP430 machines[std::size(engines)];
+    for (size_t i=0; i<std::size(engines); i++) {
+        machines[i].engine = engines[i];
+        machines[i].detach_device(MSP430::MMIO_TIMER, 4);
+    }
+    MSP430X model{};
+
+    std::vector<uint16_t> instructions;
+    for (unsigned word=0x1000; word<0x1340; word++)
+        instructions.push_back(word);
+    for (unsigned condition=0; condition<8; condition++) {
+        for (int offset : { -2, 0, 1, 2, 0x1ff })
+            instructions.push_back(0x2000 | condition << 10 | (offset & 0x3ff));
+    }
+    for (unsigned word=0x4000; word<0x10000; word++)
+        instructions.push_back(word);
+
+    for (auto instruction : instructions) {
+        // Away from the ends of memory, where MSP430X addresses go past 64 KB
+        uint16_t pc = 0x1000 + 2 * (rng() % 0x7000);
+        uint16_t registers[16];
+        for (auto& reg : registers) {
+            reg = 0x0010 + rng() % 0xfef0;
+            if (rng() % 4)
+                reg &= ~1;
+        }
+        registers[PC] = pc;
+        registers[SR] &= ALU;
+        registers[CG] = 0;
+
+        // Index words and immediates, then the exit write
+        auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+        bool dual = instruction >= 0x4000, jump = instruction >> 13 == 1;
+        unsigned reg = dual ? op.source : op.dest, as = op.as;
+        unsigned words = not jump && ((as == 1 && reg != CG) || (as == 3 && reg == PC));
+        words += dual && op.ad;
+
+        uint16_t code[5] = { instruction, random_word(), random_word() };
+        code[1 + words] = 0x4382;
+        code[2 + words] = 0xfffe;
+        words += 3;
+
+        MSP430::RunResult results[std::size(engines)];
+        std::array<bool, MSP430::PAGES> written = {};
+        for (size_t i=0; i<std::size(engines); i++) {
+            auto& m = machines[i];
+            m.restore(snapshot);
+            for (size_t j=0; j<words; j++)
+                write_ram<Word>(m, pc + 2*j, code[j]);
+            // Saved PC high bits are reserved on a 16-bit CPU
+            if (instruction == 0x1300 && !(registers[SP] & 1))
+                write_ram<Word>(m, registers[SP], read_ram<Word>(m, registers[SP]) & 0x0fff);
+            memcpy(m.registers, registers, sizeof(registers));
+            results[i] = m.run(3);
+            for (size_t page=0; page<MSP430::PAGES; page++)
+                written[page] |= m.dirty[page];
+        }
+
+        model.load(image);
+        for (size_t j=0; j<words; j++) {
+            model.poke(pc + 2*j, code[j]);
+            model.poke(pc + 2*j + 1, code[j] >> 8);
+        }
+        if (instruction == 0x1300 && !(registers[SP] & 1))
+            model.poke(registers[SP] + 1, model.peek(registers[SP] + 1) & 0x0f);
+        std::copy(std::begin(registers), std::end(registers), model.registers);
+
+        // One instruction at a time, until it leaves the low 64 KB where a
+        // 16-bit CPU wraps around
+        MSP430::RunResult expected{};
+        bool wrapped = false;
+        for (int step=0; step<3 && expected.reason == MSP430::StopReason::budget; step++) {
+            auto result = model.run(1);
+            expected.reason = result.reason;
+            expected.message = result.message;
+            expected.instructions += result.instructions;
+            wrapped |= model.registers[PC] > 0xffff;
+        }
+        if (wrapped)
+            continue;
+
+        auto& reference = machines[0];
+
+        // R3 is not compared, it only reads as a constant. MSP430X registers
+        // wrap at 1 MB, so only their low 16 bits are.
+        auto equal_registers = [&](const MSP430& m) {
+            for (unsigned reg=0; reg<16; reg++) {
+                if (reg != CG && m.registers[reg] != uint16_t(model.registers[reg]))
+                    return false;
+            }
+            return true;
+        };
+        auto fail = [&](const char* engine, const char* what) {
+            if (count - successes < 8)
+                printf("Conformance test fail (%s): %04x %04x %04x %s\n", engine, code[0], code[1], code[2], what);
+        };
+        bool ok = true;
+
+        // The model's state after a fault is unspecified. Faults are precise
+        // in MSP430, so its engines agree, and faulting first changes nothing.
+        bool faulted = expected.reason != MSP430::StopReason::budget && expected.reason != MSP430::StopReason::exit;
+        auto same_registers = [](const MSP430& m, const uint16_t* registers) {
+            for (unsigned reg=0; reg<16; reg++) {
+                if (reg != CG && m.registers[reg] != registers[reg])
+                    return false;
+            }
+            return true;
+        };
+
+        for (size_t i=0; i<std::size(engines); i++) {
+            auto& m = machines[i];
+            const char* name = i == 0 ? "reference" : i == 1 ? "cached" : i == 2 ? "threaded" : "jit";
+            if (results[i].reason != expected.reason || results[i].instructions != expected.instructions)
+                fail(name, "stop reason"), ok = false;
+            else if (faulted) {
+                if (results[i].pc != m.registers[PC] || not same_registers(m, reference.registers)
+                        || (expected.instructions == 0 && not same_registers(m, registers)))
+                    fail(name, "fault state"), ok = false;
+            } else if (not equal_registers(m))
+                fail(name, "registers"), ok = false;
+            else {
+                for (size_t page=0; page<MSP430::PAGES && ok; page++) {
+                    auto offset = page * MSP430::PAGE_BYTES;
+                    if (written[page] && memcmp(m.ram->data() + offset, reference.ram->data() + offset, MSP430::PAGE_BYTES) != 0)
+                        fail(name, "memory"), ok = false;
+                }
+            }
+        }
+
+        for (size_t page=0; page<MSP430::PAGES && ok && not faulted; page++) {
+            for (size_t i=0; i<MSP430::PAGE_BYTES && written[page]; i++) {
+                auto address = page * MSP430::PAGE_BYTES + i;
+                if ((*reference.ram)[address] != model.peek(address)) {
+                    fail("msp430x", "memory");
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        count++;
+        successes += ok;
+    }
+
+    printf("test-conformance: count %i success %i\n", count, successes);
+}
+
 int main()
 {
     test_alu2_word();
+    test_self_modifying();
+    test_run_stop();
+    test_devices();
+    test_misaligned();
+    test_protection();
+    test_snapshot();
+    test_ram_pool();
+    test_cycles();
+    test_timing();
+    test_tight_loops();
+    test_uart_io();
+    test_load_bin();
+    test_load_protection();
+    test_trace();
+    test_profile();
+    test_history();
+    test_fuzz();
+    test_breakpoints();
+    test_gdb();
+    test_isa();
+    test_msp430x();
+    test_lockstep();
+    test_conformance();
 }
 
 #endif
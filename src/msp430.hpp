@@ -1,8 +1,16 @@
 #pragma once
 #include <stdint.h>
 #include <array>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <span>
+#include <string>
+#include <vector>
+
+struct History;
+struct Profile;
+struct Tracer;
 
 struct MSP430 {
     static constexpr size_t RAM_SIZE = 0x10000;
@@ -54,12 +62,377 @@ struct MSP430 {
         ALU = CF|ZF|NF|VF,
     };
 
+    enum class Engine : uint8_t {
+        reference,  // decode every instruction from memory
+        cached,     // execute from predecoded instruction cache
+        threaded,   // handler table indexed by instruction word
+        jit,        // compile hot blocks to host code (x86-64 only)
+    };
+
+    // Predecoded instructions keyed by PC, allocated on first use
+    struct DecodeCache;
+    struct DecodeCacheDeleter { void operator()(DecodeCache*) const; };
+
+    enum class StopReason : uint8_t {
+        budget,     // Executed max_instructions or reached cycle_limit
+        exit,       // Program wrote the exit MMIO register, or a device set stop_exit
+        illegal,    // Invalid or unsupported instruction
+        misaligned, // Misaligned word access
+        breakpoint, // Reached a breakpoint, or run_until predicate matched
+        watchpoint, // Accessed a watched byte, see watch_hit
+        fault,      // Any other error, such as unknown MMIO devices
+    };
+
+    struct RunResult {
+        StopReason reason;
+        size_t instructions;
+        std::string message; // Set for illegal, misaligned and fault
+        uint16_t pc = 0;     // Start of the instruction that faulted, for the same
+    };
+
+    // MMIO device bus
+    //
+    // Every byte of the MMIO window has a slot pointing at the device mapped
+    // there, devices see word accesses at even addresses. Byte accesses to the
+    // window fault.
+
+    static constexpr uint16_t MMIO_BASE = 0xff00;
+    static constexpr uint16_t MMIO_UART_STATUS = 0xffa0; // uart_status, read only
+    static constexpr uint16_t MMIO_UART = 0xffa2;   // uart_read/uart_print
+    static constexpr uint16_t MMIO_TIMER = 0xffa4;  // Microseconds, low word then high
+    static constexpr uint16_t MMIO_EXIT = 0xfffe;   // Any write ends run()
+
+    struct Device {
+        virtual ~Device() = default;
+        virtual uint16_t read(MSP430& msp, uint16_t address) = 0;
+        virtual void write(MSP430& msp, uint16_t address, uint16_t value) = 0;
+
+        // Whether reads at address give the same value, with no effects,
+        // until the guest writes somewhere. Loops polling it are skipped.
+        virtual bool steady(const MSP430&, uint16_t) const { return false; }
+    };
+
+    enum class UnmappedPolicy : uint8_t {
+        fault,  // Stop with a fault
+        ignore, // Reads give zero, writes are dropped
+    };
+
+    enum class MisalignedPolicy : uint8_t {
+        trap,   // Stop with misaligned
+        align,  // Ignore the low address bit, as the hardware does
+    };
+
+    // Operands and result of the last ALU instruction. Its flags are written
+    // to SR only when something reads them.
+    struct PendingFlags {
+        uint32_t result;
+        uint8_t kind;
+        bool sign1, sign2;
+    };
+
+    struct Symbol {
+        uint16_t address;
+        std::string name;
+    };
+
+    // Snapshots
+    //
+    // Writes to ram mark 256 byte pages dirty. Restoring the snapshot last
+    // taken or restored copies back only the dirty pages. Restoring any other
+    // snapshot maps its memory copy-on-write, so instances forked from one
+    // snapshot share every page they have not written. Devices and hooks are
+    // not part of a snapshot.
+
+    static constexpr size_t PAGE_BYTES = 256;
+    static constexpr size_t PAGES = RAM_SIZE / PAGE_BYTES;
+
+    struct SnapshotMemory;
+
+    struct Snapshot {
+        uint16_t registers[16];
+        uint64_t cycles;
+        std::shared_ptr<const SnapshotMemory> memory; // Read-only, thread safe
+    };
+
+    // A loaded program, immutable and shared by every instance running it
+    struct Image {
+        Snapshot snapshot;              // PC at the entry point
+        std::vector<Symbol> symbols;    // Functions, by address
+        std::array<uint8_t, PAGES> protection = {}; // Denied access by page, see PageAttribute
+    };
+
+    // Ram is mapped rather than allocated so snapshots can share it. Ram
+    // taken from a pool goes back to it.
+    struct RamPool;
+    struct RamDeleter {
+        RamPool* pool; // Null for mapped ram
+        void operator()(RAM*) const;
+    };
+    static std::unique_ptr<RAM, RamDeleter> allocate_ram();
+
+    // Compiled blocks for the jit engine, allocated on first use or taken
+    // over from an instance the thread destroyed
+    struct Jit;
+    struct JitDeleter { void operator()(Jit*) const; };
+
     uint16_t registers[16] = {};
-    std::unique_ptr<RAM> ram = std::make_unique<RAM>();
+    std::unique_ptr<RAM, RamDeleter> ram = allocate_ram();
+    std::unique_ptr<DecodeCache, DecodeCacheDeleter> decode_cache;
+    std::unique_ptr<Jit, JitDeleter> jit;
+    PendingFlags pending_flags = {};
+
+    // Why the engine loop should end. Devices set stop_exit to end run().
+    enum StopRequest : uint8_t {
+        stop_exit = 1,
+        stop_watch = 2,
+        stop_interrupt = 4, // Taken by run(), which then carries on
+        stop_idle = 8,      // At a loop run() skips ahead through
+        stop_until = 16,    // The run_until predicate matched
+    };
+    uint8_t stop_requested = 0;
+
+    // Start of the instruction a fault is unwinding from, noted by the
+    // engines on the way out so run() can undo what it did
+    std::optional<uint16_t> faulting_pc;
+
+    // Predicate of the run_until call in progress, checked by the
+    // interpreter before every instruction while set
+    struct Until {
+        void* predicate;
+        bool (*check)(void* predicate, MSP430& msp);
+    };
+    Until until = {};
 
-    void load_file(const char* path); // Throws on failure
+    // Interrupts
+    //
+    // Bit n of pending_interrupts requests the vector at VECTORS + 2n, higher
+    // vectors first. run() takes one before executing, and after a device
+    // raises one, while GIE (IF) is set: PC and SR are pushed, SR cleared and
+    // the request dropped. The reset vector, 15, is never taken.
+    static constexpr uint16_t VECTORS = 0xffe0; // Read from ram, under MMIO
+    static constexpr unsigned INTERRUPT_CYCLES = 6;
+    uint16_t pending_interrupts = 0;
+
+    // For devices, also ends the current batch so the interrupt is taken
+    // after the accessing instruction
+    void raise_interrupt(unsigned vector) {
+        pending_interrupts |= 1u << vector;
+        stop_requested |= stop_interrupt;
+    }
+
+    // Counters for each (PC, next PC) pair executed, hashed into
+    // COVERAGE_SIZE entries. While set run() interprets with the reference or,
+    // for any other engine, the cached engine.
+    static constexpr size_t COVERAGE_SIZE = 0x10000;
+    uint8_t* coverage = nullptr;
+
+    // Instruction counts, cycles and call stacks, recorded while set. Like
+    // coverage this interprets.
+    Profile* profile = nullptr;
+
+    // Binary trace of instructions, register changes and memory accesses,
+    // recorded while set. Like coverage this interprets.
+    Tracer* trace = nullptr;
+
+    // Undo log and checkpoints for stepping backwards, kept while set. Like
+    // coverage this interprets.
+    History* history = nullptr;
+
+    // Breakpoints and watchpoints
+    //
+    // run() stops before executing an instruction at a breakpoint, other than
+    // at the one it starts at so it can resume from there. The decode cache
+    // and compiled blocks end at breakpoints, so only the reference engine
+    // checks them per instruction, and the threaded engine runs cached while
+    // any are set.
+    //
+    // run() stops after an instruction reads or writes a watched byte, with
+    // the first access in watch_hit. The jit engine runs cached while any are
+    // set.
+
+    enum Watch : uint8_t {
+        watch_read = 1,
+        watch_write = 2,
+        watch_access = watch_read|watch_write,
+    };
+
+    struct WatchHit {
+        uint16_t address;
+        uint8_t kind; // Watch of the access, 0 if none
+    };
+
+    std::vector<uint64_t> breakpoints;      // Bitmap by word address, empty until one is set
+    size_t breakpoint_count = 0;
+    bool skip_breakpoint = false;           // At the breakpoint run() started at
+    std::unique_ptr<uint8_t[]> watchpoints; // Watch flags by address, null until one is set
+    size_t watchpoint_count = 0;            // Watched bytes
+    WatchHit watch_hit = {};
+
+    // Breakpoints are per word, the low address bit is ignored
+    void set_breakpoint(uint16_t address, bool enabled);
+    bool has_breakpoint(uint16_t address) const {
+        return breakpoint_count && (breakpoints[address >> 7] >> (address >> 1 & 63) & 1);
+    }
+
+    // Adds or removes kind for length bytes from address
+    void set_watchpoint(uint16_t address, uint16_t length, Watch kind, bool enabled);
+
+    // Replaces the protection of the pages holding length bytes from address
+    // with denied, a combination of page_no_read, page_no_write and
+    // page_no_exec. The MMIO page only takes page_no_exec. load() sets every
+    // page from the image.
+    void protect(uint16_t address, uint32_t length, uint8_t denied);
+
+    // Virtual clock. While timing is set run() interprets, adding the cycles
+    // of each instruction, and stops once cycles reaches cycle_limit.
+    bool timing = false;
+    uint64_t cycles = 0;
+    uint64_t cycle_limit = UINT64_MAX;
+    uint32_t clock_hz = 1'000'000; // MCLK
+
+    std::shared_ptr<const Image> image; // Last loaded
+
+    std::array<bool, PAGES> dirty = {};                 // Written since baseline
+    std::shared_ptr<const SnapshotMemory> baseline;     // Last snapshot taken or restored
+
+    // UART IO for this instance, accesses fault while unset
+    std::function<void(char)> uart_print;
+    std::function<char()> uart_read;
+
+    // Bits read from MMIO_UART_STATUS, set when the matching access would not
+    // wait. While unset every connected direction is ready.
+    enum UartStatus : uint16_t {
+        UART_RX_READY = 1,
+        UART_TX_READY = 2,
+    };
+    std::function<uint16_t()> uart_status;
+
+    std::array<Device*, RAM_SIZE - MMIO_BASE> mmio = {};
+    std::vector<std::shared_ptr<Device>> devices; // Owners of mapped devices other than the built-in ones
+    UnmappedPolicy unmapped_policy = UnmappedPolicy::fault;
+
+    // For word accesses and instruction fetches at odd addresses
+    MisalignedPolicy misaligned_policy = MisalignedPolicy::trap;
+
+    // Page attributes
+    //
+    // Data accesses to a page with no attribute trapping them are a plain
+    // load or store. The rest take the slow path, which handles devices,
+    // watchpoints, recording, dropping cached code and protection faults.
+    // Kept up to date by the core, set_watchpoint, protect and run().
+    //
+    // Protection denies access to whole pages. Faults are raised before the
+    // access, so the faulting write never reaches memory. A fetch is checked
+    // for each instruction word, and an instruction in a page it may not
+    // execute from faults before any of it runs.
+
+    enum PageAttribute : uint8_t {
+        page_mmio = 1,      // The MMIO window
+        page_watched = 2,   // Holds a watched byte
+        page_hooked = 4,    // Trace or history is recording
+        page_code = 8,      // May hold cached or compiled code
+        page_no_read = 16,
+        page_no_write = 32,
+        page_no_exec = 64,
+
+        page_protection = page_no_read|page_no_write|page_no_exec,
+        page_read_trap = page_mmio|page_watched|page_hooked|page_no_read,
+        page_write_trap = page_mmio|page_watched|page_hooked|page_code|page_no_write,
+        page_fetch_trap = page_mmio|page_no_exec,
+    };
+
+    std::array<uint8_t, PAGES> page_attributes = [] {
+        std::array<uint8_t, PAGES> attributes = {};
+        attributes[MMIO_BASE / PAGE_BYTES] = page_mmio;
+        return attributes;
+    }();
+
+    // State of the built-in timer, kept here so the built-in devices hold
+    // none and one set of them is shared by every instance
+    struct TimerState {
+        uint64_t start = 0; // Host microseconds when the instance was made
+        uint64_t epoch = 0; // Timer microseconds at the last write
+        uint16_t high = 0;  // Latched by reading the low word
+    };
+    TimerState timer;
+
+    // Starts the timer again, as for a new instance
+    void restart_timer();
+
+    // Maps the UART, timer and exit devices
+    MSP430();
+
+    // As above, with zeroed ram from pool, which must outlive the instance,
+    // taken first from partition, see RamPool::take. Restoring a snapshot
+    // copies it in rather than mapping it.
+    explicit MSP430(RamPool& pool, unsigned partition = 0);
+
+    // Maps size bytes from address to device, replacing what was there.
+    // Devices may be shared between instances, but are then called from
+    // every thread running them.
+    void attach_device(uint16_t address, uint16_t size, std::shared_ptr<Device> device);
+    void detach_device(uint16_t address, uint16_t size);
+
+    Engine engine = Engine::cached;
+
+    // Maps an ELF file, or a raw binary loaded at 0 if path ends in .bin.
+    // ELF files load their PT_LOAD segments, or SHF_ALLOC sections if there
+    // are none. Throws on failure.
+    static std::shared_ptr<const Image> load_image(const char* path);
+
+    // Resets to image, sharing its memory until written
+    void load(std::shared_ptr<const Image> image);
+
+    void load_file(const char* path) { load(load_image(path)); } // Throws on failure
+
+    // Symbol at or before address, nullptr if there is none
+    const Symbol* find_symbol(uint16_t address) const;
+
+    // Executes up to max_instructions. Faults are precise: the instruction
+    // that faults is not counted, and its register changes are undone with PC
+    // left at its start. Device reads it made are not.
+    RunResult run(size_t max_instructions);
+
+    // Executes until stop returns true, checked before every instruction by
+    // the interpreter loop, which it runs in rather than compiled code. Stops
+    // at breakpoints as run() does, reporting matches as breakpoints too.
+    template <typename Predicate>
+    RunResult run_until(Predicate&& stop, size_t max_instructions = SIZE_MAX) {
+        auto call = [&stop](MSP430& msp) -> bool { return stop(msp); };
+        using Call = decltype(call);
+        until = { &call, [](void* call, MSP430& msp) { return (*static_cast<Call*>(call))(msp); } };
+        auto result = run(max_instructions);
+        until = {};
+        return result;
+    }
+
+    // Executes until max_cycles more have passed on the virtual clock, the
+    // last instruction may end past it. Timing is on for the call.
+    RunResult run_cycles(uint64_t max_cycles, size_t max_instructions = SIZE_MAX);
+
+    uint64_t virtual_microseconds() const {
+        return cycles / clock_hz * 1'000'000 + cycles % clock_hz * 1'000'000 / clock_hz;
+    }
+
+    // Executes one instruction, throws if it stops for any other reason
     void step_instruction();
 
+    static const char* stop_reason_name(StopReason);
+
+    // Engine from its name in the Engine enum, false if unknown
+    static bool parse_engine(const char* name, Engine& engine);
+
+    // Writes pending flags to registers[SR]. run() does this before returning
+    // so registers[SR] can be used between runs.
+    void sync_flags();
+
+    // Must be called after modifying ram other than by executing code, also
+    // marks every page dirty
+    void invalidate_decode_cache();
+
+    Snapshot snapshot(); // Throws if memory for it can not be mapped
+    void restore(const Snapshot& snapshot);
+
     static constexpr size_t PRINT_LENGTH = 157;
 
     void print(std::span<char, PRINT_LENGTH> out) const;
@@ -69,12 +442,7 @@ struct MSP430 {
         return arr;
     }
 
-    // IO for uart - user implementation required
-    static void uart_print(char);
-    static char uart_read();
-
-private:
-    InstructionClass classify(uint16_t instruction) const {
+    static constexpr InstructionClass classify(uint16_t instruction) {
         switch((instruction >> 12) & 0xf) {
             case 0:         return invalid;
             case 1:         return single_operand;
@@ -84,3 +452,30 @@ private:
         __builtin_unreachable();
     }
 };
+
+// Ram for many instances, carved from one arena backed by transparent huge
+// pages. Creating and destroying pooled instances maps nothing, and their
+// memory needs few TLB entries. Each thread takes slots from its own
+// partition, borrowing from the others once it runs out. Slots are first
+// written by the thread taking them, which places them on its NUMA node.
+// Thread safe.
+struct MSP430::RamPool {
+    // partitions 0 for one per core. Throws if the arena can not be mapped.
+    explicit RamPool(size_t instances, unsigned partitions = 0);
+    ~RamPool();
+    RamPool(const RamPool&) = delete;
+    RamPool& operator=(const RamPool&) = delete;
+
+    // Takes a slot from partition, modulo the partition count, or the next
+    // one with a slot left. Threads pass their own index, so each fills its
+    // own partition. Throws std::bad_alloc once every slot is taken.
+    RAM* take(unsigned partition);
+    void give(RAM* ram);
+
+    struct Partition;
+    uint8_t* arena = nullptr;
+    size_t arena_bytes = 0;
+    size_t partition_slots = 0;
+    std::unique_ptr<Partition[]> partitions;
+    unsigned partition_count = 0;
+};
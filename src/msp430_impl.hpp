@@ -0,0 +1,870 @@
+#pragma once
+// Definitions shared by the execution engines, not part of the public API
+
+#include "msp430.hpp"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string.h>
+#include <stdexcept>
+
+using Error = std::runtime_error;
+
+// Errors run() reports with their own stop reason
+struct IllegalInstruction : Error { using Error::Error; };
+struct MisalignedAccess : Error { using Error::Error; };
+struct BreakpointHit : Error { using Error::Error; };
+using RAM = MSP430::RAM;
+using enum MSP430::Registers;
+using enum MSP430::Flags;
+
+// Byte/word instruction mode selector
+
+enum ByteWord : bool {
+    Byte = true,
+    Word = false,
+};
+
+template <ByteWord mode>
+struct Constants {
+    static const uint32_t mask;
+    static const uint32_t sign;
+    static const uint32_t carry;
+    static const uint16_t size;
+};
+
+template<> inline const uint32_t Constants<Byte>::mask = 0xff;
+template<> inline const uint32_t Constants<Byte>::sign = 0x80;
+template<> inline const uint32_t Constants<Byte>::carry = 0x100;
+template<> inline const uint16_t Constants<Byte>::size = 1;
+
+template<> inline const uint32_t Constants<Word>::mask = 0xffff;
+template<> inline const uint32_t Constants<Word>::sign = 0x8000;
+template<> inline const uint32_t Constants<Word>::carry = 0x10000;
+template<> inline const uint16_t Constants<Word>::size = 2;
+
+// Word address for an access at an odd one, following msp.misaligned_policy
+
+static uint16_t
+misaligned_address(MSP430& msp, uint16_t address, const char* what)
+{
+    if (msp.misaligned_policy == MSP430::MisalignedPolicy::trap)
+        throw MisalignedAccess(what);
+    return address & ~1;
+}
+
+// MMIO
+
+static constexpr uint16_t MMIO_BASE = MSP430::MMIO_BASE;
+static constexpr uint16_t MMIO_UART_STATUS = MSP430::MMIO_UART_STATUS;
+static constexpr uint16_t MMIO_UART = MSP430::MMIO_UART;
+static constexpr uint16_t MMIO_EXIT = MSP430::MMIO_EXIT;
+
+// Accesses to slots with no device, following msp.unmapped_policy
+uint16_t unmapped_read(MSP430& msp, uint16_t address);
+void unmapped_write(MSP430& msp, uint16_t address, uint16_t value);
+
+template <ByteWord mode>
+static uint16_t
+read_mmio(MSP430& msp, uint16_t address)
+{
+    if constexpr (mode == Byte)
+        throw Error("MMIO accessed in byte-mode");
+
+    if (address & 1)
+        address = misaligned_address(msp, address, "Misaligned MMIO read");
+
+    if (auto device = msp.mmio[address - MMIO_BASE]) [[likely]]
+        return device->read(msp, address);
+    return unmapped_read(msp, address);
+}
+
+template <ByteWord mode>
+static void
+write_mmio(MSP430& msp, uint16_t address, uint16_t value)
+{
+    if constexpr (mode == Byte)
+        throw Error("MMIO accessed in byte-mode");
+
+    if (address & 1)
+        address = misaligned_address(msp, address, "Misaligned MMIO write");
+
+    if (auto device = msp.mmio[address - MMIO_BASE]) [[likely]]
+        return device->write(msp, address, value);
+    unmapped_write(msp, address, value);
+}
+
+// Decode cache
+//
+// One entry per word address. Operand addressing modes are resolved when an
+// entry is filled, so executing from the cache skips fetch and decoding. The
+// code bitmap marks words covered by a cached instruction, writes to those
+// words drop the affected entries (see invalidate_code).
+
+struct DecodedInsn;
+using Handler = void (*)(MSP430&, const DecodedInsn&);
+
+enum OperandKind : uint8_t {
+    reg_direct,     // Rn
+    constant,       // #N, constant generators and PC values known at decode
+    indexed,        // x(Rn)
+    absolute,       // &ADDR, also x(PC) resolved at decode
+    indirect,       // @Rn
+    autoincrement,  // @Rn+
+};
+
+struct DecodedInsn {
+    Handler handler;
+    uint16_t src_ext; // Immediate value, address or index offset
+    uint16_t dst_ext; // Address or index offset, jump target
+    uint8_t src_reg: 4, src_kind: 4;
+    uint8_t dst_reg: 4, dst_kind: 4;
+    uint8_t length; // In bytes
+};
+
+void decode_miss(MSP430& msp, const DecodedInsn&);
+
+// Operand decoding, shared with the JIT. These return false for encodings
+// the decode cache leaves to the reference engine.
+
+struct Operand {
+    OperandKind kind;
+    uint8_t reg;
+    uint16_t ext;
+};
+
+struct Fetch {
+    const uint16_t* words;
+    uint16_t pc;
+    uint16_t count;
+
+    uint16_t address() const { return pc + 2 * count; }
+    uint16_t next() { return words[count++]; }
+};
+
+bool decode_source(MSP430::DualOpInsn op, Fetch& fetch, Operand& out);
+bool decode_dest(MSP430::DualOpInsn op, Fetch& fetch, Operand& out);
+bool decode_single(MSP430::SingleOpInsn op, Fetch& fetch, Operand& out);
+
+struct MSP430::DecodeCache {
+    static constexpr size_t WORDS = RAM_SIZE / 2;
+
+    DecodedInsn entries[WORDS];
+    uint64_t code[WORDS / 64];
+
+    DecodeCache() { clear(); }
+
+    void clear() {
+        for (auto& entry : entries)
+            entry.handler = decode_miss;
+        memset(code, 0, sizeof(code));
+    }
+};
+
+// Memory for a snapshot, made read-only after fill writes its contents
+std::shared_ptr<const MSP430::SnapshotMemory>
+make_snapshot_memory(const std::function<void(MSP430::RAM&)>& fill);
+
+// Drop compiled blocks covering a written word, or all of them
+void jit_invalidate(MSP430& msp, uint16_t address);
+void jit_flush(MSP430& msp);
+
+// Compiled blocks also mark their words in the code bitmap
+static inline void
+invalidate_code(MSP430& msp, uint16_t address)
+{
+    auto& cache = *msp.decode_cache;
+    unsigned word = address >> 1;
+    uint64_t bit = uint64_t(1) << (word % 64);
+
+    if (cache.code[word / 64] & bit) [[unlikely]] {
+        cache.code[word / 64] &= ~bit;
+        // An instruction spans at most three words
+        for (unsigned i=0; i<3; i++)
+            cache.entries[(word - i) % cache.WORDS].handler = decode_miss;
+        if (msp.jit)
+            jit_invalidate(msp, address);
+    }
+}
+
+// Marks the word at address as holding cached code, writes to it then call
+// invalidate_code
+static inline void
+mark_code(MSP430& msp, uint16_t address)
+{
+    unsigned word = address >> 1;
+    msp.decode_cache->code[word / 64] |= uint64_t(1) << (word % 64);
+    msp.page_attributes[address / MSP430::PAGE_BYTES] |= MSP430::page_code;
+}
+
+// Memory accessors
+//
+// Data accesses are added to the trace while one is recording, instruction
+// fetches and extension words are not. Bytes about to be overwritten go to
+// the history's undo log. Accesses to watched bytes stop run() once the
+// instruction completes. Pages with none of that to do, per their
+// attributes, skip straight to the load or store.
+
+void trace_access(MSP430& msp, bool write, ByteWord mode, uint16_t address, uint16_t value);
+void history_write(MSP430& msp, ByteWord mode, uint16_t address);
+
+// Throws for an access page protection denies, access being "Read from",
+// "Write to" or "Execute from"
+[[noreturn]] void protection_fault(MSP430& msp, const char* access, uint16_t address);
+
+template <ByteWord mode>
+static inline void
+check_watch(MSP430& msp, uint16_t address, MSP430::Watch kind)
+{
+    auto& flags = msp.watchpoints;
+    bool first = flags[address] & kind;
+    bool second = mode == Word && (flags[uint16_t(address + 1)] & kind);
+    if ((first || second) && not msp.watch_hit.kind) {
+        msp.watch_hit = { uint16_t(first ? address : address + 1), kind };
+        msp.stop_requested |= MSP430::stop_watch;
+    }
+}
+
+static inline uint8_t
+page_attributes(const MSP430& msp, uint16_t address)
+{
+    return msp.page_attributes[address / MSP430::PAGE_BYTES];
+}
+
+template <ByteWord mode>
+static inline uint16_t
+load_ram(const MSP430& msp, uint16_t address)
+{
+    if constexpr (mode == Word)
+        return *reinterpret_cast<const uint16_t*>(&(*msp.ram)[address]);
+    else
+        return (*msp.ram)[address];
+}
+
+template <ByteWord mode>
+static inline void
+store_ram(MSP430& msp, uint16_t address, uint16_t value)
+{
+    msp.dirty[address / MSP430::PAGE_BYTES] = true;
+    if constexpr (mode == Word)
+        *reinterpret_cast<uint16_t*>(&(*msp.ram)[address]) = value;
+    else
+        (*msp.ram)[address] = value;
+}
+
+template <ByteWord mode>
+[[gnu::noinline]] static uint16_t
+read_ram_slow(MSP430& msp, uint16_t address)
+{
+    auto attributes = page_attributes(msp, address);
+    if (attributes & MSP430::page_no_read)
+        protection_fault(msp, "Read from", address);
+
+    uint16_t value;
+    if (attributes & MSP430::page_mmio) {
+        value = read_mmio<mode>(msp, address);
+    } else {
+        if (mode == Word && (address & 1))
+            address = misaligned_address(msp, address, "Misaligned read");
+        value = load_ram<mode>(msp, address);
+    }
+
+    if (mode == Word)
+        address &= ~1; // Read from there if the policy let it through
+    if (msp.watchpoint_count)
+        check_watch<mode>(msp, address, MSP430::watch_read);
+    if (msp.trace)
+        trace_access(msp, false, mode, address, value);
+    return value;
+}
+
+template <ByteWord mode>
+static inline uint16_t
+read_ram(MSP430& msp, uint16_t address)
+{
+    if (page_attributes(msp, address) & MSP430::page_read_trap) [[unlikely]]
+        return read_ram_slow<mode>(msp, address);
+    if (mode == Word && (address & 1)) [[unlikely]]
+        address = misaligned_address(msp, address, "Misaligned read");
+    return load_ram<mode>(msp, address);
+}
+
+// Clears page_code once the page holds no cached code, 128 words per page
+static inline void
+update_code_page(MSP430& msp, uint16_t address)
+{
+    auto page = address / MSP430::PAGE_BYTES;
+    auto* code = &msp.decode_cache->code[page * MSP430::PAGE_BYTES / 128];
+    if (not (code[0] | code[1]))
+        msp.page_attributes[page] &= ~MSP430::page_code;
+}
+
+template <ByteWord mode>
+[[gnu::noinline]] static void
+write_ram_slow(MSP430& msp, uint16_t address, uint16_t value)
+{
+    auto attributes = page_attributes(msp, address);
+    if (attributes & MSP430::page_no_write)
+        protection_fault(msp, "Write to", address);
+
+    bool mmio = attributes & MSP430::page_mmio;
+    if (mode == Word && (address & 1))
+        address = misaligned_address(msp, address, mmio ? "Misaligned MMIO write" : "Misaligned write");
+
+    if (msp.watchpoint_count)
+        check_watch<mode>(msp, address, MSP430::watch_write);
+    if (msp.trace)
+        trace_access(msp, true, mode, address, value);
+
+    if (mmio)
+        return write_mmio<mode>(msp, address, value);
+    if (msp.history)
+        history_write(msp, mode, address);
+
+    if (attributes & MSP430::page_code) {
+        invalidate_code(msp, address);
+        update_code_page(msp, address);
+    }
+    store_ram<mode>(msp, address, value);
+}
+
+template <ByteWord mode>
+static inline void
+write_ram(MSP430& msp, uint16_t address, uint16_t value)
+{
+    if (page_attributes(msp, address) & MSP430::page_write_trap) [[unlikely]]
+        return write_ram_slow<mode>(msp, address, value);
+    if (mode == Word && (address & 1)) [[unlikely]]
+        address = misaligned_address(msp, address, "Misaligned write");
+    store_ram<mode>(msp, address, value);
+}
+
+[[gnu::noinline]] static uint16_t
+fetch_slow(MSP430& msp, uint16_t address)
+{
+    if (page_attributes(msp, address) & MSP430::page_no_exec)
+        protection_fault(msp, "Execute from", address);
+    return read_mmio<Word>(msp, address);
+}
+
+// Instruction and extension words. PC is even on the hardware, under the
+// align policy odd values lose bit 0. Inlined even into the threaded
+// dispatch, which is too large for the compiler to choose to.
+[[gnu::always_inline]] static inline uint16_t
+read_pc_immediate(MSP430& msp)
+{
+    auto pc = msp.registers[PC];
+    if (pc & 1) [[unlikely]]
+        pc = misaligned_address(msp, pc, "Misaligned read");
+    auto v = page_attributes(msp, pc) & MSP430::page_fetch_trap
+        ? fetch_slow(msp, pc)
+        : load_ram<Word>(msp, pc);
+    msp.registers[PC] = pc + 2;
+    return v;
+}
+
+#define unreachable __builtin_trap
+
+// Lazy flags
+//
+// ALU instructions record their operand signs and result instead of updating
+// SR, as most flags are overwritten before a jump or carry-in reads them.
+// Anything reading the ALU flags calls read_flags. Engines send instructions
+// with SR as a register operand to step_reference, which syncs first, and
+// writes to SR drop the pending flags.
+
+enum PendingKind : uint8_t {
+    pending_none,
+    pending_alu_byte,   // alu_flags_update, sign1/sign2 are operand signs
+    pending_alu_word,
+    pending_shift_byte, // RRC and RRA, sign1 is the carry out
+    pending_shift_word,
+    pending_logic_byte, // AND, BIT, XOR and SXT, sign1 is the overflow
+    pending_logic_word,
+};
+
+static inline uint16_t
+with_flags(uint16_t sr, bool carry, bool zero, bool sign, bool overflow)
+{
+    return (sr & ~ALU)
+        | (carry * CF)
+        | (zero * ZF)
+        | (sign * NF)
+        | (overflow * VF);
+}
+
+template <ByteWord mode>
+static inline uint16_t
+with_alu_flags(uint16_t sr, bool s1_in, bool s2_in, uint32_t out)
+{
+    bool sign_out = out & Constants<mode>::sign;
+    bool carry_out = out & Constants<mode>::carry;
+    bool zero_out = !(out & Constants<mode>::mask);
+    bool overflow_out = (s1_in ^ sign_out) & (s2_in ^ sign_out);
+
+    return with_flags(sr, carry_out, zero_out, sign_out, overflow_out);
+}
+
+// SR with the pending flags applied
+static inline uint16_t
+current_sr(const MSP430& msp)
+{
+    auto sr = msp.registers[SR];
+    auto& p = msp.pending_flags;
+    auto result = p.result;
+
+    switch (PendingKind(p.kind)) {
+        case pending_none:
+            return sr;
+        case pending_alu_byte:
+            return with_alu_flags<Byte>(sr, p.sign1, p.sign2, result);
+        case pending_alu_word:
+            return with_alu_flags<Word>(sr, p.sign1, p.sign2, result);
+        case pending_shift_byte:
+            return with_flags(sr, p.sign1, result == 0, result & Constants<Byte>::sign, 0);
+        case pending_shift_word:
+            return with_flags(sr, p.sign1, result == 0, result & Constants<Word>::sign, 0);
+        case pending_logic_byte:
+            return with_flags(sr, result != 0, result == 0, result & Constants<Byte>::sign, p.sign1);
+        case pending_logic_word:
+            return with_flags(sr, result != 0, result == 0, result & Constants<Word>::sign, p.sign1);
+    }
+    unreachable();
+}
+
+static inline void
+sync_flags(MSP430& msp)
+{
+    if (msp.pending_flags.kind != pending_none) {
+        msp.registers[SR] = current_sr(msp);
+        msp.pending_flags.kind = pending_none;
+    }
+}
+
+static inline uint16_t
+read_flags(MSP430& msp)
+{
+    sync_flags(msp);
+    return msp.registers[SR];
+}
+
+static inline void
+write_register(MSP430& msp, unsigned reg, uint16_t value)
+{
+    if (reg == SR) {
+        msp.pending_flags.kind = pending_none;
+        // Setting GIE with interrupts pending ends the batch to take them
+        if ((value & IF) && msp.pending_interrupts)
+            msp.stop_requested |= MSP430::stop_interrupt;
+    }
+    msp.registers[reg] = value;
+}
+
+struct Destination {
+    uint16_t target;
+    bool is_memory;
+
+    template <ByteWord mode>
+    void write(MSP430& msp, uint16_t value) {
+        if (is_memory)
+            write_ram<mode>(msp, target, value);
+        else
+            write_register(msp, target, Constants<mode>::mask & value);
+    }
+
+    template <ByteWord mode>
+    uint16_t read(MSP430& msp) {
+        if (is_memory)
+            return read_ram<mode>(msp, target);
+        else
+            return Constants<mode>::mask & msp.registers[target];
+    }
+
+    // Writes value and calls update_flags, after a memory write so a fault
+    // leaves the flags alone, before a register write so SR as the
+    // destination takes the value
+    template <ByteWord mode, typename UpdateFlags>
+    void write(MSP430& msp, uint16_t value, UpdateFlags&& update_flags) {
+        if (is_memory) {
+            write_ram<mode>(msp, target, value);
+            update_flags();
+        } else {
+            update_flags();
+            write_register(msp, target, Constants<mode>::mask & value);
+        }
+    }
+};
+
+// Execution
+
+template <ByteWord mode>
+static inline void
+alu_flags_update(MSP430& msp, bool s1_in, bool s2_in, uint32_t out)
+{
+    auto kind = mode == Byte ? pending_alu_byte : pending_alu_word;
+    msp.pending_flags = { out, kind, s1_in, s2_in };
+}
+
+// RRC and RRA, value is the shifted result
+template <ByteWord mode>
+static inline void
+shift_flags_update(MSP430& msp, bool carry_out, uint32_t value)
+{
+    auto kind = mode == Byte ? pending_shift_byte : pending_shift_word;
+    msp.pending_flags = { value, kind, carry_out, false };
+}
+
+// AND, BIT, XOR and SXT, carry is set for non-zero results
+template <ByteWord mode>
+static inline void
+logic_flags_update(MSP430& msp, bool overflow, uint32_t value)
+{
+    auto kind = mode == Byte ? pending_logic_byte : pending_logic_word;
+    msp.pending_flags = { value, kind, overflow, false };
+}
+
+enum DualOpCode {
+    MOV = 0x4,
+    ADD,
+    ADDC,
+    SUBC,
+    SUB,
+    CMP,
+    DADD,
+    BIT,
+    BIC,
+    BIS, /* a.k.a OR */
+    XOR,
+    AND,
+};
+
+// Sums of two decimal digits and a carry, to the result digit with the carry
+// out in bit 4. Sums past 9 are adjusted by 6 as the hardware does, which
+// also gives its results for digits past 9.
+static constexpr auto DECIMAL_DIGITS = [] {
+    std::array<uint8_t, 32> table{};
+    for (unsigned sum=0; sum<table.size(); sum++)
+        table[sum] = sum > 9 ? ((sum + 6) & 15) | 16 : sum;
+    return table;
+}();
+
+// BCD a + b + carry, with the carry out at Constants<mode>::carry
+template <ByteWord mode>
+static inline uint32_t
+decimal_add(uint16_t a, uint16_t b, bool carry)
+{
+    uint32_t result = 0;
+    for (unsigned shift=0; shift<8*Constants<mode>::size; shift+=4) {
+        auto digit = DECIMAL_DIGITS[(a >> shift & 15) + (b >> shift & 15) + carry];
+        result |= uint32_t(digit & 15) << shift;
+        carry = digit >> 4;
+    }
+    return result | carry * Constants<mode>::carry;
+}
+
+template <ByteWord mode>
+static void
+execute_decoded_dual_op(MSP430& msp, DualOpCode op, uint16_t source, Destination dest)
+{
+    if (op == MOV) {
+        dest.write<mode>(msp, source);
+        return;
+    }
+
+    // Register and immediate sources arrive as whole words
+    source &= Constants<mode>::mask;
+    bool sign1_in = source & Constants<mode>::sign;
+    uint32_t target = dest.read<mode>(msp);
+    bool sign2_in = target & Constants<mode>::sign;
+
+    switch (op) {
+        case MOV:
+            unreachable();
+
+        case ADD:
+            target = target + source;
+            dest.write<mode>(msp, target, [&] { alu_flags_update<mode>(msp, sign1_in, sign2_in, target); });
+            break;
+
+        case ADDC:
+            target = target + source + bool(read_flags(msp) & CF);
+            dest.write<mode>(msp, target, [&] { alu_flags_update<mode>(msp, sign1_in, sign2_in, target); });
+            break;
+
+        case SUBC:
+            target = target + (~source & Constants<mode>::mask) + bool(read_flags(msp) & CF);
+            dest.write<mode>(msp, target, [&] { alu_flags_update<mode>(msp, not sign1_in, sign2_in, target); });
+            break;
+
+        case SUB:
+            target = target + (~source & Constants<mode>::mask) + 1;
+            dest.write<mode>(msp, target, [&] { alu_flags_update<mode>(msp, not sign1_in, sign2_in, target); });
+            break;
+
+        case CMP:
+            target = target + (~source & Constants<mode>::mask) + 1;
+            alu_flags_update<mode>(msp, not sign1_in, sign2_in, target);
+            break;
+
+        case DADD:
+            // V is undefined, left clear
+            target = decimal_add<mode>(source, target, read_flags(msp) & CF);
+            dest.write<mode>(msp, target, [&] {
+                msp.registers[SR] = with_flags(
+                    msp.registers[SR], target & Constants<mode>::carry,
+                    not (target & Constants<mode>::mask), target & Constants<mode>::sign, false
+                );
+            });
+            break;
+
+        case BIT:
+            target = target & source;
+            logic_flags_update<mode>(msp, false, target);
+            break;
+
+        case BIC:
+            target = target & ~source;
+            dest.write<mode>(msp, target);
+            break;
+
+        case BIS:
+            target = target | source;
+            dest.write<mode>(msp, target);
+            break;
+
+        case XOR:
+            target = target ^ source;
+            dest.write<mode>(msp, target, [&] { logic_flags_update<mode>(msp, sign1_in && sign2_in, target); });
+            break;
+
+        case AND:
+            target = target & source;
+            dest.write<mode>(msp, target, [&] { logic_flags_update<mode>(msp, false, target); });
+            break;
+
+        default:
+            throw IllegalInstruction("Invalid opcode for dual operand instruction");
+    }
+}
+
+enum SingleOpCode {
+    RRC = 0x0,
+    SWPB,
+    RRA,
+    SXT,
+    PUSH,
+    CALL,
+    RETI,
+};
+
+// SP moves once the write has not faulted
+static inline void
+push(MSP430& msp, uint16_t value)
+{
+    write_ram<Word>(msp, msp.registers[SP] - 2, value);
+    msp.registers[SP] -= 2;
+}
+
+static inline void
+reti(MSP430& msp)
+{
+    auto sr = read_ram<Word>(msp, msp.registers[SP]);
+    auto pc = read_ram<Word>(msp, msp.registers[SP] + 2);
+    write_register(msp, SR, sr);
+    msp.registers[PC] = pc;
+    msp.registers[SP] += 4;
+}
+
+// Read-modify-write single operand instructions. PUSH, CALL and RETI differ
+// in operand evaluation order so are handled by the caller.
+template <ByteWord mode>
+static void
+execute_decoded_single_op(MSP430& msp, SingleOpCode op, Destination target)
+{
+    switch (op) {
+        case SWPB: {
+            target.write<Word>(msp, __builtin_bswap16(target.read<Word>(msp)));
+            break;
+        }
+        case RRC: {
+            bool carry_in = read_flags(msp) & CF;
+            uint32_t value = target.read<mode>(msp) | carry_in * Constants<mode>::carry;
+            bool carry_out = value & 1;
+            value >>= 1;
+            target.write<mode>(msp, value);
+            shift_flags_update<mode>(msp, carry_out, value);
+            break;
+        }
+        case RRA: {
+            uint32_t value = target.read<mode>(msp);
+            bool carry_in = value & Constants<mode>::sign;
+            value |= carry_in * Constants<mode>::carry;
+            bool carry_out = value & 1;
+            value >>= 1;
+            target.write<mode>(msp, value);
+            shift_flags_update<mode>(msp, carry_out, value);
+            break;
+        }
+        case SXT: {
+            uint16_t value = target.read<Byte>(msp);
+            value = int16_t(int8_t(value));
+            target.write<Word>(msp, value);
+            logic_flags_update<Word>(msp, false, value);
+            break;
+        }
+        default:
+            unreachable();
+    }
+}
+
+enum Condition {
+    not_equal = 0x0,
+    equal, // == zero
+    no_carry, // == lower
+    carry, // == higher_or_same
+    negative,
+    greater_equal,
+    less,
+    always,
+};
+
+static inline bool
+is_condition(uint16_t flags, Condition cond)
+{
+    switch (cond) {
+        case not_equal:     return not(flags & ZF);
+        case equal:         return flags & ZF;
+        case no_carry:      return not(flags & CF);
+        case carry:         return flags & CF;
+        case negative:      return flags & NF;
+        case greater_equal: return bool(flags & NF) == bool(flags & VF);
+        case less:          return bool(flags & NF) != bool(flags & VF);
+        case always:        return true;
+    }
+    unreachable();
+}
+
+// Cycle counts
+//
+// From the instruction cycle tables in the MSP430x1xx family user's guide.
+// Constant generator operands count as register mode.
+
+enum CycleMode {
+    cycles_register,    // Rn, constant generators
+    cycles_indirect,    // @Rn
+    cycles_increment,   // @Rn+
+    cycles_immediate,   // #N
+    cycles_indexed,     // x(Rn), EDE, &EDE
+};
+
+static constexpr CycleMode
+cycle_mode(unsigned reg, unsigned as)
+{
+    if (reg == CG || (reg == SR && as >= 2) || as == 0)
+        return cycles_register;
+    if (as == 1)
+        return cycles_indexed;
+    if (as == 2)
+        return cycles_indirect;
+    return reg == PC ? cycles_immediate : cycles_increment;
+}
+
+// Indexed by CycleMode
+static constexpr uint8_t SHIFT_CYCLES[] =    { 1, 3, 3, 3, 4 }; // RRC, RRA, SWPB, SXT
+static constexpr uint8_t PUSH_CYCLES[] =     { 3, 4, 4, 4, 5 };
+static constexpr uint8_t CALL_CYCLES[] =     { 4, 4, 5, 5, 5 };
+static constexpr uint8_t TO_REG_CYCLES[] =   { 1, 2, 2, 2, 3 }; // Dual operand by source mode
+static constexpr uint8_t TO_PC_CYCLES[] =    { 2, 2, 3, 3, 3 };
+static constexpr uint8_t TO_MEM_CYCLES[] =   { 4, 5, 5, 5, 6 };
+
+static constexpr uint8_t
+instruction_cycles(uint16_t instruction)
+{
+    switch (MSP430::classify(instruction)) {
+        case MSP430::invalid:
+            return 1;
+        case MSP430::conditional:
+            return 2;
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            auto mode = cycle_mode(op.target, op.as);
+            switch (op.opcode) {
+                case PUSH:  return PUSH_CYCLES[mode];
+                case CALL:  return CALL_CYCLES[mode];
+                case RETI:  return 5;
+                default:    return SHIFT_CYCLES[mode];
+            }
+        }
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            auto mode = cycle_mode(op.source, op.as);
+            if (op.ad)
+                return TO_MEM_CYCLES[mode];
+            return op.dest == PC ? TO_PC_CYCLES[mode] : TO_REG_CYCLES[mode];
+        }
+    }
+    unreachable();
+}
+
+// Decodes and executes the instruction at PC without using any cache
+void step_reference(MSP430& msp);
+
+// Runs step, the instruction starting at pc, noting pc for run() if it
+// throws. Exception tables make this free until something does.
+//
+// Instructions fault precisely once run() undoes the changes they made
+// before the failed access. Engines keep those to what run() can work out
+// from the instruction: PC, the register of an @Rn+ operand and, for PUSH,
+// SP, all changed before any access that can fault unless PC is still at
+// the instruction. Memory, flags and other registers are written last.
+template <typename Step>
+[[gnu::always_inline]] static inline void
+at_instruction(MSP430& msp, uint16_t pc, Step&& step)
+{
+    try {
+        step();
+    } catch (...) {
+        msp.faulting_pc = pc;
+        throw;
+    }
+}
+
+// Called at a breakpoint before executing it, throws BreakpointHit unless it
+// is the one run() started at
+static inline void
+hit_breakpoint(MSP430& msp)
+{
+    if (not msp.skip_breakpoint)
+        throw BreakpointHit("Breakpoint");
+    msp.skip_breakpoint = false;
+}
+
+// Executes one instruction from the decode cache
+void step_cached(MSP430& msp);
+
+// Tight loops
+//
+// Engines call this after taking a conditional jump back over at most one
+// instruction, the jump offset -1 to -4. It requests stop_idle when the loop
+// now at PC is one run() can skip, see skip_tight_loop.
+
+static inline bool
+is_tight_jump(MSP430::ConditionalInsn op)
+{
+    return op.offset < 0 && op.offset >= -4;
+}
+
+void check_tight_loop(MSP430& msp);
+
+// Whether the code at pc is a loop check_tight_loop accepts, on its shape
+// alone. The jit leaves these to the interpreter.
+bool is_tight_loop(const MSP430& msp, uint16_t pc);
+
+// The execute functions run until count reaches zero or a device sets
+// stop_requested. count is kept up to date when an error is thrown.
+
+void execute_threaded(MSP430& msp, size_t& count);
+
+// Runs compiled code for hot blocks
+void execute_jit(MSP430& msp, size_t& count);
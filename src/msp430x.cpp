@@ -0,0 +1,722 @@
+#include "msp430x.hpp"
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+
+// Location sizes, from the B/W bit and, with an extension word, its A/L bit
+
+enum Size : uint8_t {
+    size_byte,
+    size_word,
+    size_address, // 20 bits, two words in memory
+};
+
+static constexpr uint32_t MASK[] = { 0xff, 0xffff, 0xfffff };
+static constexpr uint32_t SIGN[] = { 0x80, 0x8000, 0x80000 };
+static constexpr unsigned BITS[] = { 8, 16, 20 };
+
+static constexpr uint32_t ADDRESS_MASK = MSP430X::ADDRESS_MASK;
+
+static const MSP430X::Page zero_page = {};
+
+MSP430X::MSP430X()
+{
+    pages.fill(zero_page.data());
+}
+
+void MSP430X::load(std::shared_ptr<const Image> loaded)
+{
+    for (size_t i=0; i<PAGES; i++) {
+        owned[i].reset();
+        pages[i] = loaded->pages[i] ? loaded->pages[i]->data() : zero_page.data();
+    }
+    memset(registers, 0, sizeof(registers));
+    registers[PC] = loaded->entry;
+    stop_requested = false;
+    image = std::move(loaded);
+}
+
+// Copies the page on its first write
+void MSP430X::poke(uint32_t address, uint8_t value)
+{
+    address &= ADDRESS_MASK;
+    auto& page = owned[address / PAGE_BYTES];
+    if (not page) [[unlikely]] {
+        page.reset(new Page);
+        memcpy(page->data(), pages[address / PAGE_BYTES], PAGE_BYTES);
+        pages[address / PAGE_BYTES] = page->data();
+    }
+    (*page)[address % PAGE_BYTES] = value;
+}
+
+size_t MSP430X::owned_pages() const
+{
+    return std::ranges::count_if(owned, [](auto& page) { return page != nullptr; });
+}
+
+// Memory
+
+static bool
+is_mmio(uint32_t address)
+{
+    return address >= MMIO_BASE && address < 0x10000;
+}
+
+static uint16_t
+read_word(MSP430X& m, uint32_t address)
+{
+    address &= ADDRESS_MASK;
+    if (is_mmio(address)) {
+        switch (address) {
+            case MMIO_UART:
+                if (not m.uart_read)
+                    throw Error("UART input not connected");
+                return uint8_t(m.uart_read());
+            case MMIO_UART_STATUS:
+                if (m.uart_status)
+                    return m.uart_status();
+                return (m.uart_read ? MSP430::UART_RX_READY : 0) | (m.uart_print ? MSP430::UART_TX_READY : 0);
+            case MMIO_EXIT:
+                return 0;
+        }
+        throw Error("Read from unknown MMIO device");
+    }
+    return m.peek(address) | m.peek(address + 1) << 8;
+}
+
+static void
+write_word(MSP430X& m, uint32_t address, uint16_t value)
+{
+    address &= ADDRESS_MASK;
+    if (is_mmio(address)) {
+        switch (address) {
+            case MMIO_UART:
+                if (not m.uart_print)
+                    throw Error("UART output not connected");
+                m.uart_print(value);
+                return;
+            case MMIO_UART_STATUS:
+                return;
+            case MMIO_EXIT:
+                m.stop_requested = true;
+                return;
+        }
+        throw Error("Write to unknown MMIO device");
+    }
+    m.poke(address, value);
+    m.poke(address + 1, value >> 8);
+}
+
+static uint32_t
+read_memory(MSP430X& m, uint32_t address, Size size)
+{
+    address &= ADDRESS_MASK;
+    if (size == size_byte) {
+        if (is_mmio(address))
+            throw Error("MMIO accessed in byte-mode");
+        return m.peek(address);
+    }
+
+    if (address & 1)
+        throw MisalignedAccess("Misaligned read");
+    uint32_t value = read_word(m, address);
+    if (size == size_address)
+        value |= (read_word(m, address + 2) & 0xf) << 16;
+    return value;
+}
+
+static void
+write_memory(MSP430X& m, uint32_t address, Size size, uint32_t value)
+{
+    address &= ADDRESS_MASK;
+    if (size == size_byte) {
+        if (is_mmio(address))
+            throw Error("MMIO accessed in byte-mode");
+        return m.poke(address, value);
+    }
+
+    if (address & 1)
+        throw MisalignedAccess("Misaligned write");
+    write_word(m, address, value);
+    if (size == size_address)
+        write_word(m, address + 2, value >> 16 & 0xf);
+}
+
+static uint16_t
+fetch(MSP430X& m)
+{
+    auto pc = m.registers[PC];
+    if (pc & 1)
+        throw MisalignedAccess("Misaligned read");
+    m.registers[PC] = (pc + 2) & ADDRESS_MASK;
+    return read_word(m, pc);
+}
+
+static void
+push(MSP430X& m, Size size, uint32_t value)
+{
+    m.registers[SP] = (m.registers[SP] - (size == size_address ? 4 : 2)) & ADDRESS_MASK;
+    write_memory(m, m.registers[SP], size, value);
+}
+
+// Registers
+//
+// Results written to registers clear the bits above their size
+
+static void
+write_register(MSP430X& m, unsigned reg, Size size, uint32_t value)
+{
+    m.registers[reg] = value & MASK[size];
+}
+
+static void
+set_flags(MSP430X& m, bool carry, bool zero, bool negative, bool overflow)
+{
+    m.registers[SR] = with_flags(m.registers[SR], carry, zero, negative, overflow);
+}
+
+// Arithmetic flags of result, operand signs as the adder saw them
+static void
+set_alu_flags(MSP430X& m, Size size, bool sign1, bool sign2, uint32_t result)
+{
+    bool sign = result & SIGN[size];
+    set_flags(m, result > MASK[size], not (result & MASK[size]), sign, (sign1 ^ sign) & (sign2 ^ sign));
+}
+
+// Operands
+//
+// Extension words carry bits 19:16 of immediates, indexes and absolute
+// addresses. Without one, indexes from bases in the lower 64 KB wrap there,
+// higher bases add the sign extended index.
+
+struct Location {
+    enum Kind : uint8_t { reg, memory, immediate } kind;
+    uint32_t value; // Register, address or value
+};
+
+struct Extension {
+    int src_high = -1;      // Bits 19:16, or -1 without an extension word
+    int dst_high = -1;
+    bool zero_carry = false;
+    unsigned repeat = 1;    // Executions, register mode only
+};
+
+static uint32_t
+sign_extend16(uint16_t value)
+{
+    return uint32_t(int32_t(int16_t(value)));
+}
+
+static uint32_t
+indexed_address(uint32_t base, uint16_t index, int high)
+{
+    if (high >= 0)
+        return (base + (uint32_t(high) << 16 | index)) & ADDRESS_MASK;
+    if (base < 0x10000)
+        return (base + index) & 0xffff;
+    return (base + sign_extend16(index)) & ADDRESS_MASK;
+}
+
+static uint32_t
+extended_value(uint16_t low, int high)
+{
+    return high >= 0 ? uint32_t(high) << 16 | low : low;
+}
+
+// @Rn+ steps by the operand size, the stack pointer and PC by whole words
+static unsigned
+increment(unsigned reg, Size size)
+{
+    static constexpr unsigned steps[] = { 1, 2, 4 };
+    return reg <= SP ? std::max(2u, steps[size]) : steps[size];
+}
+
+static Location
+source_operand(MSP430X& m, unsigned reg, unsigned as, Size size, int high)
+{
+    if (reg == CG) {
+        static constexpr uint32_t constants[4] = { 0, 1, 2, 0xfffff };
+        return { Location::immediate, constants[as] };
+    }
+
+    if (reg == SR && as >= 2)
+        return { Location::immediate, as == 2 ? 4u : 8u };
+
+    switch (as) {
+        case 0:
+            return { Location::reg, reg };
+        case 1: {
+            auto base = m.registers[reg];
+            auto index = fetch(m);
+            if (reg == SR)
+                return { Location::memory, extended_value(index, high) };
+            return { Location::memory, indexed_address(base, index, high) };
+        }
+        case 2:
+            return { Location::memory, m.registers[reg] };
+        case 3: {
+            if (reg == PC)
+                return { Location::immediate, extended_value(fetch(m), high) };
+            auto address = m.registers[reg];
+            m.registers[reg] = (address + increment(reg, size)) & ADDRESS_MASK;
+            return { Location::memory, address };
+        }
+    }
+    unreachable();
+}
+
+static Location
+dest_operand(MSP430X& m, unsigned reg, unsigned ad, int high)
+{
+    if (ad == 0)
+        return { Location::reg, reg };
+
+    if (reg == CG)
+        throw IllegalInstruction("Illegal x(CG2) address mode");
+
+    auto base = m.registers[reg];
+    auto index = fetch(m);
+    if (reg == SR)
+        return { Location::memory, extended_value(index, high) };
+    return { Location::memory, indexed_address(base, index, high) };
+}
+
+// Read-modify-write single operand locations
+static Location
+single_operand(MSP430X& m, unsigned reg, unsigned as, Size size, int high)
+{
+    if (as == 0)
+        return { Location::reg, reg };
+
+    if (reg == CG)
+        throw IllegalInstruction("Illegal target register CG2");
+
+    if (reg == SR && as != 1)
+        throw IllegalInstruction("Illegal target register CG1");
+
+    if (reg == PC && as == 3) {
+        auto address = m.registers[PC];
+        m.registers[PC] = (address + 2) & ADDRESS_MASK;
+        return { Location::memory, address };
+    }
+
+    return source_operand(m, reg, as, size, high);
+}
+
+static uint32_t
+read_operand(MSP430X& m, const Location& operand, Size size)
+{
+    switch (operand.kind) {
+        case Location::reg:          return operand.value == CG ? 0 : m.registers[operand.value] & MASK[size];
+        case Location::memory:       return read_memory(m, operand.value, size);
+        case Location::immediate:    return operand.value & MASK[size];
+    }
+    unreachable();
+}
+
+static void
+write_operand(MSP430X& m, const Location& operand, Size size, uint32_t value)
+{
+    if (operand.kind == Location::reg)
+        write_register(m, operand.value, size, value);
+    else
+        write_memory(m, operand.value, size, value & MASK[size]);
+}
+
+// Execution
+
+// BCD a + b + carry over the digits of size, with the carry out above them
+static uint32_t
+decimal_add(Size size, uint32_t a, uint32_t b, bool carry)
+{
+    uint32_t result = 0;
+    for (unsigned shift=0; shift<BITS[size]; shift+=4) {
+        auto digit = DECIMAL_DIGITS[(a >> shift & 15) + (b >> shift & 15) + carry];
+        result |= uint32_t(digit & 15) << shift;
+        carry = digit >> 4;
+    }
+    return result | uint32_t(carry) << BITS[size];
+}
+
+static void
+execute_alu(MSP430X& m, DualOpCode op, Size size, uint32_t source, const Location& dest, bool zero_carry)
+{
+    if (op == MOV)
+        return write_operand(m, dest, size, source);
+
+    auto mask = MASK[size], sign = SIGN[size];
+    uint32_t target = read_operand(m, dest, size);
+    bool carry = not zero_carry && (m.registers[SR] & CF);
+    bool sign1 = source & sign, sign2 = target & sign;
+    uint32_t result;
+
+    switch (op) {
+        case ADD:
+            result = target + source;
+            set_alu_flags(m, size, sign1, sign2, result);
+            break;
+        case ADDC:
+            result = target + source + carry;
+            set_alu_flags(m, size, sign1, sign2, result);
+            break;
+        case SUBC:
+            result = target + (~source & mask) + carry;
+            set_alu_flags(m, size, not sign1, sign2, result);
+            break;
+        case SUB:
+        case CMP:
+            result = target + (~source & mask) + 1;
+            set_alu_flags(m, size, not sign1, sign2, result);
+            if (op == CMP)
+                return;
+            break;
+        case DADD:
+            // V is undefined, left clear
+            result = decimal_add(size, source, target, carry);
+            set_flags(m, result > mask, not (result & mask), result & sign, false);
+            break;
+        case BIT:
+        case AND:
+            result = target & source;
+            set_flags(m, result != 0, result == 0, result & sign, false);
+            if (op == BIT)
+                return;
+            break;
+        case BIC:
+            result = target & ~source;
+            break;
+        case BIS:
+            result = target | source;
+            break;
+        case XOR:
+            result = target ^ source;
+            set_flags(m, result != 0, result == 0, result & sign, sign1 && sign2);
+            break;
+        default:
+            throw IllegalInstruction("Invalid opcode for dual operand instruction");
+    }
+    write_operand(m, dest, size, result);
+}
+
+static void
+execute_dual_op(MSP430X& m, uint16_t instruction, Size size, const Extension& ext)
+{
+    auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+    auto source = read_operand(m, source_operand(m, op.source, op.as, size, ext.src_high), size);
+    auto dest = dest_operand(m, op.dest, op.ad, ext.dst_high);
+    execute_alu(m, DualOpCode(op.opcode), size, source, dest, ext.zero_carry);
+}
+
+static void
+execute_single_op(MSP430X& m, uint16_t instruction, Size size, const Extension& ext)
+{
+    auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+    bool extended = ext.dst_high >= 0 || ext.repeat > 1 || size == size_address;
+
+    switch (op.opcode) {
+        case RRC:
+        case RRA: {
+            auto location = single_operand(m, op.target, op.as, size, ext.dst_high);
+            uint32_t value = read_operand(m, location, size);
+            bool carry_in = not ext.zero_carry && (m.registers[SR] & CF);
+            uint32_t top = op.opcode == RRC ? carry_in * SIGN[size] : value & SIGN[size];
+            bool carry_out = value & 1;
+            value = value >> 1 | top;
+            write_operand(m, location, size, value);
+            set_flags(m, carry_out, value == 0, value & SIGN[size], false);
+            break;
+        }
+        case SWPB: {
+            auto wide = size == size_address ? size_address : size_word;
+            auto location = single_operand(m, op.target, op.as, size, ext.dst_high);
+            uint32_t value = read_operand(m, location, wide);
+            value = (value & 0xf0000) | (value >> 8 & 0xff) | (value & 0xff) << 8;
+            write_operand(m, location, wide, value);
+            break;
+        }
+        case SXT: {
+            auto wide = size == size_address ? size_address : size_word;
+            auto location = single_operand(m, op.target, op.as, size, ext.dst_high);
+            uint32_t value = sign_extend16(int8_t(read_operand(m, location, size_byte))) & MASK[wide];
+            write_operand(m, location, wide, value);
+            set_flags(m, value != 0, value == 0, value & SIGN[wide], false);
+            break;
+        }
+        case PUSH: {
+            m.registers[SP] = (m.registers[SP] - (size == size_address ? 4 : 2)) & ADDRESS_MASK;
+            auto value = read_operand(m, source_operand(m, op.target, op.as, size, ext.dst_high), size);
+            write_memory(m, m.registers[SP], size, value);
+            break;
+        }
+        case CALL: {
+            // Only in the lower 64 KB, CALLA reaches the rest
+            if (extended)
+                throw IllegalInstruction("CALL with extension word");
+            auto dest = read_operand(m, source_operand(m, op.target, op.as, size, -1), size_word);
+            push(m, size_word, m.registers[PC]);
+            m.registers[PC] = dest;
+            break;
+        }
+        case RETI: {
+            if (extended || (instruction & 0x3f))
+                throw IllegalInstruction("Illegal argument for RETI");
+            // PC bits 19:16 are kept in the top of the saved SR
+            auto sr = read_memory(m, m.registers[SP], size_word);
+            auto pc = read_memory(m, m.registers[SP] + 2, size_word);
+            m.registers[SR] = sr & 0x0fff;
+            m.registers[PC] = (sr & 0xf000) << 4 | pc;
+            m.registers[SP] = (m.registers[SP] + 4) & ADDRESS_MASK;
+            break;
+        }
+        default:
+            throw IllegalInstruction("Illegal single operand instruction");
+    }
+}
+
+static void
+execute_jump(MSP430X& m, uint16_t instruction)
+{
+    auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+    if (is_condition(m.registers[SR], Condition(op.condition)))
+        m.registers[PC] = (m.registers[PC] + (uint32_t(int32_t(op.offset)) << 1)) & ADDRESS_MASK;
+}
+
+// RRCM, RRAM, RLAM and RRUM, shifting a register 1 to 4 times
+static void
+execute_rotate(MSP430X& m, uint16_t instruction)
+{
+    unsigned count = (instruction >> 10 & 3) + 1;
+    unsigned kind = instruction >> 8 & 3;
+    unsigned reg = instruction & 15;
+    auto size = instruction & 0x10 ? size_word : size_address;
+    auto sign = SIGN[size];
+
+    uint32_t value = m.registers[reg] & MASK[size];
+    bool carry = m.registers[SR] & CF;
+    for (unsigned i=0; i<count; i++) {
+        bool out = kind == 2 ? value & sign : value & 1;
+        switch (kind) {
+            case 0: value = value >> 1 | carry * sign;      break; // RRCM
+            case 1: value = value >> 1 | (value & sign);    break; // RRAM
+            case 2: value = (value << 1) & MASK[size];      break; // RLAM
+            case 3: value = value >> 1;                     break; // RRUM
+        }
+        carry = out;
+    }
+
+    write_register(m, reg, size, value);
+    set_flags(m, carry, value == 0, value & sign, false);
+}
+
+// CMPA, ADDA and SUBA
+static void
+execute_address_alu(MSP430X& m, unsigned op, uint32_t source, unsigned dst)
+{
+    auto target = m.registers[dst];
+    bool subtract = op != 2;
+    uint32_t result = subtract ? target + (~source & ADDRESS_MASK) + 1 : target + source;
+    set_alu_flags(m, size_address, bool(source & SIGN[size_address]) != subtract, target & SIGN[size_address], result);
+    if (op != 1)
+        write_register(m, dst, size_address, result);
+}
+
+// Address instructions, opcodes 0x0000 to 0x0fff. Bits 11:8 are the source
+// register or bits 19:16 of the value, bits 3:0 the destination register or
+// bits 19:16 of the address.
+static void
+execute_address_op(MSP430X& m, uint16_t instruction)
+{
+    unsigned src = instruction >> 8 & 15, op = instruction >> 4 & 15, dst = instruction & 15;
+    auto& r = m.registers;
+
+    switch (op) {
+        case 0: // MOVA @Rsrc, Rdst
+            return write_register(m, dst, size_address, read_memory(m, r[src], size_address));
+        case 1: { // MOVA @Rsrc+, Rdst
+            auto address = r[src];
+            auto value = read_memory(m, address, size_address);
+            r[src] = (address + 4) & ADDRESS_MASK;
+            return write_register(m, dst, size_address, value);
+        }
+        case 2: { // MOVA &abs20, Rdst
+            auto address = extended_value(fetch(m), src);
+            return write_register(m, dst, size_address, read_memory(m, address, size_address));
+        }
+        case 3: { // MOVA x(Rsrc), Rdst
+            auto base = r[src];
+            auto address = base + sign_extend16(fetch(m));
+            return write_register(m, dst, size_address, read_memory(m, address, size_address));
+        }
+        case 4:
+        case 5:
+            return execute_rotate(m, instruction);
+        case 6: { // MOVA Rsrc, &abs20
+            auto address = extended_value(fetch(m), dst);
+            return write_memory(m, address, size_address, r[src]);
+        }
+        case 7: { // MOVA Rsrc, x(Rdst)
+            auto base = r[dst];
+            auto address = base + sign_extend16(fetch(m));
+            return write_memory(m, address, size_address, r[src]);
+        }
+        case 8: // MOVA #imm20, Rdst
+            return write_register(m, dst, size_address, extended_value(fetch(m), src));
+        case 9 ... 11: // CMPA, ADDA, SUBA #imm20, Rdst
+            return execute_address_alu(m, op - 8, extended_value(fetch(m), src), dst);
+        case 12: // MOVA Rsrc, Rdst
+            return write_register(m, dst, size_address, r[src]);
+        case 13 ... 15: // CMPA, ADDA, SUBA Rsrc, Rdst
+            return execute_address_alu(m, op - 12, r[src], dst);
+    }
+    unreachable();
+}
+
+// CALLA, pushing the 20-bit return address
+static void
+execute_calla(MSP430X& m, uint16_t instruction)
+{
+    unsigned mode = instruction >> 4 & 15, reg = instruction & 15;
+    auto& r = m.registers;
+    uint32_t target;
+
+    switch (mode) {
+        case 4: // Rdst
+            target = r[reg];
+            break;
+        case 5: { // x(Rdst)
+            auto base = r[reg];
+            target = read_memory(m, base + sign_extend16(fetch(m)), size_address);
+            break;
+        }
+        case 6: // @Rdst
+            target = read_memory(m, r[reg], size_address);
+            break;
+        case 7: // @Rdst+
+            target = read_memory(m, r[reg], size_address);
+            r[reg] = (r[reg] + 4) & ADDRESS_MASK;
+            break;
+        case 8: // &abs20
+            target = read_memory(m, extended_value(fetch(m), reg), size_address);
+            break;
+        case 9: { // EDE, PC relative
+            auto base = r[PC];
+            target = read_memory(m, base + extended_value(fetch(m), reg), size_address);
+            break;
+        }
+        case 11: // #imm20
+            target = extended_value(fetch(m), reg);
+            break;
+        default:
+            throw IllegalInstruction("Illegal CALLA address mode");
+    }
+
+    push(m, size_address, r[PC]);
+    r[PC] = target & ADDRESS_MASK;
+}
+
+// PUSHM and POPM, n registers down from, or up to, the one given
+static void
+execute_push_pop(MSP430X& m, uint16_t instruction)
+{
+    unsigned kind = instruction >> 8 & 3;
+    unsigned count = (instruction >> 4 & 15) + 1;
+    unsigned reg = instruction & 15;
+    auto size = kind & 1 ? size_word : size_address;
+    auto& r = m.registers;
+
+    for (unsigned i=0; i<count; i++) {
+        if (kind < 2) {
+            push(m, size, r[(reg - i) & 15]);
+        } else {
+            auto value = read_memory(m, r[SP], size);
+            r[SP] = (r[SP] + (size == size_address ? 4 : 2)) & ADDRESS_MASK;
+            write_register(m, (reg + i) & 15, size, value);
+        }
+    }
+}
+
+// Extended format I and II instructions. In register mode the extension
+// word holds ZC and the repeat count, otherwise bits 19:16 of the operands.
+static void
+execute_extended(MSP430X& m, uint16_t extension)
+{
+    auto instruction = fetch(m);
+    bool dual = instruction >= 0x4000;
+    bool single = (instruction & 0xfc00) == 0x1000 && (instruction >> 7 & 7) <= PUSH;
+    if (not dual && not single)
+        throw IllegalInstruction("Illegal instruction after extension word");
+
+    bool al = extension & 0x40, bw = instruction & 0x40;
+    if (not al && not bw)
+        throw IllegalInstruction("Reserved extension word size");
+    auto size = not al ? size_address : bw ? size_byte : size_word;
+
+    Extension ext;
+    bool register_mode = dual
+        ? (instruction & 0x30) == 0 && (instruction & 0x80) == 0
+        : (instruction & 0x30) == 0;
+
+    if (register_mode) {
+        ext.zero_carry = extension & 0x100;
+        unsigned count = extension & 0x80 ? m.registers[extension & 15] & 15 : extension & 15;
+        ext.repeat = count + 1;
+    } else {
+        ext.src_high = extension >> 7 & 15;
+        ext.dst_high = extension & 15;
+    }
+
+    for (unsigned i=0; i<ext.repeat; i++) {
+        if (dual)
+            execute_dual_op(m, instruction, size, ext);
+        else
+            execute_single_op(m, instruction, size, ext);
+    }
+}
+
+static void
+step(MSP430X& m)
+{
+    auto instruction = fetch(m);
+
+    switch (instruction >> 12) {
+        case 0:
+            return execute_address_op(m, instruction);
+        case 1:
+            if (instruction >= 0x1800)
+                return execute_extended(m, instruction);
+            if (instruction >= 0x1400)
+                return execute_push_pop(m, instruction);
+            if (instruction >= 0x1340)
+                return execute_calla(m, instruction);
+            return execute_single_op(m, instruction, instruction & 0x40 ? size_byte : size_word, {});
+        case 2:
+        case 3:
+            return execute_jump(m, instruction);
+        default:
+            return execute_dual_op(m, instruction, instruction & 0x40 ? size_byte : size_word, {});
+    }
+}
+
+MSP430X::RunResult MSP430X::run(size_t max_instructions)
+{
+    size_t count = 0;
+    RunResult result = { StopReason::budget, 0, {} };
+    stop_requested = false;
+
+    try {
+        for (; count < max_instructions && not stop_requested; count++)
+            step(*this);
+        if (stop_requested)
+            result.reason = StopReason::exit;
+    } catch (IllegalInstruction& e) {
+        result = { StopReason::illegal, 0, e.what() };
+    } catch (MisalignedAccess& e) {
+        result = { StopReason::misaligned, 0, e.what() };
+    } catch (std::exception& e) {
+        result = { StopReason::fault, 0, e.what() };
+    }
+
+    stop_requested = false;
+    result.instructions = count;
+    return result;
+}
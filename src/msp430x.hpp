@@ -0,0 +1,71 @@
+#pragma once
+// MSP430X core: 20-bit registers, extension words, address instructions and
+// a 1 MB address space
+//
+// A separate interpreter from MSP430, whose engines, caches and tools stay
+// built around 16-bit addresses and keep their speed. Classic instructions
+// run as on an MSP430X CPU: register results clear the bits above their
+// size, and indexed addresses from registers above 64 KB are 20-bit.
+//
+// Memory is paged. Until written a page is read from the image it was loaded
+// from, or a shared zero page, so instances only hold the pages they wrote.
+// The MMIO window is the same as MSP430's, with the UART and exit registers.
+
+#include "msp430.hpp"
+
+#include <array>
+#include <functional>
+#include <memory>
+
+struct MSP430X {
+    static constexpr uint32_t ADDRESS_SPACE = 1 << 20;
+    static constexpr uint32_t ADDRESS_MASK = ADDRESS_SPACE - 1;
+    static constexpr size_t PAGE_BYTES = 4096;
+    static constexpr size_t PAGES = ADDRESS_SPACE / PAGE_BYTES;
+
+    using Page = std::array<uint8_t, PAGE_BYTES>;
+    using StopReason = MSP430::StopReason;
+    using RunResult = MSP430::RunResult;
+
+    // A loaded program, immutable and shared by every instance running it
+    struct Image {
+        std::array<std::shared_ptr<const Page>, PAGES> pages; // Null pages are zero
+        uint32_t entry = 0;
+    };
+
+    // Maps an ELF file, or a raw binary loaded at 0 if path ends in .bin.
+    // Throws on failure.
+    static std::shared_ptr<const Image> load_image(const char* path);
+
+    // Resets to image, reading its pages until written
+    void load(std::shared_ptr<const Image> image);
+
+    uint32_t registers[16] = {};
+
+    // Readable data of every page, the owned copy once written
+    std::array<const uint8_t*, PAGES> pages;
+    std::array<std::unique_ptr<Page>, PAGES> owned;
+    std::shared_ptr<const Image> image;
+
+    bool stop_requested = false; // Set by the exit register
+
+    // UART IO for this instance, accesses fault while unset
+    std::function<void(char)> uart_print;
+    std::function<char()> uart_read;
+    std::function<uint16_t()> uart_status; // As MSP430::uart_status
+
+    MSP430X();
+
+    // Executes up to max_instructions, a repeated instruction counting once.
+    // The instruction that faults is not counted.
+    RunResult run(size_t max_instructions);
+
+    // Memory as the CPU sees it, without MMIO. Writes allocate pages.
+    uint8_t peek(uint32_t address) const {
+        address &= ADDRESS_MASK;
+        return pages[address / PAGE_BYTES][address % PAGE_BYTES];
+    }
+    void poke(uint32_t address, uint8_t value);
+
+    size_t owned_pages() const;
+};
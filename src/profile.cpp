@@ -0,0 +1,97 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <inttypes.h>
+#include <string>
+
+void Profile::enter(uint16_t function, uint16_t return_pc, uint16_t sp)
+{
+    auto parent = stack.back().node;
+    auto [it, inserted] = children.try_emplace({ parent, function }, nodes.size());
+    if (inserted)
+        nodes.push_back({ function, parent, 0, 0 });
+    nodes[it->second].calls++;
+    stack.push_back({ it->second, return_pc, sp });
+}
+
+static std::string
+function_name(const MSP430& msp, uint16_t address)
+{
+    char buffer[16];
+    auto symbol = msp.find_symbol(address);
+    if (symbol == nullptr) {
+        snprintf(buffer, sizeof(buffer), "0x%04x", address);
+        return buffer;
+    }
+    if (symbol->address == address)
+        return symbol->name;
+    snprintf(buffer, sizeof(buffer), "+0x%x", address - symbol->address);
+    return symbol->name + buffer;
+}
+
+void Profile::write_flat(FILE* out, const MSP430& msp) const
+{
+    struct Function {
+        uint64_t instructions, cycles, calls;
+    };
+
+    // Self totals go to the symbol containing each PC, calls to the callee
+    std::map<std::string, Function> functions;
+    uint64_t total_cycles = 0;
+
+    for (size_t word=0; word<counts.size(); word++) {
+        if (counts[word] == 0)
+            continue;
+        auto symbol = msp.find_symbol(2 * word);
+        auto& f = functions[symbol ? symbol->name : function_name(msp, 2 * word)];
+        f.instructions += counts[word];
+        f.cycles += cycles[word];
+        total_cycles += cycles[word];
+    }
+
+    for (auto& node : nodes)
+        functions[function_name(msp, node.function)].calls += node.calls;
+
+    std::vector<std::pair<std::string, Function>> sorted(functions.begin(), functions.end());
+    std::ranges::stable_sort(sorted, std::greater{}, [](auto& f) { return f.second.cycles; });
+
+    fprintf(out, "%7s %12s %12s %10s  %s\n", "%", "cycles", "instructions", "calls", "function");
+    for (auto& [name, f] : sorted) {
+        fprintf(
+            out, "%7.2f %12" PRIu64 " %12" PRIu64 " %10" PRIu64 "  %s\n",
+            total_cycles ? 100.0 * f.cycles / total_cycles : 0.0,
+            f.cycles, f.instructions, f.calls, name.c_str()
+        );
+    }
+
+    std::map<std::pair<std::string, std::string>, uint64_t> edges;
+    for (size_t i=1; i<nodes.size(); i++) {
+        auto& node = nodes[i];
+        auto caller = function_name(msp, nodes[node.parent].function);
+        edges[{ caller, function_name(msp, node.function) }] += node.calls;
+    }
+
+    fprintf(out, "\n%10s  %s\n", "calls", "caller -> callee");
+    for (auto& [edge, calls] : edges)
+        fprintf(out, "%10" PRIu64 "  %s -> %s\n", calls, edge.first.c_str(), edge.second.c_str());
+}
+
+void Profile::write_folded(FILE* out, const MSP430& msp) const
+{
+    for (size_t i=0; i<nodes.size(); i++) {
+        if (nodes[i].cycles == 0)
+            continue;
+
+        std::vector<std::string> names;
+        for (size_t n=i;; n=nodes[n].parent) {
+            names.push_back(function_name(msp, nodes[n].function));
+            if (n == 0)
+                break;
+        }
+
+        std::string line;
+        for (auto it = names.rbegin(); it != names.rend(); it++)
+            line += (line.empty() ? "" : ";") + *it;
+        fprintf(out, "%s %" PRIu64 "\n", line.c_str(), nodes[i].cycles);
+    }
+}
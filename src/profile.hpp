@@ -0,0 +1,81 @@
+#pragma once
+// Execution profile, see MSP430::profile
+
+#include "msp430.hpp"
+
+#include <map>
+#include <stdio.h>
+#include <vector>
+
+struct Profile {
+    // Indexed by word address
+    std::vector<uint64_t> counts = std::vector<uint64_t>(MSP430::RAM_SIZE / 2);
+    std::vector<uint64_t> cycles = std::vector<uint64_t>(MSP430::RAM_SIZE / 2);
+
+    // Call tree from CALL and interrupts, node 0 is where profiling started.
+    // A node is one function reached through one stack of calls, interrupt
+    // handlers being called from what they interrupted.
+    struct Node {
+        uint16_t function;      // Entry address
+        uint32_t parent;
+        uint64_t calls;
+        uint64_t cycles;        // Excluding callees
+    };
+
+    // A call ends on reaching its return address with SP as before it, as
+    // RET and RETI do, or once SP is above that, when the stack was unwound.
+    // Returns are found whatever instruction makes them.
+    struct Frame {
+        uint32_t node;
+        uint16_t return_pc;
+        uint16_t sp;
+    };
+
+    std::vector<Node> nodes = { {} };
+    std::map<std::pair<uint32_t, uint16_t>, uint32_t> children; // By parent and function
+    std::vector<Frame> stack = { {} };
+    bool started = false;
+
+    // Called by run() after each instruction, with msp as it left it
+    void record(const MSP430& msp, uint16_t pc, uint16_t instruction, uint8_t instruction_cycles) {
+        if (not started) [[unlikely]] {
+            nodes[0].function = pc;
+            started = true;
+        }
+
+        counts[pc >> 1]++;
+        cycles[pc >> 1] += instruction_cycles;
+        nodes[stack.back().node].cycles += instruction_cycles;
+
+        auto next_pc = msp.registers[MSP430::PC];
+        auto sp = msp.registers[MSP430::SP];
+        if ((instruction & 0xffc0) == 0x1280) { // call, the return address pushed
+            auto& ram = *msp.ram;
+            enter(next_pc, ram[sp] | ram[uint16_t(sp + 1)] << 8, sp + 2);
+        } else if (stack.size() > 1) {
+            leave(next_pc, sp);
+        }
+    }
+
+    // Called by run() on taking an interrupt, sp from before it
+    void interrupt(uint16_t handler, uint16_t return_pc, uint16_t sp) {
+        if (not started) {
+            nodes[0].function = return_pc;
+            started = true;
+        }
+        enter(handler, return_pc, sp);
+    }
+
+    void enter(uint16_t function, uint16_t return_pc, uint16_t sp);
+
+    void leave(uint16_t pc, uint16_t sp) {
+        while (stack.size() > 1 && (sp > stack.back().sp || (sp == stack.back().sp && pc == stack.back().return_pc)))
+            stack.pop_back();
+    }
+
+    // Per function totals by self cycles, then the call graph
+    void write_flat(FILE* out, const MSP430& msp) const;
+
+    // One line per stack, "outer;inner cycles", as used by flamegraph.pl
+    void write_folded(FILE* out, const MSP430& msp) const;
+};
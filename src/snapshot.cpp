@@ -0,0 +1,181 @@
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+// Snapshot memory lives in a memfd. Instances restoring it for the first time
+// map the file privately, the kernel then shares its pages between all of
+// them until they are written.
+
+struct MSP430::SnapshotMemory {
+    int fd = -1;
+    const RAM* ram = nullptr;
+
+    ~SnapshotMemory() {
+        if (ram)
+            munmap(const_cast<RAM*>(ram), RAM_SIZE);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+void MSP430::RamDeleter::operator()(RAM* p) const
+{
+    if (pool)
+        pool->give(p);
+    else
+        munmap(p, RAM_SIZE);
+}
+
+static std::unique_ptr<MSP430::RAM, MSP430::RamDeleter>
+map_ram(int fd)
+{
+    int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE;
+    auto p = mmap(nullptr, MSP430::RAM_SIZE, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+    return std::unique_ptr<MSP430::RAM, MSP430::RamDeleter>(static_cast<MSP430::RAM*>(p));
+}
+
+std::unique_ptr<MSP430::RAM, MSP430::RamDeleter> MSP430::allocate_ram()
+{
+    return map_ram(-1);
+}
+
+// Ram pool
+//
+// Slots are handed out of each partition in order the first time, so arena
+// pages are only touched once needed and then by the thread that takes
+// them. Freed slots go on their partition's free list, linked through their
+// first bytes.
+
+static constexpr size_t HUGE_PAGE = 2 << 20;
+
+struct MSP430::RamPool::Partition {
+    std::mutex lock;
+    RAM* free = nullptr;
+    size_t fresh = 0; // Slots from here on never taken
+};
+
+MSP430::RamPool::RamPool(size_t instances, unsigned partitions)
+{
+    if (partitions == 0)
+        partitions = std::max(1U, std::thread::hardware_concurrency());
+    partition_count = partitions;
+    partition_slots = std::max<size_t>(1, (instances + partitions - 1) / partitions);
+
+    auto bytes = partition_slots * partitions * RAM_SIZE;
+    arena_bytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    auto p = mmap(nullptr, arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        throw Error(strerror(errno));
+    madvise(p, arena_bytes, MADV_HUGEPAGE); // A hint, fine to fail
+    arena = static_cast<uint8_t*>(p);
+    this->partitions = std::make_unique<Partition[]>(partitions);
+}
+
+MSP430::RamPool::~RamPool()
+{
+    munmap(arena, arena_bytes);
+}
+
+MSP430::RAM* MSP430::RamPool::take(unsigned partition)
+{
+    for (unsigned i=0; i<partition_count; i++) {
+        auto index = (partition + i) % partition_count;
+        auto& partition = partitions[index];
+        std::lock_guard guard(partition.lock);
+
+        if (auto ram = partition.free) {
+            memcpy(&partition.free, ram->data(), sizeof(RAM*));
+            return ram;
+        }
+        if (partition.fresh < partition_slots) {
+            auto slot = index * partition_slots + partition.fresh++;
+            return reinterpret_cast<RAM*>(arena + slot * RAM_SIZE);
+        }
+    }
+    throw std::bad_alloc();
+}
+
+void MSP430::RamPool::give(RAM* ram)
+{
+    auto slot = (reinterpret_cast<uint8_t*>(ram) - arena) / RAM_SIZE;
+    auto& partition = partitions[slot / partition_slots];
+    std::lock_guard guard(partition.lock);
+    memcpy(ram->data(), &partition.free, sizeof(RAM*));
+    partition.free = ram;
+}
+
+std::shared_ptr<const MSP430::SnapshotMemory>
+make_snapshot_memory(const std::function<void(MSP430::RAM&)>& fill)
+{
+    auto memory = std::make_shared<MSP430::SnapshotMemory>();
+    memory->fd = memfd_create("msp430-snapshot", MFD_CLOEXEC);
+    if (memory->fd < 0 || ftruncate(memory->fd, MSP430::RAM_SIZE) < 0)
+        throw Error(strerror(errno));
+
+    auto p = mmap(nullptr, MSP430::RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memory->fd, 0);
+    if (p == MAP_FAILED)
+        throw Error(strerror(errno));
+    memory->ram = static_cast<const MSP430::RAM*>(p);
+    fill(*static_cast<MSP430::RAM*>(p));
+    mprotect(p, MSP430::RAM_SIZE, PROT_READ);
+    return memory;
+}
+
+MSP430::Snapshot MSP430::snapshot()
+{
+    ::sync_flags(*this);
+
+    auto memory = make_snapshot_memory([&](RAM& copy) { copy = *ram; });
+
+    Snapshot snapshot;
+    memcpy(snapshot.registers, registers, sizeof(registers));
+    snapshot.cycles = cycles;
+    snapshot.memory = memory;
+
+    baseline = std::move(memory);
+    dirty.fill(false);
+    return snapshot;
+}
+
+void MSP430::restore(const Snapshot& snapshot)
+{
+    if (baseline == snapshot.memory) {
+        for (size_t page=0; page<PAGES; page++) {
+            if (not dirty[page])
+                continue;
+
+            auto offset = page * PAGE_BYTES;
+            memcpy(ram->data() + offset, snapshot.memory->ram->data() + offset, PAGE_BYTES);
+
+            // Drop cached code in the page, the bitmap covers 128 words per page
+            if (decode_cache) {
+                auto* code = &decode_cache->code[page * PAGE_BYTES / 128];
+                for (unsigned i=0; i<2; i++) {
+                    for (auto bits = code[i]; bits; bits &= bits - 1)
+                        invalidate_code(*this, offset + 128 * i + 2 * __builtin_ctzll(bits));
+                }
+                update_code_page(*this, offset);
+            }
+        }
+    } else {
+        if (ram.get_deleter().pool)
+            *ram = *snapshot.memory->ram; // Stays in the pool's arena
+        else
+            ram = map_ram(snapshot.memory->fd);
+        invalidate_decode_cache();
+        baseline = snapshot.memory;
+    }
+
+    dirty.fill(false);
+    memcpy(registers, snapshot.registers, sizeof(registers));
+    cycles = snapshot.cycles;
+    pending_flags = {};
+    pending_interrupts = 0;
+    stop_requested = 0;
+}
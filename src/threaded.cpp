@@ -0,0 +1,546 @@
+#include "msp430_impl.hpp"
+
+#include <unordered_map>
+
+// Threaded execution
+//
+// Every 16-bit instruction word indexes a table of handlers specialised at
+// compile time on opcode, byte/word mode, addressing modes and register class,
+// leaving no decoding to do at run time. Where the compiler guarantees tail
+// calls each handler dispatches the next instruction itself. Otherwise
+// handlers return to a computed goto with a label for each of them, see
+// execute_threaded. Either way every handler ends in its own indirect branch.
+
+using ThreadedHandler = void (*)(MSP430&, uint16_t instruction, size_t& budget);
+
+static ThreadedHandler threaded_handlers[0x10000];
+
+#if __has_cpp_attribute(clang::musttail)
+#define THREADED_MUSTTAIL [[clang::musttail]]
+#elif __has_cpp_attribute(gnu::musttail)
+#define THREADED_MUSTTAIL [[gnu::musttail]]
+#endif
+
+// budget counts down as instructions complete, so it is exact after a fault
+#ifdef THREADED_MUSTTAIL
+#define DISPATCH_NEXT \
+    if (--budget == 0 || msp.stop_requested) \
+        return; \
+    auto next = read_pc_immediate(msp); \
+    THREADED_MUSTTAIL return threaded_handlers[next](msp, next, budget)
+#else
+#define DISPATCH_NEXT (void)budget
+#endif
+
+enum SourceMode : uint8_t {
+    src_register,
+    src_indexed,        // x(Rn)
+    src_symbolic,       // x(PC)
+    src_absolute,       // &ADDR
+    src_indirect,       // @Rn
+    src_autoincrement,  // @Rn+, steps by operand size
+    src_pop,            // @SP+ or single operand @PC+, always steps by 2
+    src_immediate,      // dual operand @PC+, always reads a word
+    src_constant,       // constant generators
+    src_unsupported,
+};
+
+enum DestMode : uint8_t {
+    dst_register,
+    dst_indexed,
+    dst_symbolic,
+    dst_absolute,
+    dst_unsupported,
+};
+
+// Operand access, matching the evaluation order of the reference decoder
+
+template <ByteWord mode, SourceMode s>
+static inline Destination
+threaded_location(MSP430& msp, unsigned reg)
+{
+    if constexpr (s == src_register) {
+        return { uint16_t(reg), false };
+    } else if constexpr (s == src_indexed || s == src_symbolic) {
+        auto base = msp.registers[s == src_symbolic ? unsigned(PC) : reg];
+        auto offset = read_pc_immediate(msp);
+        return { uint16_t(base + offset), true };
+    } else if constexpr (s == src_absolute) {
+        return { read_pc_immediate(msp), true };
+    } else if constexpr (s == src_indirect) {
+        return { msp.registers[reg], true };
+    } else if constexpr (s == src_autoincrement || s == src_pop) {
+        auto address = msp.registers[reg];
+        msp.registers[reg] += s == src_pop ? 2 : Constants<mode>::size;
+        return { address, true };
+    } else {
+        static_assert(s == src_register, "No location for source mode");
+    }
+}
+
+template <ByteWord mode, SourceMode s, uint16_t value>
+static inline uint16_t
+threaded_source(MSP430& msp, unsigned reg)
+{
+    if constexpr (s == src_register)
+        return msp.registers[reg];
+    else if constexpr (s == src_immediate)
+        return read_pc_immediate(msp);
+    else if constexpr (s == src_constant)
+        return value;
+    else
+        return threaded_location<mode, s>(msp, reg).template read<mode>(msp);
+}
+
+template <DestMode d>
+static inline Destination
+threaded_dest(MSP430& msp, unsigned reg)
+{
+    if constexpr (d == dst_register) {
+        return { uint16_t(reg), false };
+    } else if constexpr (d == dst_absolute) {
+        return { read_pc_immediate(msp), true };
+    } else {
+        auto base = msp.registers[d == dst_symbolic ? unsigned(PC) : reg];
+        auto offset = read_pc_immediate(msp);
+        return { uint16_t(base + offset), true };
+    }
+}
+
+// Handlers
+//
+// Each instruction word is fetched before its handler runs, so handlers that
+// can fault note PC - 2 as the instruction start, see at_instruction.
+
+template <DualOpCode op, ByteWord mode, SourceMode s, uint16_t value, DestMode d>
+static void
+threaded_dual_op(MSP430& msp, uint16_t instruction, size_t& budget)
+{
+    at_instruction(msp, msp.registers[PC] - 2, [&] {
+        auto source = threaded_source<mode, s, value>(msp, (instruction >> 8) & 0xf);
+        auto dest = threaded_dest<d>(msp, instruction & 0xf);
+        execute_decoded_dual_op<mode>(msp, op, source, dest);
+    });
+    DISPATCH_NEXT;
+}
+
+template <SingleOpCode op, ByteWord mode, SourceMode s>
+static void
+threaded_single_op(MSP430& msp, uint16_t instruction, size_t& budget)
+{
+    unsigned reg = instruction & 0xf;
+
+    at_instruction(msp, msp.registers[PC] - 2, [&] {
+        if constexpr (op == PUSH) {
+            msp.registers[SP] -= 2;
+            auto value = threaded_location<mode, s>(msp, reg).template read<mode>(msp);
+            write_ram<mode>(msp, msp.registers[SP], value);
+        } else if constexpr (op == CALL) {
+            auto dest = threaded_location<mode, s>(msp, reg).template read<Word>(msp);
+            push(msp, msp.registers[PC]);
+            msp.registers[PC] = dest;
+        } else {
+            execute_decoded_single_op<mode>(msp, op, threaded_location<mode, s>(msp, reg));
+        }
+    });
+    DISPATCH_NEXT;
+}
+
+static void
+threaded_reti(MSP430& msp, uint16_t, size_t& budget)
+{
+    at_instruction(msp, msp.registers[PC] - 2, [&] { reti(msp); });
+    DISPATCH_NEXT;
+}
+
+template <Condition cond>
+static void
+threaded_conditional_op(MSP430& msp, uint16_t instruction, size_t& budget)
+{
+    auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+
+    if (is_condition(read_flags(msp), cond))
+        msp.registers[PC] += uint16_t(int16_t(op.offset)) << 1;
+    DISPATCH_NEXT;
+}
+
+// Conditional jumps back over at most one instruction
+template <Condition cond>
+static void
+threaded_tight_jump(MSP430& msp, uint16_t instruction, size_t& budget)
+{
+    auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+
+    if (is_condition(read_flags(msp), cond)) {
+        msp.registers[PC] += uint16_t(int16_t(op.offset)) << 1;
+        check_tight_loop(msp);
+    }
+    DISPATCH_NEXT;
+}
+
+// Encodings not specialised, including every invalid one, are decoded by the
+// reference engine which also reports their errors
+static void
+threaded_fallback(MSP430& msp, uint16_t, size_t& budget)
+{
+    msp.registers[PC] -= 2;
+    at_instruction(msp, msp.registers[PC], [&] { step_reference(msp); });
+    DISPATCH_NEXT;
+}
+
+// Handler selection
+
+template <DualOpCode op, ByteWord mode, SourceMode s, uint16_t value>
+static ThreadedHandler
+select_dual_op(DestMode d)
+{
+    switch (d) {
+        case dst_register: return threaded_dual_op<op, mode, s, value, dst_register>;
+        case dst_indexed:  return threaded_dual_op<op, mode, s, value, dst_indexed>;
+        case dst_symbolic: return threaded_dual_op<op, mode, s, value, dst_symbolic>;
+        case dst_absolute: return threaded_dual_op<op, mode, s, value, dst_absolute>;
+        case dst_unsupported: break;
+    }
+    return threaded_fallback;
+}
+
+template <DualOpCode op, ByteWord mode>
+static ThreadedHandler
+select_dual_op(SourceMode s, uint16_t value, DestMode d)
+{
+    switch (s) {
+        case src_register:      return select_dual_op<op, mode, src_register, 0>(d);
+        case src_indexed:       return select_dual_op<op, mode, src_indexed, 0>(d);
+        case src_symbolic:      return select_dual_op<op, mode, src_symbolic, 0>(d);
+        case src_absolute:      return select_dual_op<op, mode, src_absolute, 0>(d);
+        case src_indirect:      return select_dual_op<op, mode, src_indirect, 0>(d);
+        case src_autoincrement: return select_dual_op<op, mode, src_autoincrement, 0>(d);
+        case src_pop:           return select_dual_op<op, mode, src_pop, 0>(d);
+        case src_immediate:     return select_dual_op<op, mode, src_immediate, 0>(d);
+        case src_constant:
+            switch (value) {
+                case 0:      return select_dual_op<op, mode, src_constant, 0>(d);
+                case 1:      return select_dual_op<op, mode, src_constant, 1>(d);
+                case 2:      return select_dual_op<op, mode, src_constant, 2>(d);
+                case 4:      return select_dual_op<op, mode, src_constant, 4>(d);
+                case 8:      return select_dual_op<op, mode, src_constant, 8>(d);
+                case 0xffff: return select_dual_op<op, mode, src_constant, 0xffff>(d);
+            }
+            break;
+        case src_unsupported:
+            break;
+    }
+    return threaded_fallback;
+}
+
+template <ByteWord mode>
+static ThreadedHandler
+select_dual_op(DualOpCode op, SourceMode s, uint16_t value, DestMode d)
+{
+    switch (op) {
+        case MOV:   return select_dual_op<MOV, mode>(s, value, d);
+        case ADD:   return select_dual_op<ADD, mode>(s, value, d);
+        case ADDC:  return select_dual_op<ADDC, mode>(s, value, d);
+        case SUBC:  return select_dual_op<SUBC, mode>(s, value, d);
+        case SUB:   return select_dual_op<SUB, mode>(s, value, d);
+        case CMP:   return select_dual_op<CMP, mode>(s, value, d);
+        case DADD:  return select_dual_op<DADD, mode>(s, value, d);
+        case BIT:   return select_dual_op<BIT, mode>(s, value, d);
+        case BIC:   return select_dual_op<BIC, mode>(s, value, d);
+        case BIS:   return select_dual_op<BIS, mode>(s, value, d);
+        case XOR:   return select_dual_op<XOR, mode>(s, value, d);
+        case AND:   return select_dual_op<AND, mode>(s, value, d);
+        default:    return threaded_fallback;
+    }
+}
+
+template <SingleOpCode op, ByteWord mode>
+static ThreadedHandler
+select_single_op(SourceMode s)
+{
+    switch (s) {
+        case src_register:      return threaded_single_op<op, mode, src_register>;
+        case src_indexed:       return threaded_single_op<op, mode, src_indexed>;
+        case src_symbolic:      return threaded_single_op<op, mode, src_symbolic>;
+        case src_absolute:      return threaded_single_op<op, mode, src_absolute>;
+        case src_indirect:      return threaded_single_op<op, mode, src_indirect>;
+        case src_autoincrement: return threaded_single_op<op, mode, src_autoincrement>;
+        case src_pop:           return threaded_single_op<op, mode, src_pop>;
+        default:                return threaded_fallback;
+    }
+}
+
+template <ByteWord mode>
+static ThreadedHandler
+select_single_op(SingleOpCode op, SourceMode s)
+{
+    switch (op) {
+        case RRC:   return select_single_op<RRC, mode>(s);
+        case SWPB:  return select_single_op<SWPB, mode>(s);
+        case RRA:   return select_single_op<RRA, mode>(s);
+        case SXT:   return select_single_op<SXT, mode>(s);
+        case PUSH:  return select_single_op<PUSH, mode>(s);
+        case CALL:  return select_single_op<CALL, mode>(s);
+        default:    return threaded_fallback;
+    }
+}
+
+static SourceMode
+dual_source_mode(unsigned as, unsigned reg, uint16_t& value)
+{
+    static constexpr SourceMode general[4] = {
+        src_register, src_indexed, src_indirect, src_autoincrement
+    };
+    static constexpr uint16_t cg1[4] = { 0, 0, 4, 8 };
+    static constexpr uint16_t cg2[4] = { 0, 1, 2, 0xffff };
+
+    switch (reg) {
+        case PC: {
+            static constexpr SourceMode modes[4] = {
+                src_register, src_symbolic, src_indirect, src_immediate
+            };
+            return modes[as];
+        }
+        case SR: {
+            static constexpr SourceMode modes[4] = {
+                src_register, src_absolute, src_constant, src_constant
+            };
+            value = cg1[as];
+            return modes[as];
+        }
+        case CG:
+            value = cg2[as];
+            return src_constant;
+        case SP:
+            return as == 3 ? src_pop : general[as];
+    }
+    return general[as];
+}
+
+static DestMode
+dual_dest_mode(unsigned ad, unsigned reg)
+{
+    if (ad == 0)
+        return dst_register;
+
+    switch (reg) {
+        case PC: return dst_symbolic;
+        case SR: return dst_absolute;
+        case CG: return dst_unsupported;
+    }
+    return dst_indexed;
+}
+
+static SourceMode
+single_location_mode(unsigned as, unsigned reg)
+{
+    static constexpr SourceMode general[4] = {
+        src_register, src_indexed, src_indirect, src_autoincrement
+    };
+
+    if (as == 0)
+        return src_register;
+
+    switch (reg) {
+        case PC: {
+            static constexpr SourceMode modes[4] = {
+                src_register, src_symbolic, src_indirect, src_pop
+            };
+            return modes[as];
+        }
+        case SR:
+            return as == 1 ? src_absolute : src_unsupported;
+        case CG:
+            return src_unsupported;
+        case SP:
+            return as == 3 ? src_pop : general[as];
+    }
+    return general[as];
+}
+
+static ThreadedHandler
+select_handler(uint16_t instruction)
+{
+    static constexpr ThreadedHandler conditional[8] = {
+        threaded_conditional_op<not_equal>,
+        threaded_conditional_op<equal>,
+        threaded_conditional_op<no_carry>,
+        threaded_conditional_op<carry>,
+        threaded_conditional_op<negative>,
+        threaded_conditional_op<greater_equal>,
+        threaded_conditional_op<less>,
+        threaded_conditional_op<always>,
+    };
+    static constexpr ThreadedHandler tight_jump[8] = {
+        threaded_tight_jump<not_equal>,
+        threaded_tight_jump<equal>,
+        threaded_tight_jump<no_carry>,
+        threaded_tight_jump<carry>,
+        threaded_tight_jump<negative>,
+        threaded_tight_jump<greater_equal>,
+        threaded_tight_jump<less>,
+        threaded_tight_jump<always>,
+    };
+
+    switch (MSP430::classify(instruction)) {
+        case MSP430::invalid:
+            return threaded_fallback;
+
+        case MSP430::conditional: {
+            auto op = std::bit_cast<MSP430::ConditionalInsn>(instruction);
+            return is_tight_jump(op) ? tight_jump[op.condition] : conditional[op.condition];
+        }
+
+        case MSP430::single_operand: {
+            auto op = std::bit_cast<MSP430::SingleOpInsn>(instruction);
+            if (op.opcode == RETI)
+                return (instruction & 0x3f) ? threaded_fallback : threaded_reti;
+
+            // SR register operands need pending flags synced, see sync_flags
+            if (op.as == 0 && op.target == SR)
+                return threaded_fallback;
+
+            auto s = single_location_mode(op.as, op.target);
+            return op.bw
+                ? select_single_op<Byte>(SingleOpCode(op.opcode), s)
+                : select_single_op<Word>(SingleOpCode(op.opcode), s);
+        }
+
+        case MSP430::dual_operand: {
+            auto op = std::bit_cast<MSP430::DualOpInsn>(instruction);
+            if ((op.as == 0 && op.source == SR) || (op.ad == 0 && op.dest == SR))
+                return threaded_fallback;
+
+            uint16_t value = 0;
+            auto s = dual_source_mode(op.as, op.source, value);
+            auto d = dual_dest_mode(op.ad, op.dest);
+            return op.bw
+                ? select_dual_op<Byte>(DualOpCode(op.opcode), s, value, d)
+                : select_dual_op<Word>(DualOpCode(op.opcode), s, value, d);
+        }
+    }
+    unreachable();
+}
+
+static bool
+build_threaded_handlers()
+{
+    for (unsigned i=0; i<std::size(threaded_handlers); i++)
+        threaded_handlers[i] = select_handler(i);
+    return true;
+}
+
+#ifdef THREADED_MUSTTAIL
+
+void
+execute_threaded(MSP430& msp, size_t& count)
+{
+    static const bool ready = build_threaded_handlers();
+    (void)ready;
+
+    if (count == 0 || msp.stop_requested)
+        return;
+    auto instruction = read_pc_immediate(msp);
+    threaded_handlers[instruction](msp, instruction, count);
+}
+
+#else
+
+// Every distinct handler, numbered so the dispatch below can give each a
+// label: fallback, RETI, conditional jumps, tight jumps, then single and
+// dual operand handlers in the order of their template arguments
+
+static constexpr uint16_t CONSTANT_VALUES[6] = { 0, 1, 2, 4, 8, 0xffff };
+static constexpr unsigned SINGLE_FIRST = 18;
+static constexpr unsigned DUAL_FIRST = SINGLE_FIRST + 6 * 2 * 7;
+static constexpr unsigned HANDLER_COUNT = DUAL_FIRST + 12 * 2 * 14 * 4;
+
+template <unsigned n>
+static constexpr ThreadedHandler
+numbered_handler()
+{
+    if constexpr (n == 0) {
+        return threaded_fallback;
+    } else if constexpr (n == 1) {
+        return threaded_reti;
+    } else if constexpr (n < 10) {
+        return threaded_conditional_op<Condition(n - 2)>;
+    } else if constexpr (n < SINGLE_FIRST) {
+        return threaded_tight_jump<Condition(n - 10)>;
+    } else if constexpr (n < DUAL_FIRST) {
+        constexpr unsigned i = n - SINGLE_FIRST;
+        return threaded_single_op<SingleOpCode(i / 14), ByteWord(i / 7 % 2), SourceMode(i % 7)>;
+    } else {
+        // Sources are the 8 modes before src_constant, then each constant
+        constexpr unsigned i = n - DUAL_FIRST;
+        constexpr unsigned source = i / 4 % 14;
+        constexpr auto s = source < 8 ? SourceMode(source) : src_constant;
+        constexpr uint16_t value = source < 8 ? 0 : CONSTANT_VALUES[source - 8];
+        return threaded_dual_op<DualOpCode(MOV + i / 112), ByteWord(i / 56 % 2), s, value, DestMode(i % 4)>;
+    }
+}
+
+static constexpr auto NUMBERED_HANDLERS = []<unsigned... n>(std::integer_sequence<unsigned, n...>) {
+    return std::array{ numbered_handler<n>()... };
+}(std::make_integer_sequence<unsigned, HANDLER_COUNT>());
+
+// Fills targets with the label of each instruction word's handler, labels
+// holding one per handler number
+static bool
+build_threaded_targets(const void* const* labels, const void** targets)
+{
+    build_threaded_handlers();
+
+    std::unordered_map<ThreadedHandler, uint16_t> numbers;
+    for (unsigned n=0; n<HANDLER_COUNT; n++)
+        numbers[NUMBERED_HANDLERS[n]] = n;
+    for (unsigned i=0; i<std::size(threaded_handlers); i++)
+        targets[i] = labels[numbers.at(threaded_handlers[i])];
+    return true;
+}
+
+// Labels handler_<n in binary>, enough for 2048 handlers
+#define THREADED_BITS1(m, p) m(p##0) m(p##1)
+#define THREADED_BITS2(m, p) THREADED_BITS1(m, p##0) THREADED_BITS1(m, p##1)
+#define THREADED_BITS3(m, p) THREADED_BITS2(m, p##0) THREADED_BITS2(m, p##1)
+#define THREADED_BITS4(m, p) THREADED_BITS3(m, p##0) THREADED_BITS3(m, p##1)
+#define THREADED_BITS5(m, p) THREADED_BITS4(m, p##0) THREADED_BITS4(m, p##1)
+#define THREADED_BITS6(m, p) THREADED_BITS5(m, p##0) THREADED_BITS5(m, p##1)
+#define THREADED_BITS7(m, p) THREADED_BITS6(m, p##0) THREADED_BITS6(m, p##1)
+#define THREADED_BITS8(m, p) THREADED_BITS7(m, p##0) THREADED_BITS7(m, p##1)
+#define THREADED_BITS9(m, p) THREADED_BITS8(m, p##0) THREADED_BITS8(m, p##1)
+#define THREADED_BITS10(m, p) THREADED_BITS9(m, p##0) THREADED_BITS9(m, p##1)
+#define THREADED_BITS11(m, p) THREADED_BITS10(m, p##0) THREADED_BITS10(m, p##1)
+
+static_assert(HANDLER_COUNT <= 2048);
+
+#define THREADED_LABEL_ADDRESS(bits) &&handler_##bits,
+
+// A direct call to the handler, then the dispatch of the next instruction
+#define THREADED_LABEL(bits) \
+    handler_##bits: \
+    if constexpr (0b##bits < HANDLER_COUNT) { \
+        NUMBERED_HANDLERS[0b##bits](msp, instruction, count); \
+        if (--count == 0 || msp.stop_requested) \
+            return; \
+        instruction = read_pc_immediate(msp); \
+        goto *targets[instruction]; \
+    }
+
+void
+execute_threaded(MSP430& msp, size_t& count)
+{
+    static const void* const labels[] = { THREADED_BITS11(THREADED_LABEL_ADDRESS, ) };
+    static const void* targets[0x10000]; // Label of each instruction word
+    static const bool ready = build_threaded_targets(labels, targets);
+    (void)ready;
+
+    if (count == 0 || msp.stop_requested)
+        return;
+    auto instruction = read_pc_immediate(msp);
+    goto *targets[instruction];
+
+    THREADED_BITS11(THREADED_LABEL, );
+}
+
+#endif
@@ -0,0 +1,266 @@
+#include "trace.hpp"
+#include "msp430_impl.hpp"
+
+#include <algorithm>
+#include <inttypes.h>
+
+static constexpr char MAGIC[8] = { 'M', 'S', 'P', '4', '3', '0', 'T', '1' };
+
+static inline void
+put16(uint8_t*& p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p += 2;
+}
+
+// Recording
+
+Tracer::Tracer(const char* path, size_t buffer_bytes)
+{
+    out = fopen(path, "wb");
+    if (out == nullptr)
+        throw Error(strerror(errno));
+
+    size_t count = std::max<size_t>(2, buffer_bytes / CHUNK_BYTES);
+    for (size_t i=0; i<count; i++)
+        chunks.emplace_back(new uint8_t[CHUNK_BYTES]);
+    lengths.resize(count);
+
+    cursor = chunks[0].get();
+    end = cursor + CHUNK_BYTES;
+    memcpy(cursor, MAGIC, sizeof(MAGIC));
+    cursor += sizeof(MAGIC);
+
+    writer = std::thread(&Tracer::write_chunks, this);
+}
+
+Tracer::~Tracer()
+{
+    {
+        std::lock_guard guard(lock);
+        lengths[filled % chunks.size()] = cursor - chunks[filled % chunks.size()].get();
+        filled++;
+        done = true;
+    }
+    changed.notify_all();
+    writer.join();
+    fclose(out);
+}
+
+// Hands the current chunk to the writer, waiting for a free one
+void Tracer::next_chunk()
+{
+    std::unique_lock guard(lock);
+    lengths[filled % chunks.size()] = cursor - chunks[filled % chunks.size()].get();
+    filled++;
+    changed.notify_all();
+    changed.wait(guard, [&] { return filled - written < chunks.size(); });
+
+    cursor = chunks[filled % chunks.size()].get();
+    end = cursor + CHUNK_BYTES;
+}
+
+void Tracer::write_chunks()
+{
+    std::unique_lock guard(lock);
+    for (;;) {
+        changed.wait(guard, [&] { return written < filled || done; });
+        if (written == filled)
+            return;
+
+        auto index = written % chunks.size();
+        guard.unlock();
+        fwrite(chunks[index].get(), 1, lengths[index], out);
+        guard.lock();
+
+        written++;
+        changed.notify_all();
+    }
+}
+
+void Tracer::start(const MSP430& msp)
+{
+    accesses = 0;
+
+    uint16_t registers[16];
+    memcpy(registers, msp.registers, sizeof(registers));
+    registers[SR] = current_sr(msp);
+
+    if (synced && memcmp(registers, shadow, sizeof(shadow)) == 0)
+        return;
+
+    if (end - cursor < ptrdiff_t(MAX_RECORD)) [[unlikely]]
+        next_chunk();
+
+    *cursor++ = TAG_SYNC;
+    for (auto value : registers)
+        put16(cursor, value);
+    memcpy(shadow, registers, sizeof(shadow));
+    synced = true;
+}
+
+void Tracer::stop(MSP430::StopReason reason)
+{
+    if (end - cursor < ptrdiff_t(MAX_RECORD)) [[unlikely]]
+        next_chunk();
+
+    *cursor++ = TAG_STOP;
+    *cursor++ = uint8_t(reason);
+}
+
+void Tracer::record(const MSP430& msp, uint16_t pc, uint16_t opcode)
+{
+    if (end - cursor < ptrdiff_t(MAX_RECORD)) [[unlikely]]
+        next_chunk();
+
+    // Work on a local cursor, stores through it could alias any member
+    auto p = cursor;
+    auto tag = p++;
+    unsigned bits = 0;
+
+    uint16_t next = msp.registers[PC];
+    uint16_t step = next - pc;
+    if (step == 2 || step == 4 || step == 6) {
+        bits |= step / 2 - 1;
+    } else {
+        bits |= 3;
+        put16(p, next);
+    }
+    shadow[PC] = next;
+
+    if (opcodes[pc >> 1] != opcode) {
+        bits |= 4;
+        put16(p, opcode);
+        opcodes[pc >> 1] = opcode;
+    }
+
+    // An instruction only writes SP, SR and the registers named in its
+    // source and destination fields, so only those are compared
+    uint16_t sr = current_sr(msp);
+    unsigned candidates = (1u << SP | 1u << (opcode & 15) | 1u << (opcode >> 8 & 15)) & ~(1u << PC | 1u << SR);
+    unsigned changed = unsigned(sr != shadow[SR]) << SR;
+    for (; candidates; candidates &= candidates - 1) {
+        unsigned reg = __builtin_ctz(candidates);
+        changed |= unsigned(msp.registers[reg] != shadow[reg]) << reg;
+    }
+
+    bits |= __builtin_popcount(changed) << 3;
+    for (; changed; changed &= changed - 1) {
+        unsigned reg = __builtin_ctz(changed);
+        uint16_t value = reg == SR ? sr : msp.registers[reg];
+        int16_t delta = value - shadow[reg];
+        if (delta >= -7 && delta <= 7) {
+            *p++ = reg << 4 | (delta + 7);
+        } else {
+            *p++ = reg << 4 | 15;
+            put16(p, value);
+        }
+        shadow[reg] = value;
+    }
+
+    for (unsigned i=0; i<accesses; i++) {
+        auto& a = pending[i];
+        *p++ = a.write | a.byte << 1;
+        put16(p, a.address);
+        if (a.byte)
+            *p++ = a.value;
+        else
+            put16(p, a.value);
+    }
+    bits |= accesses << 6;
+    accesses = 0;
+
+    *tag = bits;
+    cursor = p;
+}
+
+void
+trace_access(MSP430& msp, bool write, ByteWord mode, uint16_t address, uint16_t value)
+{
+    msp.trace->access(write, mode == Byte, address, value);
+}
+
+// Decoding
+
+bool
+decode_trace(FILE* in, FILE* out)
+{
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        return false;
+
+    static constexpr const char* names[16] = {
+        "pc", "sp", "sr", "cg", "r4", "r5", "r6", "r7",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+
+    std::vector<uint16_t> opcodes(MSP430::RAM_SIZE / 2);
+    uint16_t registers[16] = {};
+    uint64_t count = 0;
+
+    bool truncated = false;
+    auto get8 = [&]() -> uint8_t {
+        int c = getc(in);
+        truncated |= c == EOF;
+        return c;
+    };
+    auto get16 = [&]() -> uint16_t {
+        uint16_t low = get8();
+        return low | get8() << 8;
+    };
+
+    for (int c; (c = getc(in)) != EOF;) {
+        uint8_t tag = c;
+
+        if (tag == Tracer::TAG_SYNC) {
+            for (auto& reg : registers)
+                reg = get16();
+            fprintf(out, "sync");
+            for (unsigned reg=0; reg<16; reg++)
+                fprintf(out, " %s=%04x", names[reg], registers[reg]);
+            fprintf(out, "\n");
+            continue;
+        }
+
+        if (tag == Tracer::TAG_STOP) {
+            fprintf(out, "stop %s\n", MSP430::stop_reason_name(MSP430::StopReason(get8())));
+            continue;
+        }
+
+        if ((tag & 0x38) == 0x38)
+            return false;
+
+        uint16_t pc = registers[PC];
+        if ((tag & 3) == 3)
+            registers[PC] = get16();
+        else
+            registers[PC] = pc + 2 * ((tag & 3) + 1);
+
+        if (tag & 4)
+            opcodes[pc >> 1] = get16();
+
+        fprintf(out, "%10" PRIu64 " %04x: %04x ", count++, pc, opcodes[pc >> 1]);
+
+        for (unsigned i=0; i<((tag >> 3) & 7u); i++) {
+            auto change = get8();
+            unsigned reg = change >> 4, d = change & 15;
+            registers[reg] = d == 15 ? get16() : registers[reg] + int(d) - 7;
+            fprintf(out, " %s=%04x", names[reg], registers[reg]);
+        }
+
+        for (unsigned i=0; i<unsigned(tag >> 6); i++) {
+            auto kind = get8();
+            auto address = get16();
+            bool byte = kind & 2;
+            uint16_t value = byte ? get8() : get16();
+            fprintf(out, byte ? " [%04x]%s%02x" : " [%04x]%s%04x", address, kind & 1 ? "<-" : "->", value);
+        }
+
+        fprintf(out, "\n");
+        if (truncated)
+            return false;
+    }
+
+    return not truncated;
+}
@@ -0,0 +1,80 @@
+#pragma once
+// Binary execution trace, see MSP430::trace
+//
+// The stream starts with the 8 bytes "MSP430T1", then has one record per
+// executed instruction:
+//
+//   tag         bits 0-1  next PC: +2, +4, +6, or 3 for a u16 after the tag
+//               bit 2     opcode u16 follows, else it is the last one seen at PC
+//               bits 3-5  changed registers other than PC
+//               bits 6-7  memory accesses
+//   registers   reg << 4 | d, where d < 15 adds d - 7 and 15 has a u16 value
+//   accesses    kind (bit 0 write, bit 1 byte), u16 address, u8 or u16 value
+//
+// Tags with 7 changed registers are special: 0x38 is a sync record holding
+// all 16 registers, written whenever the registers changed between runs, and
+// 0x39 a stop record holding a StopReason byte. Values are little-endian.
+
+#include "msp430.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+struct Tracer {
+    static constexpr size_t CHUNK_BYTES = 1 << 20;
+    static constexpr size_t MAX_RECORD = 64;
+    static constexpr uint8_t TAG_SYNC = 0x38, TAG_STOP = 0x39;
+
+    // Writes to path from a background thread. Records go to chunks of a
+    // ring of buffer_bytes, execution waits if the writer falls behind.
+    explicit Tracer(const char* path, size_t buffer_bytes = 64 << 20); // Throws on failure
+    ~Tracer(); // Flushes and waits for the writer
+
+    // Called by run() before executing and after it stops
+    void start(const MSP430& msp);
+    void stop(MSP430::StopReason reason);
+
+    // Called for each data access and then once the instruction completes
+    void access(bool write, bool byte, uint16_t address, uint16_t value) {
+        if (accesses < 3)
+            pending[accesses++] = { write, byte, address, value };
+    }
+    void record(const MSP430& msp, uint16_t pc, uint16_t opcode);
+
+    // Producer state
+    struct Access {
+        bool write, byte;
+        uint16_t address, value;
+    };
+
+    Access pending[3];
+    unsigned accesses = 0;
+    uint16_t shadow[16] = {};                   // Registers as of the last record
+    std::vector<uint16_t> opcodes = std::vector<uint16_t>(MSP430::RAM_SIZE / 2);
+    bool synced = false;
+    uint8_t* cursor = nullptr;
+    uint8_t* end = nullptr;
+
+    void next_chunk();
+
+    // Ring of chunks shared with the writer. Chunks [written, filled) are
+    // waiting to be written, counts only grow.
+    FILE* out;
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+    std::vector<size_t> lengths;
+    size_t filled = 0, written = 0;
+    bool done = false;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread writer;
+
+    void write_chunks();
+};
+
+// Writes the trace from in as text, one line per instruction. Returns false
+// if the stream is not a trace or is truncated.
+bool decode_trace(FILE* in, FILE* out);
@@ -0,0 +1,197 @@
+#include "uart.hpp"
+#include "msp430_impl.hpp"
+
+#include <optional>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+UartIo::UartIo(int in_fd, int out_fd)
+    : line_buffered(isatty(out_fd))
+    , in_fd(in_fd)
+    , out_fd(out_fd)
+{
+    event_fd = eventfd(0, EFD_CLOEXEC);
+    if (event_fd < 0)
+        throw Error(strerror(errno));
+    thread = std::thread(&UartIo::transfer, this);
+}
+
+UartIo::~UartIo()
+{
+    done = true;
+    wake();
+    thread.join();
+    close(event_fd);
+}
+
+void
+UartIo::connect(MSP430& msp)
+{
+    msp.uart_print = [this](char c) { print(c); };
+    msp.uart_read = [this] { return read(); };
+    msp.uart_status = [this] { return status(); };
+}
+
+// Guest side
+
+void
+UartIo::print(char c)
+{
+    while (not output.push(uint8_t(c))) {
+        // Full, wait for the I/O thread to make room
+        auto head = output.head.load();
+        request_flush();
+        if (output.size() == BUFFER_BYTES)
+            output.head.wait(head);
+    }
+
+    if (output.size() >= BUFFER_BYTES / 2 || (line_buffered && c == '\n'))
+        request_flush();
+    else if (waiting.load(std::memory_order_relaxed) == sleeping)
+        wake(); // Starts the flush timeout
+}
+
+char
+UartIo::read()
+{
+    uint8_t byte;
+    for (;;) {
+        auto changes = input_changes.load();
+        bool full = input.size() == BUFFER_BYTES;
+        if (input.pop(byte)) {
+            // The I/O thread stops reading while the ring is full
+            if (full)
+                wake();
+            return char(byte);
+        }
+        if (input_ended)
+            return char(-1);
+
+        // Shows any prompt before waiting
+        request_flush();
+        input_changes.wait(changes);
+    }
+}
+
+uint16_t
+UartIo::status() const
+{
+    uint16_t bits = 0;
+    if (input.size() || input_ended)
+        bits |= MSP430::UART_RX_READY;
+    if (output.size() < BUFFER_BYTES)
+        bits |= MSP430::UART_TX_READY;
+    return bits;
+}
+
+void
+UartIo::drain()
+{
+    for (;;) {
+        auto head = output.head.load();
+        if (head == output.tail.load())
+            return;
+        request_flush();
+        output.head.wait(head);
+    }
+}
+
+void
+UartIo::request_flush()
+{
+    flush = true;
+    wake();
+}
+
+void
+UartIo::wake()
+{
+    if (waiting.exchange(awake) != awake) {
+        uint64_t one = 1;
+        (void)!::write(event_fd, &one, sizeof(one));
+    }
+}
+
+// I/O thread
+
+void
+UartIo::write_output()
+{
+    for (;;) {
+        auto bytes = output.readable();
+        if (bytes.empty())
+            return;
+        auto written = ::write(out_fd, bytes.data(), bytes.size());
+        if (written < 0 && errno == EINTR)
+            continue;
+        // Output that can not be written is dropped, the guest never waits
+        // on a broken descriptor
+        output.consume(written < 0 ? bytes.size() : size_t(written));
+        output.head.notify_all();
+    }
+}
+
+void
+UartIo::read_input()
+{
+    auto space = input.writable();
+    auto count = ::read(in_fd, space.data(), space.size());
+    if (count < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (count > 0)
+        input.produce(count);
+    else
+        input_ended = true;
+    input_changes++;
+    input_changes.notify_all();
+}
+
+void
+UartIo::transfer()
+{
+    using Clock = std::chrono::steady_clock;
+    std::optional<Clock::time_point> flush_at; // Set while output waits
+
+    for (;;) {
+        bool finishing = done;
+        auto now = Clock::now();
+        if (flush.exchange(false) || finishing || output.size() >= BUFFER_BYTES / 2
+            || (flush_at && now >= *flush_at)) {
+            write_output();
+            flush_at.reset();
+        }
+        if (finishing)
+            return;
+
+        // Published before checking for work, so a wake() after the checks
+        // ends the poll
+        waiting = sleeping;
+        int timeout = -1;
+        if (output.size()) {
+            waiting = napping;
+            if (not flush_at)
+                flush_at = now + FLUSH_INTERVAL;
+            timeout = std::chrono::ceil<std::chrono::milliseconds>(*flush_at - now).count();
+        }
+        bool want_input = not input_ended && input.size() < BUFFER_BYTES;
+        if (done || flush || output.size() >= BUFFER_BYTES / 2) {
+            waiting = awake;
+            continue;
+        }
+
+        pollfd fds[2] = {
+            { event_fd, POLLIN, 0 },
+            { want_input ? in_fd : -1, POLLIN, 0 },
+        };
+        poll(fds, 2, timeout);
+        waiting = awake;
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            (void)!::read(event_fd, &count, sizeof(count));
+        }
+        if (fds[1].revents)
+            read_input();
+    }
+}
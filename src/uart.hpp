@@ -0,0 +1,110 @@
+#pragma once
+// UART connected to host file descriptors
+//
+// The guest side only touches lock-free rings, an I/O thread moves their
+// bytes with large reads and writes. Output is written when the ring is half
+// full, at newlines when it goes to a terminal, before waiting for input, and
+// otherwise within FLUSH_INTERVAL. Printing waits while the output ring is
+// full, and input is not read while its ring is full.
+
+#include "msp430.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <span>
+#include <thread>
+
+// Bytes from one producer thread to one consumer thread. Positions only grow,
+// each is written by its own side.
+template <size_t SIZE>
+struct ByteRing {
+    static_assert((SIZE & (SIZE - 1)) == 0);
+
+    alignas(64) std::atomic<uint64_t> head = 0; // Consumed up to
+    alignas(64) std::atomic<uint64_t> tail = 0; // Produced up to
+    uint8_t bytes[SIZE];
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    // Producer side
+    bool push(uint8_t byte) {
+        auto position = tail.load(std::memory_order_relaxed);
+        if (position - head.load(std::memory_order_acquire) == SIZE)
+            return false;
+        bytes[position % SIZE] = byte;
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Free space up to the end of the array
+    std::span<uint8_t> writable() {
+        auto position = tail.load(std::memory_order_relaxed);
+        auto free = SIZE - (position - head.load(std::memory_order_acquire));
+        return { &bytes[position % SIZE], std::min(free, SIZE - position % SIZE) };
+    }
+
+    void produce(size_t count) {
+        tail.fetch_add(count, std::memory_order_release);
+    }
+
+    // Consumer side
+    bool pop(uint8_t& byte) {
+        auto position = head.load(std::memory_order_relaxed);
+        if (position == tail.load(std::memory_order_acquire))
+            return false;
+        byte = bytes[position % SIZE];
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Bytes up to the end of the array
+    std::span<const uint8_t> readable() const {
+        auto position = head.load(std::memory_order_relaxed);
+        auto used = tail.load(std::memory_order_acquire) - position;
+        return { &bytes[position % SIZE], std::min<size_t>(used, SIZE - position % SIZE) };
+    }
+
+    void consume(size_t count) {
+        head.fetch_add(count, std::memory_order_release);
+    }
+};
+
+struct UartIo {
+    static constexpr size_t BUFFER_BYTES = 1 << 16;
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+    // Reads in_fd and writes out_fd, leaving both open. Throws on failure.
+    UartIo(int in_fd, int out_fd);
+    ~UartIo(); // Writes all output and waits for the I/O thread
+
+    // For uart_print, uart_read and uart_status. Reads wait for input, and
+    // give -1 once it has ended.
+    void connect(MSP430& msp);
+    void print(char c);
+    char read();
+    uint16_t status() const;
+
+    // Waits until all output is written
+    void drain();
+
+    // I/O thread state, waiting is set while it polls and cleared by wake()
+    enum Waiting : uint8_t { awake, napping, sleeping };
+
+    ByteRing<BUFFER_BYTES> input, output;
+    std::atomic<uint32_t> input_changes = 0; // Bytes arrived or input ended
+    std::atomic<bool> input_ended = false;
+    std::atomic<bool> flush = false; // Write output now, not at the timeout
+    std::atomic<bool> done = false;
+    std::atomic<uint8_t> waiting = awake;
+    bool line_buffered;
+    int in_fd, out_fd, event_fd;
+    std::thread thread;
+
+    void wake();
+    void request_flush();
+    void write_output();
+    void read_input();
+    void transfer();
+};
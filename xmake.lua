@@ -11,15 +11,44 @@ target("termbox2")
 
 target("msp430emu-cli")
 	set_kind("binary")
-	add_files("src/main_cli.cpp", "src/msp430.cpp")
+	add_files("src/main_cli.cpp", "src/uart.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
 
 target("msp430emu-tui")
 	set_kind("binary")
-	add_files("src/main_tui.cpp", "src/msp430.cpp")
+	add_files("src/main_tui.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
 	add_deps("termbox2")
 
+target("msp430emu-fleet")
+	set_kind("binary")
+	add_files("src/main_fleet.cpp", "src/fleet.cpp", "src/lockstep.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
+
+target("msp430emu-fuzz")
+	set_kind("binary")
+	add_files("src/main_fuzz.cpp", "src/fuzz.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
+
+target("msp430emu-trace")
+	set_kind("binary")
+	add_files("src/main_trace.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
+
+target("msp430emu-gdb")
+	set_kind("binary")
+	add_files("src/main_gdb.cpp", "src/gdb.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_syslinks("pthread")
+
+target("msp430emu-bench")
+	set_kind("binary")
+	add_files("src/main_bench.cpp", "src/msp430.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp")
+	add_cxflags("-O2")
+	add_syslinks("pthread")
+
 target("test-msp430")
 	set_kind("binary")
 	add_defines("MSP430TEST")
-	add_files("src/msp430.cpp")
+	add_files("src/msp430.cpp", "src/fleet.cpp", "src/fuzz.cpp", "src/lockstep.cpp", "src/uart.cpp", "src/threaded.cpp", "src/jit.cpp", "src/devices.cpp", "src/snapshot.cpp", "src/profile.cpp", "src/loader.cpp", "src/trace.cpp", "src/history.cpp", "src/msp430x.cpp", "src/gdb.cpp")
+	add_syslinks("pthread")
 	set_group("test")